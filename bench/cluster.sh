@@ -0,0 +1,95 @@
+# Throwaway cluster for the benchmark scripts; sourced, not run.
+#
+# Expects BENCH_DIR and sets up a temporary cluster on $PORT whose
+# directory is removed on exit. start_server loads the given library
+# from the build tree through dynamic_library_path, so nothing has to be
+# installed; SERVER_OPTS adds server options.
+
+REPO_DIR="$(dirname "$BENCH_DIR")"
+
+PG_CONFIG="${PG_CONFIG:-pg_config}"
+BINDIR="$("$PG_CONFIG" --bindir)"
+SCALE="${BENCH_SCALE:-10}"
+PORT="${BENCH_PORT:-54329}"
+OUT="${BENCH_OUT:-$BENCH_DIR/results}"
+
+WORK="$(mktemp -d "${TMPDIR:-/tmp}/pg_trace_bench.XXXXXX")"
+PGDATA_DIR="$WORK/data"
+TRACE_DIR="$WORK/traces"
+
+export PGHOST="$WORK"
+export PGPORT="$PORT"
+export PGDATABASE=postgres
+export PGUSER=postgres
+
+cleanup() {
+    "$BINDIR/pg_ctl" -D "$PGDATA_DIR" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+start_server() {
+    local lib="$1"
+
+    "$BINDIR/pg_ctl" -D "$PGDATA_DIR" -l "$WORK/server.log" -w start -o "\
+        -p $PORT -k $WORK -c listen_addresses='' \
+        -c dynamic_library_path='$REPO_DIR:$REPO_DIR/src:\$libdir' \
+        -c shared_preload_libraries='$lib' \
+        -c pg_trace.output_directory='$TRACE_DIR' \
+        -c track_io_timing=on -c max_connections=200 \
+        -c shared_buffers=256MB -c synchronous_commit=off \
+        $SERVER_OPTS" >/dev/null
+}
+
+stop_server() {
+    "$BINDIR/pg_ctl" -D "$PGDATA_DIR" -m fast -w stop >/dev/null
+}
+
+# initdb, pgbench -i and the tables of bench/setup.sql
+init_cluster() {
+    mkdir -p "$OUT" "$TRACE_DIR"
+    "$BINDIR/initdb" -D "$PGDATA_DIR" -A trust -U postgres >/dev/null
+
+    start_server ""
+    "$BINDIR/pgbench" -i -q -s "$SCALE" >/dev/null 2>&1
+    "$BINDIR/psql" -q -v ON_ERROR_STOP=1 -f "$BENCH_DIR/setup.sql" >/dev/null
+    stop_server
+}
+
+# bench_trace_start(): pg_trace_start_trace() of lib, or a no-op without one
+create_trace_start() {
+    local lib="$1"
+
+    if [ -n "$lib" ]; then
+        "$BINDIR/psql" -q -v ON_ERROR_STOP=1 -c "
+            CREATE OR REPLACE FUNCTION bench_trace_start() RETURNS text
+            AS '$lib', 'pg_trace_start_trace' LANGUAGE C;" >/dev/null
+    else
+        "$BINDIR/psql" -q -v ON_ERROR_STOP=1 -c "
+            CREATE OR REPLACE FUNCTION bench_trace_start() RETURNS text
+            AS 'SELECT NULL::text' LANGUAGE sql;" >/dev/null
+    fi
+}
+
+# Script that starts tracing in the first transaction of each client
+# (pgbench -D started=0), then runs bench/scripts/<name>.sql
+traced_script() {
+    local script="$1"
+
+    {
+        echo "\\if :started = 0"
+        echo "SELECT bench_trace_start();"
+        echo "\\set started 1"
+        echo "\\endif"
+        cat "$BENCH_DIR/scripts/$script.sql"
+    } > "$WORK/$script.sql"
+    echo "$WORK/$script.sql"
+}
+
+# Percentile of the latency column (usec) of pgbench -l logs, in ms
+percentile() {
+    sort -n "$1" | awk -v p="$2" '{ v[NR] = $1 } END {
+        if (NR == 0) { print 0; exit }
+        i = int(NR * p / 100 + 0.5); if (i < 1) i = 1; if (i > NR) i = NR;
+        printf "%.3f", v[i] / 1000 }'
+}
@@ -0,0 +1,114 @@
+#!/bin/bash
+# Tracing overhead benchmark: pgbench against a throwaway cluster with
+# tracing off and with each extension variant.
+#
+# Usage: bench/run_bench.sh            (normally via: make bench)
+#
+# Environment:
+#   PG_CONFIG        pg_config of the server to use     (pg_config)
+#   BENCH_VARIANTS   off mvp enhanced ultimate
+#   BENCH_SCRIPTS    scripts in bench/scripts            (all)
+#   BENCH_CLIENTS    client counts                       (1 4 16)
+#   BENCH_DURATION   seconds per run                     (30)
+#   BENCH_SCALE      pgbench scale factor                (10)
+#   BENCH_PORT       port of the temporary cluster       (54329)
+#   BENCH_OUT        results directory                   (bench/results)
+#
+# Every session starts tracing once, in its first transaction, so the
+# runs measure traced statements, not pg_trace_start_trace(). With
+# "off" the same first-transaction call goes to an empty SQL function.
+#
+# Results: $BENCH_OUT/results.csv, one row per variant/script/clients:
+#   variant,script,clients,duration_s,transactions,tps,lat_avg_ms,
+#   lat_p50_ms,lat_p99_ms,trace_bytes,trace_bytes_per_s
+
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+VARIANTS="${BENCH_VARIANTS:-off mvp enhanced ultimate}"
+SCRIPTS="${BENCH_SCRIPTS:-$(cd "$BENCH_DIR/scripts" && ls *.sql | sed 's/\.sql$//' | tr '\n' ' ')}"
+CLIENTS="${BENCH_CLIENTS:-1 4 16}"
+DURATION="${BENCH_DURATION:-30}"
+
+. "$BENCH_DIR/cluster.sh"
+
+RESULTS="$OUT/results.csv"
+
+# Library of each variant
+library() {
+    case "$1" in
+        mvp)      echo pg_trace_mvp ;;
+        enhanced) echo pg_trace_enhanced ;;
+        ultimate) echo pg_trace_ultimate ;;
+        off)      echo "" ;;
+        *)        echo "unknown variant: $1" >&2; exit 1 ;;
+    esac
+}
+
+echo "pg_trace benchmark: $("$BINDIR/postgres" --version)"
+echo "  variants: $VARIANTS"
+echo "  scripts:  $SCRIPTS"
+echo "  clients:  $CLIENTS, ${DURATION}s per run, scale $SCALE"
+echo "  work dir: $WORK"
+echo ""
+
+init_cluster
+
+echo "variant,script,clients,duration_s,transactions,tps,lat_avg_ms,lat_p50_ms,lat_p99_ms,trace_bytes,trace_bytes_per_s" > "$RESULTS"
+
+for variant in $VARIANTS; do
+    lib="$(library "$variant")"
+    start_server "$lib"
+
+    create_trace_start "$lib"
+
+    for script in $SCRIPTS; do
+        script_file="$(traced_script "$script")"
+
+        for clients in $CLIENTS; do
+            rm -f "$TRACE_DIR"/* "$WORK"/pgbench_log.*
+
+            output="$(cd "$WORK" && PGOPTIONS="-c client_min_messages=warning" \
+                "$BINDIR/pgbench" -n -c "$clients" -j "$clients" -T "$DURATION" \
+                -s "$SCALE" -D started=0 -l --log-prefix=pgbench_log \
+                -f "$script_file" 2>&1)" || {
+                echo "$output" >&2
+                echo "pgbench failed: $variant $script $clients clients" >&2
+                exit 1
+            }
+
+            txns="$(echo "$output" | sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p')"
+            tps="$(echo "$output" | sed -n 's/^tps = \([0-9.]*\) (without initial connection time)/\1/p')"
+            lat_avg="$(echo "$output" | sed -n 's/^latency average = \([0-9.]*\) ms/\1/p')"
+
+            cat "$WORK"/pgbench_log.* | awk '{ print $3 }' > "$WORK/latencies"
+            p50="$(percentile "$WORK/latencies" 50)"
+            p99="$(percentile "$WORK/latencies" 99)"
+
+            trace_bytes="$(cat "$TRACE_DIR"/* 2>/dev/null | wc -c)"
+            trace_rate="$(awk -v b="$trace_bytes" -v d="$DURATION" 'BEGIN { printf "%.0f", b / d }')"
+
+            echo "$variant,$script,$clients,$DURATION,$txns,$tps,$lat_avg,$p50,$p99,$trace_bytes,$trace_rate" >> "$RESULTS"
+            printf "  %-9s %-13s %3d clients: %10s tps  p50 %8s ms  p99 %8s ms  trace %12s B/s\n" \
+                "$variant" "$script" "$clients" "$tps" "$p50" "$p99" "$trace_rate"
+        done
+    done
+
+    stop_server
+done
+
+# Overhead against the untraced runs
+echo ""
+echo "Overhead (TPS loss against off):"
+awk -F, 'NR > 1 { tps[$1 "," $2 "," $3] = $6; keys[NR] = $1 "," $2 "," $3 }
+    END {
+        for (n in keys) {
+            split(keys[n], k, ",");
+            base = tps["off," k[2] "," k[3]];
+            if (k[1] != "off" && base > 0)
+                printf "  %-9s %-13s %3d clients: %6.1f%%\n", k[1], k[2], k[3], (1 - tps[keys[n]] / base) * 100;
+        }
+    }' "$RESULTS" | sort
+
+echo ""
+echo "Results: $RESULTS"
@@ -0,0 +1,145 @@
+#!/bin/bash
+# Connection-scaling benchmark of the tracing shared-memory paths: ramps
+# traced pgbench clients and measures, at each step, what tracing costs
+# per query and how long sessions wait on the pg_trace LWLock tranches.
+#
+# Usage: bench/run_scaling.sh          (normally via: make bench-scaling)
+#
+# Environment:
+#   PG_CONFIG        pg_config of the server to use     (pg_config)
+#   BENCH_SCRIPT     script in bench/scripts             (select_only)
+#   BENCH_CLIENTS    client counts          (1 2 4 8 16 32 64 128 256 512)
+#   BENCH_DURATION   seconds per step                    (20)
+#   BENCH_SCALE      pgbench scale factor                (10)
+#   BENCH_PORT       port of the temporary cluster       (54329)
+#   BENCH_OUT        results directory                   (bench/results)
+#
+# Every step runs twice: on a server without pg_trace, and with
+# pg_trace_ultimate loaded and every client traced. Tracing cost per query
+# is the difference in mean latency divided by the queries per transaction.
+#
+# LWLock waits come from the extension's own active session history,
+# sampled every 10 ms: each sample of a session waiting on a pg_trace*
+# tranche (pg_trace_ash, pg_trace_dsa, pg_trace_hash) counts 10 ms of
+# wait, which is divided over the queries run in the step.
+#
+# Results: $BENCH_OUT/scaling.csv, one row per client count:
+#   script,clients,base_tps,traced_tps,base_lat_ms,traced_lat_ms,
+#   trace_us_per_query,lwlock_samples,lwlock_wait_ms,lwlock_us_per_query,
+#   tranches (name:samples;...)
+
+set -e
+
+BENCH_DIR="$(cd "$(dirname "$0")" && pwd)"
+SCRIPT="${BENCH_SCRIPT:-select_only}"
+CLIENTS="${BENCH_CLIENTS:-1 2 4 8 16 32 64 128 256 512}"
+DURATION="${BENCH_DURATION:-20}"
+ASH_INTERVAL_MS=10
+
+. "$BENCH_DIR/cluster.sh"
+
+RESULTS="$OUT/scaling.csv"
+THREADS="$(nproc 2>/dev/null || echo 4)"
+MAX_CLIENTS="$(echo $CLIENTS | tr ' ' '\n' | sort -n | tail -1)"
+SERVER_OPTS="-c max_connections=$((MAX_CLIENTS + 20)) -c pg_trace.ash_interval_ms=$ASH_INTERVAL_MS"
+
+# SQL statements per transaction: lines that are not meta-commands or comments
+QUERIES_PER_TXN="$(grep -cv '^\s*\(\\\|--\|$\)' "$BENCH_DIR/scripts/$SCRIPT.sql")"
+
+# Runs one step; sets txns, tps and lat_avg
+run_step() {
+    local clients="$1"
+    local jobs=$(( clients < THREADS ? clients : THREADS ))
+    local output
+
+    rm -f "$TRACE_DIR"/*
+    output="$(cd "$WORK" && PGOPTIONS="-c client_min_messages=warning" \
+        "$BINDIR/pgbench" -n -c "$clients" -j "$jobs" -T "$DURATION" \
+        -s "$SCALE" -D started=0 -f "$script_file" 2>&1)" || {
+        echo "$output" >&2
+        echo "pgbench failed: $clients clients" >&2
+        exit 1
+    }
+
+    txns="$(echo "$output" | sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p')"
+    tps="$(echo "$output" | sed -n 's/^tps = \([0-9.]*\) (without initial connection time)/\1/p')"
+    lat_avg="$(echo "$output" | sed -n 's/^latency average = \([0-9.]*\) ms/\1/p')"
+}
+
+echo "pg_trace scaling benchmark: $("$BINDIR/postgres" --version)"
+echo "  script:   $SCRIPT ($QUERIES_PER_TXN queries per transaction)"
+echo "  clients:  $CLIENTS, ${DURATION}s per step, scale $SCALE"
+echo "  work dir: $WORK"
+echo ""
+
+init_cluster
+script_file="$(traced_script "$SCRIPT")"
+
+# Baseline: no pg_trace at all
+start_server ""
+create_trace_start ""
+for clients in $CLIENTS; do
+    run_step "$clients"
+    base_tps[$clients]="$tps"
+    base_lat[$clients]="$lat_avg"
+    printf "  base    %3d clients: %10s tps  %8s ms\n" "$clients" "$tps" "$lat_avg"
+done
+stop_server
+
+start_server pg_trace_ultimate
+create_trace_start pg_trace_ultimate
+"$BINDIR/psql" -q -v ON_ERROR_STOP=1 -c "
+    CREATE OR REPLACE FUNCTION bench_ash(timestamptz, timestamptz,
+        OUT sample_time timestamptz, OUT pid integer, OUT datid oid,
+        OUT roleid oid, OUT state text, OUT wait_event_type text,
+        OUT wait_event text, OUT sql_id bigint, OUT blocking_pid integer)
+    RETURNS SETOF record
+    AS 'pg_trace_ultimate', 'pg_trace_ash_history' LANGUAGE C STRICT;" >/dev/null
+
+echo "script,clients,base_tps,traced_tps,base_lat_ms,traced_lat_ms,trace_us_per_query,lwlock_samples,lwlock_wait_ms,lwlock_us_per_query,tranches" > "$RESULTS"
+
+for clients in $CLIENTS; do
+    from="$("$BINDIR/psql" -Atc "SELECT now()")"
+    run_step "$clients"
+    to="$("$BINDIR/psql" -Atc "SELECT now()")"
+
+    # Let the sampler take its last samples of the step
+    sleep 1
+
+    tranches="$("$BINDIR/psql" -Atc "
+        SELECT coalesce(string_agg(wait_event || ':' || n, ';' ORDER BY n DESC), '')
+        FROM (SELECT wait_event, count(*) AS n
+              FROM bench_ash('$from', '$to')
+              WHERE wait_event_type = 'LWLock' AND wait_event LIKE 'pg_trace%'
+              GROUP BY wait_event) t")"
+    samples="$(echo "$tranches" | tr ';' '\n' | awk -F: '{ n += $2 } END { print n + 0 }')"
+
+    read -r trace_us lwlock_ms lwlock_us <<< "$(awk \
+        -v bl="${base_lat[$clients]}" -v tl="$lat_avg" -v q="$QUERIES_PER_TXN" \
+        -v s="$samples" -v iv="$ASH_INTERVAL_MS" -v t="$txns" 'BEGIN {
+            queries = t * q;
+            printf "%.2f %.1f %.3f\n", (tl - bl) * 1000 / q, s * iv,
+                   queries > 0 ? s * iv * 1000 / queries : 0 }')"
+
+    echo "$SCRIPT,$clients,${base_tps[$clients]},$tps,${base_lat[$clients]},$lat_avg,$trace_us,$samples,$lwlock_ms,$lwlock_us,$tranches" >> "$RESULTS"
+    printf "  traced  %3d clients: %10s tps  %8s ms  trace %8s us/query  pg_trace LWLock %8s ms (%s us/query)\n" \
+        "$clients" "$tps" "$lat_avg" "$trace_us" "$lwlock_ms" "$lwlock_us"
+done
+
+stop_server
+
+# Scaling curve: tracing cost per query against clients
+echo ""
+echo "Tracing cost per query (us), by clients:"
+awk -F, 'NR > 1 { c[NR] = $2; v[NR] = $7; w[NR] = $10; if ($7 > max) max = $7 }
+    END {
+        for (i = 2; i <= NR; i++) {
+            bar = max > 0 ? int(v[i] / max * 50 + 0.5) : 0;
+            line = "";
+            for (j = 0; j < bar; j++) line = line "#";
+            printf "  %4d %-50s %8.2f  (LWLock %.3f)\n", c[i], line, v[i], w[i];
+        }
+    }' "$RESULTS"
+
+echo ""
+echo "Results: $RESULTS"
@@ -0,0 +1,7 @@
+-- Nested loop and hash joins over a few thousand rows
+\set region random(0, 49)
+SELECT c.region, count(*), sum(o.amount)
+FROM bench_customers c
+JOIN bench_orders o ON o.customer_id = c.customer_id
+WHERE c.region = :region AND o.order_date >= date '2024-06-01'
+GROUP BY c.region;
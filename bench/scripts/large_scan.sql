@@ -0,0 +1,3 @@
+-- Full scans: per-block and per-row instrumentation dominates
+\set day random(0, 364)
+SELECT count(*), avg(amount) FROM bench_orders WHERE order_date = date '2024-01-01' + :day;
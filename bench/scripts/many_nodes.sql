@@ -0,0 +1,15 @@
+-- Deep plan: per-node instrumentation and plan tree output dominate
+\set cid random(1, 99000)
+SELECT o.order_id, c.name, count(i.item_id)
+FROM bench_orders o
+JOIN bench_customers c ON c.customer_id = o.customer_id
+LEFT JOIN bench_items i ON i.order_id = o.order_id
+WHERE o.customer_id BETWEEN :cid AND :cid + 20
+GROUP BY o.order_id, c.name
+UNION ALL
+SELECT o.order_id, c.name, 0
+FROM bench_orders o
+JOIN bench_customers c ON c.customer_id = o.customer_id
+WHERE o.order_id IN (SELECT order_id FROM bench_items WHERE product_id = :cid % 500 LIMIT 5)
+ORDER BY 1
+LIMIT 50;
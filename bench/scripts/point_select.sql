@@ -0,0 +1,4 @@
+-- Index lookups: per-statement overhead dominates
+\set cid random(1, 100000)
+SELECT name, region FROM bench_customers WHERE customer_id = :cid;
+SELECT count(*), sum(amount) FROM bench_orders WHERE customer_id = :cid;
@@ -0,0 +1,3 @@
+-- pgbench built-in select-only
+\set aid random(1, 100000 * :scale)
+SELECT abalance FROM pgbench_accounts WHERE aid = :aid;
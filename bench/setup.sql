@@ -0,0 +1,23 @@
+-- Tables for the custom bench scripts, on top of pgbench -i
+-- (pgbench_accounts has 100000 rows per scale unit)
+
+DROP TABLE IF EXISTS bench_orders, bench_customers, bench_items;
+
+CREATE TABLE bench_customers AS
+SELECT i AS customer_id, 'customer ' || i AS name, i % 50 AS region
+FROM generate_series(1, 100000) i;
+ALTER TABLE bench_customers ADD PRIMARY KEY (customer_id);
+
+CREATE TABLE bench_orders AS
+SELECT i AS order_id, 1 + (i * 7919) % 100000 AS customer_id,
+       (i % 1000) / 10.0 AS amount, date '2024-01-01' + i % 365 AS order_date
+FROM generate_series(1, 1000000) i;
+ALTER TABLE bench_orders ADD PRIMARY KEY (order_id);
+CREATE INDEX ON bench_orders (customer_id);
+
+CREATE TABLE bench_items AS
+SELECT i AS item_id, 1 + i % 1000000 AS order_id, i % 500 AS product_id
+FROM generate_series(1, 2000000) i;
+CREATE INDEX ON bench_items (order_id);
+
+VACUUM ANALYZE bench_customers, bench_orders, bench_items;
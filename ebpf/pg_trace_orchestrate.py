@@ -14,46 +14,34 @@ import subprocess
 import sys
 import os
 import time
+import shutil
 import signal
-import threading
 from pathlib import Path
 
-def tail_trace_file(trace_file, output_file):
-    """Tail the trace file from extension"""
-    try:
-        with open(trace_file, 'r') as tf:
-            # Seek to end initially
-            tf.seek(0, 2)
-            
-            while True:
-                line = tf.readline()
-                if line:
-                    output_file.write(line)
-                    output_file.flush()
-                else:
-                    time.sleep(0.1)
-    except Exception as e:
-        print(f"Error tailing trace file: {e}", file=sys.stderr)
+def find_merger():
+    """Locate the native pg_trace_merge tool (make tools)"""
+    local = Path(__file__).resolve().parent.parent / 'tools' / 'pg_trace_merge'
+    if local.exists():
+        return str(local)
+    return shutil.which('pg_trace_merge')
 
 def merge_traces(extension_file, wait_file, output_file):
-    """Merge extension trace with wait events"""
+    """Interleave wait events into the extension trace by tim="""
     print(f"Merging traces into: {output_file}")
-    
-    with open(output_file, 'w') as out:
-        # Write extension trace
-        if os.path.exists(extension_file):
-            with open(extension_file, 'r') as ef:
-                out.write(ef.read())
-        
-        # Append wait events
-        if os.path.exists(wait_file):
-            out.write("\n" + "="*70 + "\n")
-            out.write("WAIT EVENTS (from eBPF)\n")
-            out.write("="*70 + "\n\n")
-            with open(wait_file, 'r') as wf:
-                out.write(wf.read())
-    
+
+    merger = find_merger()
+    if not merger:
+        print("Error: pg_trace_merge not found; build it with 'make tools'", file=sys.stderr)
+        print(f"Unmerged inputs kept: {extension_file} {wait_file}", file=sys.stderr)
+        return False
+
+    if not os.path.exists(wait_file):
+        open(wait_file, 'w').close()
+
+    subprocess.run([merger, '-o', output_file, extension_file, wait_file], check=True)
+
     print(f"Trace complete: {output_file}")
+    return True
 
 def main():
     parser = argparse.ArgumentParser(description='Orchestrate pg_trace with eBPF')
@@ -130,10 +118,10 @@ def main():
 
     # Merge traces
     print("\nMerging trace files...")
-    merge_traces(args.trace_file, wait_file, output_file)
+    merged = merge_traces(args.trace_file, wait_file, output_file)
     
     # Cleanup
-    if os.path.exists(wait_file):
+    if merged and os.path.exists(wait_file):
         os.remove(wait_file)
 
 if __name__ == '__main__':
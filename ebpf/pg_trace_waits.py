@@ -7,20 +7,32 @@ It integrates with the pg_trace extension to provide Oracle 10046-style
 wait event logging.
 
 Requirements:
-    - Linux kernel 4.9+
+    - Linux kernel 4.9+ (5.8+ for --aggregate, which uses a BPF ring buffer)
     - BCC (BPF Compiler Collection)
     - Root privileges or CAP_BPF capability
 
 Usage:
     sudo python3 pg_trace_waits.py -p <postgres_pid>
+    sudo python3 pg_trace_waits.py --aggregate [-p <pid>] [-i <sec>] [-t <us>]
+
+By default every wait is sent to user space. With --aggregate, counts and
+log2 duration histograms per (pid, cursor, wait event) are kept in a BPF
+map and drained every --interval seconds; only waits longer than --threshold
+are sent as events. This keeps tracing all backends of a busy server cheap.
+
+Waits are attributed to the traced cursor running at the time, taken from
+the extension's exec_start/exec_done USDT probes (pg_trace_probes.h) in
+--library. Without probes, or outside a traced statement, waits are
+reported per PID.
 """
 
 from bcc import BPF
 import argparse
 import sys
 import ctypes
+import os
+import subprocess
 import time
-from datetime import datetime
 
 # eBPF program
 bpf_program = """
@@ -34,26 +46,67 @@ struct wait_event_t {
     u64 cursor_id;
     u32 wait_event_info;
     u64 duration_ns;
-    char wait_name[64];
+};
+
+// Wait in progress on a thread
+struct wait_start_t {
+    u64 ts;
+    u32 wait_event_info;
 };
 
 // Hash map to track wait start times
-BPF_HASH(wait_starts, u32, u64);
+BPF_HASH(wait_starts, u32, struct wait_start_t);
 
-// Hash map to lookup cursor_id from PID (populated by extension)
-BPF_HASH(pid_to_cursor, u32, u64);
+// Traced cursors executing in a backend, innermost last, from the
+// exec_start/exec_done USDT probes. Deeper nesting than MAX_NESTING is
+// counted but attributed to the deepest cursor kept.
+#define MAX_NESTING 8
 
+struct cursor_stack_t {
+    u32 depth;
+    u64 cursor_ids[MAX_NESTING];
+};
+
+BPF_HASH(pid_to_cursor, u32, struct cursor_stack_t);
+
+#ifdef AGGREGATE
+// Aggregation key: one entry per backend, cursor and wait event
+struct wait_key_t {
+    u32 pid;
+    u32 wait_event_info;
+    u64 cursor_id;
+};
+
+// Log2 buckets of the duration in microseconds: slot 0 is < 1us,
+// slot n is [2^(n-1), 2^n) us, the last slot takes everything longer
+#define HIST_SLOTS 24
+
+struct wait_stat_t {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 hist[HIST_SLOTS];
+};
+
+BPF_HASH(wait_stats, struct wait_key_t, struct wait_stat_t, 65536);
+
+// Only waits over THRESHOLD_NS are sent to user space
+BPF_RINGBUF_OUTPUT(wait_events, 64);
+#else
 // Perf output for sending events to user space
 BPF_PERF_OUTPUT(wait_events);
+#endif
 
 // Trace pgstat_report_wait_start
 int trace_wait_start(struct pt_regs *ctx, u32 wait_event_info) {
     u64 pid_tid = bpf_get_current_pid_tgid();
     u32 tid = (u32)pid_tid;
-    u64 ts = bpf_ktime_get_ns();
-    
+    struct wait_start_t start = {};
+
     // Store start time
-    wait_starts.update(&tid, &ts);
+    start.ts = bpf_ktime_get_ns();
+    start.wait_event_info = wait_event_info;
+    wait_starts.update(&tid, &start);
     
     return 0;
 }
@@ -65,47 +118,145 @@ int trace_wait_end(struct pt_regs *ctx) {
     u32 tid = (u32)pid_tid;
     
     // Look up start time
-    u64 *start_ts = wait_starts.lookup(&tid);
-    if (!start_ts)
+    struct wait_start_t *start = wait_starts.lookup(&tid);
+    if (!start)
         return 0;
     
     u64 end_ts = bpf_ktime_get_ns();
-    u64 duration_ns = end_ts - *start_ts;
-    
+    u64 duration_ns = end_ts - start->ts;
+    u32 wait_event_info = start->wait_event_info;
+    u64 cursor = 0;
+
+    // Innermost traced cursor of this backend, if any
+    struct cursor_stack_t *stack = pid_to_cursor.lookup(&pid);
+    if (stack && stack->depth > 0) {
+        u32 top = stack->depth <= MAX_NESTING ? stack->depth - 1 : MAX_NESTING - 1;
+        if (top < MAX_NESTING)
+            cursor = stack->cursor_ids[top];
+    }
+
+#ifdef AGGREGATE
+    struct wait_key_t key = {};
+    struct wait_stat_t zero = {};
+    struct wait_stat_t *stat;
+    u32 slot;
+
+    key.pid = pid;
+    key.wait_event_info = wait_event_info;
+    key.cursor_id = cursor;
+
+    stat = wait_stats.lookup_or_try_init(&key, &zero);
+    if (stat) {
+        slot = bpf_log2l(duration_ns / 1000);
+        if (slot >= HIST_SLOTS)
+            slot = HIST_SLOTS - 1;
+        __sync_fetch_and_add(&stat->count, 1);
+        __sync_fetch_and_add(&stat->total_ns, duration_ns);
+        __sync_fetch_and_add(&stat->hist[slot], 1);
+        if (duration_ns > stat->max_ns)
+            stat->max_ns = duration_ns;
+    }
+
+    if (duration_ns < THRESHOLD_NS)
+        goto cleanup;
+#else
     // Only report waits > 1 microsecond (reduce noise)
     if (duration_ns < 1000)
         goto cleanup;
+#endif
     
     // Create event
     struct wait_event_t event = {};
     event.timestamp_ns = end_ts;
     event.pid = pid;
     event.tid = tid;
+    event.cursor_id = cursor;
+    event.wait_event_info = wait_event_info;
     event.duration_ns = duration_ns;
     
-    // Look up cursor_id (if extension has registered one)
-    u64 *cursor_id = pid_to_cursor.lookup(&pid);
-    if (cursor_id)
-        event.cursor_id = *cursor_id;
-    
     // Submit to user space
+#ifdef AGGREGATE
+    wait_events.ringbuf_output(&event, sizeof(event), 0);
+#else
     wait_events.perf_submit(ctx, &event, sizeof(event));
+#endif
     
 cleanup:
     wait_starts.delete(&tid);
     return 0;
 }
 
-// Trace specific I/O operations for detailed stats
-int trace_buffer_read_start(struct pt_regs *ctx) {
+// USDT pg_trace:exec_start(cursor_id, sql_id)
+int trace_exec_start(struct pt_regs *ctx) {
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    struct cursor_stack_t zero = {};
+    struct cursor_stack_t *stack;
+    u64 cursor_id = 0;
+
+    bpf_usdt_readarg(1, ctx, &cursor_id);
+
+    stack = pid_to_cursor.lookup_or_try_init(&pid, &zero);
+    if (!stack)
+        return 0;
+
+    u32 depth = stack->depth;
+    if (depth < MAX_NESTING)
+        stack->cursor_ids[depth] = cursor_id;
+    stack->depth = depth + 1;
+    return 0;
+}
+
+// USDT pg_trace:exec_done(cursor_id, sql_id, ela_us, rows), which also
+// fires when execution fails: pop down to and including this cursor
+int trace_exec_done(struct pt_regs *ctx) {
+    u32 pid = bpf_get_current_pid_tgid() >> 32;
+    struct cursor_stack_t *stack = pid_to_cursor.lookup(&pid);
+    u64 cursor_id = 0;
+
+    if (!stack)
+        return 0;
+
+    bpf_usdt_readarg(1, ctx, &cursor_id);
+
+    if (stack->depth > MAX_NESTING) {
+        // Not kept, nothing to match against
+        stack->depth--;
+        return 0;
+    }
+
+    #pragma unroll
+    for (int i = 0; i < MAX_NESTING; i++) {
+        u32 top = stack->depth - 1;
+        if (stack->depth == 0)
+            break;
+        stack->depth--;
+        if (top < MAX_NESTING && stack->cursor_ids[top] == cursor_id)
+            break;
+    }
+
+    if (stack->depth == 0)
+        pid_to_cursor.delete(&pid);
+    return 0;
+}
+
+// Backend exit: forget its cursors and any wait it was in. Aggregates of
+// an exited backend leave the map at the next drain.
+TRACEPOINT_PROBE(sched, sched_process_exit) {
     u64 pid_tid = bpf_get_current_pid_tgid();
+    u32 pid = pid_tid >> 32;
     u32 tid = (u32)pid_tid;
-    u64 ts = bpf_ktime_get_ns();
-    
-    wait_starts.update(&tid, &ts);
+
+    wait_starts.delete(&tid);
+    if (pid == tid)
+        pid_to_cursor.delete(&pid);
     return 0;
 }
 
+// Trace specific I/O operations for detailed stats
+int trace_buffer_read_start(struct pt_regs *ctx) {
+    return trace_wait_start(ctx, 0x0A000000);     // PG_WAIT_IO
+}
+
 int trace_buffer_read_done(struct pt_regs *ctx) {
     return trace_wait_end(ctx);
 }
@@ -134,19 +285,23 @@ def get_wait_event_name(wait_event_info):
     """Get human-readable wait event name"""
     return WAIT_EVENT_NAMES.get(wait_event_info, f'Unknown:0x{wait_event_info:08x}')
 
+# bpf_ktime_get_ns() is CLOCK_MONOTONIC; tim= is wall clock like the extension's
+MONOTONIC_TO_REALTIME_NS = time.time_ns() - time.monotonic_ns()
+
 def print_wait_event(cpu, data, size):
-    """Callback for each wait event"""
+    """Callback for each wait event (perf buffer or ring buffer)"""
     event = ctypes.cast(data, ctypes.POINTER(WaitEvent)).contents
     
-    timestamp = datetime.now().strftime('%Y-%m-%d %H:%M:%S.%f')[:-3]
+    # tim= is microseconds since the Unix epoch at the end of the wait
+    tim = (event.timestamp_ns + MONOTONIC_TO_REALTIME_NS) // 1000
     duration_us = event.duration_ns / 1000
     wait_name = get_wait_event_name(event.wait_event_info)
     
     # Format similar to Oracle 10046
     if event.cursor_id > 0:
-        print(f"WAIT #{event.cursor_id}: nam='{wait_name}' ela={duration_us:.0f} us tim={timestamp}")
+        print(f"WAIT #{event.cursor_id}: nam='{wait_name}' ela={duration_us:.0f} us tim={tim}")
     else:
-        print(f"WAIT [PID {event.pid}]: nam='{wait_name}' ela={duration_us:.0f} us tim={timestamp}")
+        print(f"WAIT [PID {event.pid}]: nam='{wait_name}' ela={duration_us:.0f} us tim={tim}")
     
     sys.stdout.flush()
 
@@ -159,12 +314,47 @@ class WaitEvent(ctypes.Structure):
         ("cursor_id", ctypes.c_uint64),
         ("wait_event_info", ctypes.c_uint32),
         ("duration_ns", ctypes.c_uint64),
-        ("wait_name", ctypes.c_char * 64),
     ]
 
+def format_hist(hist):
+    """Non-empty log2 buckets as '<bound>:<count>,...' (bound in microseconds)"""
+    buckets = []
+    for slot, count in enumerate(hist):
+        if count:
+            bound = f"{1 << slot}us" if slot < len(hist) - 1 else "inf"
+            buckets.append(f"<{bound}:{count}")
+    return ','.join(buckets)
+
+def print_wait_stats(stats):
+    """Drain the in-kernel aggregates and print this interval's waits.
+
+    Entries are deleted as they are read, so count, ela and max cover only
+    the interval and keys of exited backends or ended cursors disappear.
+    An update racing with the delete of its entry is lost.
+    """
+    tim = time.time_ns() // 1000
+    current = {}
+
+    for key, stat in stats.items_lookup_and_delete_batch():
+        k = (key.pid, key.cursor_id, key.wait_event_info)
+        current[k] = (stat.count, stat.total_ns, stat.max_ns, list(stat.hist))
+
+    for k in sorted(current):
+        pid, cursor_id, wait_event_info = k
+        count, total_ns, max_ns, hist = current[k]
+        if count == 0:
+            continue
+
+        wait_name = get_wait_event_name(wait_event_info)
+        who = f"#{cursor_id}" if cursor_id > 0 else f"[PID {pid}]"
+        print(f"WAIT STATS {who}: nam='{wait_name}' waits={count} "
+              f"ela={total_ns / 1000:.0f} us max={max_ns / 1000:.0f} us "
+              f"hist={format_hist(hist)} tim={tim}")
+
+    sys.stdout.flush()
+
 def find_postgres_binary():
     """Find PostgreSQL binary path"""
-    import subprocess
     try:
         result = subprocess.run(['which', 'postgres'], 
                               capture_output=True, text=True, check=True)
@@ -174,21 +364,76 @@ def find_postgres_binary():
         for path in ['/usr/pgsql-14/bin/postgres', 
                     '/usr/lib/postgresql/14/bin/postgres',
                     '/usr/local/pgsql/bin/postgres']:
-            import os
             if os.path.exists(path):
                 return path
     return None
 
+def find_extension_library():
+    """pg_trace_ultimate.so in pg_config's package library directory"""
+    try:
+        result = subprocess.run(['pg_config', '--pkglibdir'],
+                              capture_output=True, text=True, check=True)
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    path = os.path.join(result.stdout.strip(), 'pg_trace_ultimate.so')
+    return path if os.path.exists(path) else None
+
+def cursor_probes(library, pid, verbose):
+    """USDT context for the exec_start/exec_done probes, or None"""
+    from bcc import USDT
+    try:
+        usdt = USDT(path=library, pid=pid) if pid else USDT(path=library)
+        usdt.enable_probe(probe="exec_start", fn_name="trace_exec_start")
+        usdt.enable_probe(probe="exec_done", fn_name="trace_exec_done")
+    except Exception as e:
+        print(f"Warning: no pg_trace USDT probes in {library} ({e}); "
+              "waits are reported per PID", file=sys.stderr)
+        return None
+    if verbose:
+        print(f"Attached to pg_trace:exec_start/exec_done in {library}")
+    return usdt
+
+def aggregate_loop(b, interval):
+    """Drain long waits from the ring buffer, report aggregates every interval"""
+    b["wait_events"].open_ring_buffer(lambda ctx, data, size: print_wait_event(0, data, size))
+    stats = b["wait_stats"]
+    next_report = time.monotonic() + interval
+
+    try:
+        while True:
+            timeout_ms = max(0, int((next_report - time.monotonic()) * 1000))
+            b.ring_buffer_poll(timeout_ms)
+            if time.monotonic() >= next_report:
+                print_wait_stats(stats)
+                next_report += interval
+    except KeyboardInterrupt:
+        print_wait_stats(stats)
+        print("\n=== Trace stopped ===")
+
 def main():
     parser = argparse.ArgumentParser(description='Trace PostgreSQL wait events with eBPF')
-    parser.add_argument('-p', '--pid', type=int, required=True,
-                       help='PostgreSQL backend process ID to trace')
+    parser.add_argument('-p', '--pid', type=int,
+                       help='PostgreSQL backend process ID to trace '
+                            '(all backends with --aggregate if omitted)')
+    parser.add_argument('-a', '--aggregate', action='store_true',
+                       help='Aggregate waits in kernel, only send long ones')
+    parser.add_argument('-i', '--interval', type=float, default=5.0,
+                       help='Seconds between aggregate reports (default 5)')
+    parser.add_argument('-t', '--threshold', type=int, default=1000,
+                       help='With --aggregate, send waits longer than this '
+                            'many microseconds as events (default 1000)')
+    parser.add_argument('-l', '--library', type=str,
+                       help='pg_trace_ultimate.so with USDT probes, for cursor '
+                            'attribution (default: from pg_config --pkglibdir)')
     parser.add_argument('-v', '--verbose', action='store_true',
                        help='Verbose output')
     parser.add_argument('-o', '--output', type=str,
                        help='Output file (default: stdout)')
     args = parser.parse_args()
 
+    if args.pid is None and not args.aggregate:
+        parser.error("-p/--pid is required unless --aggregate is used")
+
     # Find PostgreSQL binary
     postgres_bin = find_postgres_binary()
     if not postgres_bin:
@@ -198,15 +443,31 @@ def main():
     
     if args.verbose:
         print(f"Using PostgreSQL binary: {postgres_bin}")
-        print(f"Tracing PID: {args.pid}")
+        print(f"Tracing PID: {args.pid if args.pid else 'all'}")
 
     # Redirect output if requested
     if args.output:
         sys.stdout = open(args.output, 'w', buffering=1)
 
+    cflags = []
+    if args.aggregate:
+        cflags.append("-DAGGREGATE")
+        cflags.append(f"-DTHRESHOLD_NS={args.threshold * 1000}ULL")
+    target_pid = args.pid if args.pid else -1
+
+    usdt_contexts = []
+    library = args.library or find_extension_library()
+    if library:
+        usdt = cursor_probes(library, args.pid, args.verbose)
+        if usdt:
+            usdt_contexts.append(usdt)
+    else:
+        print("Warning: pg_trace_ultimate.so not found; waits are reported per PID",
+              file=sys.stderr)
+
     # Load eBPF program
     try:
-        b = BPF(text=bpf_program)
+        b = BPF(text=bpf_program, cflags=cflags, usdt_contexts=usdt_contexts)
     except Exception as e:
         print(f"Error loading eBPF program: {e}", file=sys.stderr)
         print("Make sure you have BCC installed and running as root", file=sys.stderr)
@@ -217,11 +478,11 @@ def main():
         b.attach_uprobe(name=postgres_bin,
                        sym="pgstat_report_wait_start",
                        fn_name="trace_wait_start",
-                       pid=args.pid)
+                       pid=target_pid)
         b.attach_uprobe(name=postgres_bin,
                        sym="pgstat_report_wait_end",
                        fn_name="trace_wait_end",
-                       pid=args.pid)
+                       pid=target_pid)
         
         if args.verbose:
             print("Attached to pgstat_report_wait_start/end")
@@ -233,10 +494,17 @@ def main():
         print("  3. You have root privileges", file=sys.stderr)
         sys.exit(1)
 
-    print(f"=== Tracing PostgreSQL wait events for PID {args.pid} ===")
+    if args.pid:
+        print(f"=== Tracing PostgreSQL wait events for PID {args.pid} ===")
+    else:
+        print("=== Tracing PostgreSQL wait events for all backends ===")
     print("Press Ctrl-C to stop")
     print()
 
+    if args.aggregate:
+        aggregate_loop(b, args.interval)
+        return
+
     # Open perf buffer
     b["wait_events"].open_perf_buffer(print_wait_event)
 
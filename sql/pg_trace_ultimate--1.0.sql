@@ -26,8 +26,156 @@ RETURNS integer
 AS 'MODULE_PATHNAME', 'pg_trace_set_cache_threshold'
 LANGUAGE C STRICT;
 
+-- Live per-node progress of a traced query in another backend
+CREATE FUNCTION pg_trace_live(pid integer,
+    OUT cursor_id bigint,
+    OUT snapshot_time timestamptz,
+    OUT node_id integer,
+    OUT parent_node_id integer,
+    OUT depth integer,
+    OUT node_type text,
+    OUT plan_rows float8,
+    OUT actual_rows float8,
+    OUT loops float8,
+    OUT elapsed_ms float8,
+    OUT shared_hit bigint,
+    OUT shared_read bigint,
+    OUT temp_read bigint,
+    OUT temp_written bigint,
+    OUT sql_text text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_live'
+LANGUAGE C STRICT;
+
+-- SQL text for a SQL_ID found in a trace file
+CREATE FUNCTION pg_trace_sql_text(sql_id bigint)
+RETURNS text
+AS 'MODULE_PATHNAME', 'pg_trace_sql_text'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_trace_sql_text(bigint) FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_trace_sql_text(bigint) TO pg_read_all_stats;
+
+-- Response time aggregates per statement and plan
+CREATE FUNCTION pg_trace_sql_stats(
+    OUT sql_id bigint,
+    OUT plan_id bigint,
+    OUT dbid oid,
+    OUT calls bigint,
+    OUT rows bigint,
+    OUT total_ms float8,
+    OUT mean_ms float8,
+    OUT max_ms float8,
+    OUT cpu_user_ms float8,
+    OUT cpu_sys_ms float8,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint,
+    OUT io_read_ms float8,
+    OUT io_write_ms float8,
+    OUT other_wait_ms float8,
+    OUT lwlock_wait_ms float8,
+    OUT lock_wait_ms float8,
+    OUT bufferpin_wait_ms float8,
+    OUT io_wait_ms float8,
+    OUT ipc_wait_ms float8,
+    OUT client_wait_ms float8,
+    OUT timeout_wait_ms float8,
+    OUT extension_wait_ms float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_sql_stats'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_trace_sql_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_trace_sql_stats_reset'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_trace_sql_stats_reset() FROM PUBLIC;
+
+CREATE VIEW pg_trace_sql_stats AS
+    SELECT s.*, pg_trace_sql_text(s.sql_id) AS sql_text
+    FROM pg_trace_sql_stats() s;
+
+REVOKE ALL ON pg_trace_sql_stats FROM PUBLIC;
+GRANT SELECT ON pg_trace_sql_stats TO pg_read_all_stats;
+
+-- Active session history of all sessions between two points in time
+CREATE FUNCTION pg_trace_ash(
+    start_time timestamptz DEFAULT now() - interval '1 hour',
+    end_time timestamptz DEFAULT now(),
+    OUT sample_time timestamptz,
+    OUT pid integer,
+    OUT datid oid,
+    OUT roleid oid,
+    OUT state text,
+    OUT wait_event_type text,
+    OUT wait_event text,
+    OUT sql_id bigint,
+    OUT blocking_pid integer)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_ash_history'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_trace_ash(timestamptz, timestamptz) FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_trace_ash(timestamptz, timestamptz) TO pg_read_all_stats;
+
+-- Drain the PARSE/EXEC events buffered in every backend's ring
+CREATE FUNCTION pg_trace_read_events(
+    OUT event_time timestamptz,
+    OUT pid integer,
+    OUT event text,
+    OUT cursor_id bigint,
+    OUT sql_id bigint,
+    OUT duration_ms float8,
+    OUT rows bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_read_events'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_trace_read_events() FROM PUBLIC;
+
+-- Fill level and overflow of the per-backend event rings
+CREATE FUNCTION pg_trace_event_rings(
+    OUT backend_id integer,
+    OUT pid integer,
+    OUT pending bigint,
+    OUT total bigint,
+    OUT dropped bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_event_rings'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION pg_trace_event_rings() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_trace_event_rings() TO pg_read_all_stats;
+
+-- Microbenchmarks of the trace hot paths, run in the calling backend
+CREATE FUNCTION pg_trace_bench(
+    iterations integer DEFAULT 10000,
+    OUT benchmark text,
+    OUT ops integer,
+    OUT ns_per_op float8,
+    OUT bytes_per_op float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_trace_bench'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_trace_bench(integer) FROM PUBLIC;
+
 COMMENT ON FUNCTION pg_trace_start_trace() IS 'Start Oracle 10046-style tracing with per-block I/O detail';
 COMMENT ON FUNCTION pg_trace_stop_trace() IS 'Stop tracing and return trace file path';
 COMMENT ON FUNCTION pg_trace_get_tracefile() IS 'Get current trace file path';
 COMMENT ON FUNCTION pg_trace_set_cache_threshold(integer) IS 'Set threshold in microseconds to distinguish OS cache from disk (default 500)';
-
+COMMENT ON FUNCTION pg_trace_live(integer) IS 'Current per-node counters of a traced query running in another backend (never blocks it)';
+COMMENT ON FUNCTION pg_trace_sql_text(bigint) IS 'Look up the shared SQL text for a SQL_ID (same value as pg_stat_statements.queryid when compute_query_id is on)';
+COMMENT ON FUNCTION pg_trace_sql_stats() IS 'Per sql_id/plan_id response time: elapsed, CPU, buffers, I/O time, remaining wait time and its split by wait class (sampled by the ASH worker)';
+COMMENT ON FUNCTION pg_trace_sql_stats_reset() IS 'Discard all pg_trace_sql_stats counters';
+COMMENT ON FUNCTION pg_trace_ash(timestamptz, timestamptz) IS 'Sampled active session history (wait event, sql_id, blocker) of all sessions in a time range';
+COMMENT ON FUNCTION pg_trace_read_events() IS 'Consume the PARSE, EXEC and END EXEC events of traced cursors buffered in all backends (each event is returned once)';
+COMMENT ON FUNCTION pg_trace_event_rings() IS 'Per-backend event ring: events waiting to be read, written in total and dropped because the ring was full';
+COMMENT ON FUNCTION pg_trace_bench(integer) IS 'Time trace_printf, buffer I/O capture, plan and bind writers and /proc readers on synthetic input (ns and bytes left allocated per operation)';
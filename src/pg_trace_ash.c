@@ -0,0 +1,946 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_ash.c
+ *    Instance-wide active session history
+ *
+ * The worker is the only writer of the ring. Readers take the ring lock
+ * in shared mode just long enough to copy the samples not yet on disk and
+ * the newest sample time that is (spilled_to); segment files newer than
+ * that are ignored, so every sample is returned exactly once.
+ *
+ * Spills always cover whole sampling ticks: all samples of a tick are
+ * appended at once, and only the worker appends.
+ *
+ * The blocker of a transaction id or virtual transaction id wait is
+ * resolved without the lock manager, by matching the awaited id against
+ * each PGPROC. Other lock types (relation, tuple, object, ...) need the
+ * lock's holders and wait queue: the worker reads them under the lock's
+ * partition lock in shared mode, as pg_blocking_pids() does, and publishes
+ * the blocker in the waiter's slot together with the waitStart of the wait
+ * it belongs to, so lock-free readers can tell a stale entry.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lock.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "pg_trace_ash.h"
+
+#define ASH_SEGMENT_MAGIC       0x50544153      /* "PTAS" */
+#define ASH_SEGMENT_VERSION     1
+#define ASH_TRANCHE_NAME        "pg_trace_ash"
+
+typedef struct AshShared
+{
+    LWLock lock;                /* Ring appends and spill bookkeeping */
+    int lock_tranche;
+    int ring_size;
+    uint64 head;                /* Samples ever appended */
+    uint64 spilled;             /* Samples ever spilled to disk or dropped */
+    uint64 dropped;             /* Overwritten before they could be spilled */
+    TimestampTz spilled_to;     /* Newest sample time on disk */
+    pg_atomic_uint64 sql_ids[FLEXIBLE_ARRAY_MEMBER];   /* By BackendId - 1 */
+    /* Then PG_TRACE_ASH_WAIT_CLASSES sample counters per backend */
+    /* Then one AshLockBlocker per backend */
+} AshShared;
+
+/* Blocker the worker resolved for a backend's current lock wait */
+typedef struct AshLockBlocker
+{
+    pg_atomic_uint64 wait_start;    /* PGPROC->waitStart of the wait, 0 while updated */
+    pg_atomic_uint32 pgprocno;      /* Blocker's pgprocno + 1, 0 if none */
+} AshLockBlocker;
+
+#define AshWaitCounts(shared, backend_id) \
+    ((pg_atomic_uint64 *) ((char *) (shared) + ash_sql_ids_size()) + \
+     ((backend_id) - 1) * PG_TRACE_ASH_WAIT_CLASSES)
+
+#define AshLockBlockers(shared, backend_id) \
+    ((AshLockBlocker *) ((char *) (shared) + ash_wait_counts_end()) + ((backend_id) - 1))
+
+#define AshRing(shared) \
+    ((PgTraceAshSample *) ((char *) (shared) + ash_header_size()))
+
+/* Segment file header, followed by nsamples samples */
+typedef struct AshSegmentHeader
+{
+    uint32 magic;
+    uint32 version;
+    uint32 sample_size;
+    uint32 nsamples;
+} AshSegmentHeader;
+
+/* GUCs */
+bool pg_trace_ash = true;
+int pg_trace_ash_interval_ms = 1000;
+int pg_trace_ash_buffer_samples = 65536;
+int pg_trace_ash_retention = 1440;
+
+static AshShared *ash_shared = NULL;
+
+/* Backend state */
+static QueryDesc *ash_query = NULL;
+static SubTransactionId ash_subid = InvalidSubTransactionId;
+
+PG_FUNCTION_INFO_V1(pg_trace_ash_history);
+
+static Size
+ash_sql_ids_size(void)
+{
+    return MAXALIGN(add_size(offsetof(AshShared, sql_ids),
+                             mul_size(MaxBackends, sizeof(pg_atomic_uint64))));
+}
+
+static Size
+ash_wait_counts_end(void)
+{
+    return MAXALIGN(add_size(ash_sql_ids_size(),
+                             mul_size(mul_size(MaxBackends, PG_TRACE_ASH_WAIT_CLASSES),
+                                      sizeof(pg_atomic_uint64))));
+}
+
+static Size
+ash_header_size(void)
+{
+    return MAXALIGN(add_size(ash_wait_counts_end(),
+                             mul_size(MaxBackends, sizeof(AshLockBlocker))));
+}
+
+static int
+ash_ring_size(void)
+{
+    /* Room for several ticks, so a slow spill does not lose samples */
+    return Max(pg_trace_ash_buffer_samples, 4 * MaxBackends);
+}
+
+Size
+pg_trace_ash_shmem_size(void)
+{
+    return add_size(ash_header_size(),
+                    mul_size(ash_ring_size(), sizeof(PgTraceAshSample)));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_ash_shmem_init(void)
+{
+    bool found;
+    int i;
+
+    ash_shared = ShmemInitStruct("pg_trace_ash", pg_trace_ash_shmem_size(), &found);
+
+    if (!found)
+    {
+        ash_shared->lock_tranche = LWLockNewTrancheId();
+        LWLockInitialize(&ash_shared->lock, ash_shared->lock_tranche);
+        ash_shared->ring_size = ash_ring_size();
+        ash_shared->head = 0;
+        ash_shared->spilled = 0;
+        ash_shared->dropped = 0;
+
+        /* Segments left by an earlier server run are all older than this */
+        ash_shared->spilled_to = GetCurrentTimestamp();
+
+        for (i = 0; i < MaxBackends; i++)
+        {
+            pg_atomic_uint64 *counts = AshWaitCounts(ash_shared, i + 1);
+            AshLockBlocker *blocker = AshLockBlockers(ash_shared, i + 1);
+            int c;
+
+            pg_atomic_init_u64(&ash_shared->sql_ids[i], 0);
+            for (c = 0; c < PG_TRACE_ASH_WAIT_CLASSES; c++)
+                pg_atomic_init_u64(&counts[c], 0);
+            pg_atomic_init_u64(&blocker->wait_start, 0);
+            pg_atomic_init_u32(&blocker->pgprocno, 0);
+        }
+    }
+
+    LWLockRegisterTranche(ash_shared->lock_tranche, ASH_TRANCHE_NAME);
+}
+
+void
+pg_trace_ash_register_worker(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = 10;
+    strlcpy(worker.bgw_library_name, "pg_trace_ultimate", BGW_MAXLEN);
+    strlcpy(worker.bgw_function_name, "pg_trace_ash_main", BGW_MAXLEN);
+    strlcpy(worker.bgw_name, "pg_trace ash sampler", BGW_MAXLEN);
+    strlcpy(worker.bgw_type, "pg_trace ash sampler", BGW_MAXLEN);
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/*---- Backend side ----*/
+
+/*
+ * Publish the sql_id of the outermost statement; nested statements are
+ * part of it
+ */
+void
+pg_trace_ash_begin(QueryDesc *queryDesc, uint64 sql_id)
+{
+    if (!ash_shared || ash_query)
+        return;
+
+    if (MyBackendId == InvalidBackendId || MyBackendId > MaxBackends)
+        return;
+
+    ash_query = queryDesc;
+    ash_subid = GetCurrentSubTransactionId();
+    pg_atomic_write_u64(&ash_shared->sql_ids[MyBackendId - 1], sql_id);
+}
+
+static void
+ash_clear(void)
+{
+    pg_atomic_write_u64(&ash_shared->sql_ids[MyBackendId - 1], 0);
+    ash_query = NULL;
+    ash_subid = InvalidSubTransactionId;
+}
+
+void
+pg_trace_ash_end(QueryDesc *queryDesc)
+{
+    if (queryDesc != ash_query)
+        return;
+
+    ash_clear();
+}
+
+/*
+ * (Sub)transaction abort: the statement will not reach ExecutorEnd
+ */
+void
+pg_trace_ash_abort(SubTransactionId subid)
+{
+    if (!ash_query)
+        return;
+
+    if (subid == InvalidSubTransactionId || subid == ash_subid)
+        ash_clear();
+}
+
+/*---- Sampling ----*/
+
+/*
+ * Does proc run (sub)transaction xid? Unlocked read of the subxid cache;
+ * an overflowed cache simply does not match.
+ */
+static bool
+ash_proc_has_xid(PGPROC *proc, TransactionId xid)
+{
+    int nsubxids;
+    int i;
+
+    if (TransactionIdEquals(proc->xid, xid))
+        return true;
+
+    nsubxids = Min(proc->subxidStatus.count, PGPROC_MAX_CACHED_SUBXIDS);
+    for (i = 0; i < nsubxids; i++)
+    {
+        if (TransactionIdEquals(proc->subxids.xids[i], xid))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * sql_id the given backend is executing, 0 if none
+ */
+uint64
+pg_trace_ash_sql_id(BackendId backend_id)
+{
+    if (!ash_shared || backend_id == InvalidBackendId || backend_id > MaxBackends)
+        return 0;
+
+    return pg_atomic_read_u64(&ash_shared->sql_ids[backend_id - 1]);
+}
+
+/*
+ * Active samples of this backend so far, per wait class. The counters only
+ * grow, so a statement's share is the difference of two reads. False when
+ * the sampler is not running.
+ */
+bool
+pg_trace_ash_wait_counts(uint64 *counts)
+{
+    pg_atomic_uint64 *slot;
+    int c;
+
+    if (!ash_shared || !pg_trace_ash ||
+        MyBackendId == InvalidBackendId || MyBackendId > MaxBackends)
+        return false;
+
+    slot = AshWaitCounts(ash_shared, MyBackendId);
+    for (c = 0; c < PG_TRACE_ASH_WAIT_CLASSES; c++)
+        counts[c] = pg_atomic_read_u64(&slot[c]);
+
+    return true;
+}
+
+/*
+ * Holder of the transaction or virtual transaction the waiter awaits
+ */
+static PGPROC *
+ash_xact_blocker(PGPROC *waiter, const LOCKTAG *tag)
+{
+    int i;
+
+    for (i = 0; i < ProcGlobal->allProcCount; i++)
+    {
+        PGPROC *proc = &ProcGlobal->allProcs[i];
+
+        if (proc->pid == 0 || proc == waiter)
+            continue;
+
+        if (tag->locktag_type == LOCKTAG_TRANSACTION)
+        {
+            if (ash_proc_has_xid(proc, (TransactionId) tag->locktag_field1))
+                return proc;
+        }
+        else if (proc->backendId == (BackendId) tag->locktag_field1 &&
+                 proc->lxid == (LocalTransactionId) tag->locktag_field2)
+            return proc;
+    }
+
+    return NULL;
+}
+
+static bool
+ash_is_xact_lock(const LOCKTAG *tag)
+{
+    return tag->locktag_type == LOCKTAG_TRANSACTION ||
+        tag->locktag_type == LOCKTAG_VIRTUALTRANSACTION;
+}
+
+/*
+ * The session the waiter is blocked on, or NULL. Other lock types than
+ * transaction ids are answered from what the worker last published for
+ * this very wait; until its next tick they report no blocker.
+ */
+PGPROC *
+pg_trace_ash_blocker(PGPROC *waiter)
+{
+    LOCK *lock = waiter->waitLock;
+    LOCKTAG tag;
+    AshLockBlocker *slot;
+    uint64 wait_start;
+    uint32 pgprocno;
+
+    if (!lock)
+        return NULL;
+
+    /* The lock may be released and reused meanwhile; a copy is enough */
+    memcpy(&tag, &lock->tag, sizeof(LOCKTAG));
+
+    if (ash_is_xact_lock(&tag))
+        return ash_xact_blocker(waiter, &tag);
+
+    if (!ash_shared || waiter->backendId == InvalidBackendId ||
+        waiter->backendId > MaxBackends)
+        return NULL;
+
+    wait_start = pg_atomic_read_u64(&waiter->waitStart);
+    if (wait_start == 0)
+        return NULL;
+
+    /* The worker clears wait_start around its update of pgprocno */
+    slot = AshLockBlockers(ash_shared, waiter->backendId);
+    if (pg_atomic_read_u64(&slot->wait_start) != wait_start)
+        return NULL;
+    pg_read_barrier();
+    pgprocno = pg_atomic_read_u32(&slot->pgprocno);
+    pg_read_barrier();
+    if (pg_atomic_read_u64(&slot->wait_start) != wait_start ||
+        pgprocno == 0 || pgprocno > ProcGlobal->allProcCount)
+        return NULL;
+
+    return &ProcGlobal->allProcs[pgprocno - 1];
+}
+
+static PGPROC *
+ash_group_leader(PGPROC *proc)
+{
+    return proc->lockGroupLeader ? proc->lockGroupLeader : proc;
+}
+
+/*
+ * Blocker of any other lock wait: a holder of a conflicting mode, else a
+ * conflicting request queued ahead of the waiter. Worker only: takes the
+ * lock's partition lock in shared mode.
+ */
+static PGPROC *
+ash_lock_blocker(PGPROC *waiter, const LOCKTAG *tag)
+{
+    LOCK *lock;
+    LWLock *partition_lock = LockHashPartitionLock(LockTagHashCode(tag));
+    PGPROC *blocker = NULL;
+
+    LWLockAcquire(partition_lock, LW_SHARED);
+
+    /* Nothing moves while we hold the partition lock; is it still the wait? */
+    lock = waiter->waitLock;
+    if (lock && memcmp(&lock->tag, tag, sizeof(LOCKTAG)) == 0)
+    {
+        LOCKMASK conflicts = GetLocksMethodTable(lock)->conflictTab[waiter->waitLockMode];
+        PGPROC *leader = ash_group_leader(waiter);
+        SHM_QUEUE *proc_locks = &lock->procLocks;
+        PROC_QUEUE *wait_queue = &lock->waitProcs;
+        PROCLOCK *proclock;
+        PGPROC *proc;
+        int i;
+
+        proclock = (PROCLOCK *) SHMQueueNext(proc_locks, proc_locks,
+                                             offsetof(PROCLOCK, lockLink));
+        while (proclock && !blocker)
+        {
+            if (proclock->groupLeader != leader && (proclock->holdMask & conflicts))
+                blocker = proclock->tag.myProc;
+            proclock = (PROCLOCK *) SHMQueueNext(proc_locks, &proclock->lockLink,
+                                                 offsetof(PROCLOCK, lockLink));
+        }
+
+        /* Lock convoys: a conflicting request ahead of us in the queue */
+        proc = (PGPROC *) wait_queue->links.next;
+        for (i = 0; i < wait_queue->size && !blocker && proc != waiter; i++)
+        {
+            if (ash_group_leader(proc) != leader &&
+                (conflicts & LOCKBIT_ON(proc->waitLockMode)))
+                blocker = proc;
+            proc = (PGPROC *) proc->links.next;
+        }
+    }
+
+    LWLockRelease(partition_lock);
+
+    return blocker;
+}
+
+/*
+ * Resolve the blocker of a lock wait seen by the worker, publishing it
+ * for pg_trace_ash_blocker() when the lock manager had to be asked
+ */
+static int
+ash_blocker_pid(PGPROC *waiter)
+{
+    LOCK *lock = waiter->waitLock;
+    LOCKTAG tag;
+    AshLockBlocker *slot;
+    uint64 wait_start;
+    PGPROC *blocker;
+
+    if (!lock)
+        return 0;
+    memcpy(&tag, &lock->tag, sizeof(LOCKTAG));
+
+    if (ash_is_xact_lock(&tag))
+    {
+        blocker = ash_xact_blocker(waiter, &tag);
+        return blocker ? blocker->pid : 0;
+    }
+
+    wait_start = pg_atomic_read_u64(&waiter->waitStart);
+    blocker = ash_lock_blocker(waiter, &tag);
+
+    if (wait_start != 0 && waiter->backendId != InvalidBackendId &&
+        waiter->backendId <= MaxBackends)
+    {
+        slot = AshLockBlockers(ash_shared, waiter->backendId);
+        pg_atomic_write_u64(&slot->wait_start, 0);
+        pg_write_barrier();
+        pg_atomic_write_u32(&slot->pgprocno, blocker ? blocker->pgprocno + 1 : 0);
+        pg_write_barrier();
+        pg_atomic_write_u64(&slot->wait_start, wait_start);
+    }
+
+    return blocker ? blocker->pid : 0;
+}
+
+/*
+ * One pass over all PGPROCs, no locks taken except the partition lock of
+ * a lock wait that is not on a transaction id
+ */
+static int
+ash_sample_procs(PgTraceAshSample *samples, TimestampTz now)
+{
+    int nsamples = 0;
+    int i;
+
+    for (i = 0; i < ProcGlobal->allProcCount; i++)
+    {
+        PGPROC *proc = &ProcGlobal->allProcs[i];
+        PgTraceAshSample *sample;
+        uint32 info;
+        uint64 sql_id;
+        BackendId backend_id;
+        bool idle;
+        int pid;
+
+        pid = proc->pid;
+        if (pid == 0 || proc == MyProc)
+            continue;
+
+        info = *((volatile uint32 *) &proc->wait_event_info);
+        backend_id = proc->backendId;
+
+        sql_id = pg_trace_ash_sql_id(backend_id);
+
+        idle = (info == WAIT_EVENT_CLIENT_READ ||
+                (info & 0xFF000000) == PG_WAIT_ACTIVITY);
+
+        /* Idle sessions are not interesting, idle transactions are */
+        if (idle && sql_id == 0 && proc->lxid == InvalidLocalTransactionId)
+            continue;
+
+        sample = &samples[nsamples++];
+        sample->sample_time = now;
+        sample->sql_id = sql_id;
+        sample->pid = pid;
+        sample->dbid = proc->databaseId;
+        sample->roleid = proc->roleId;
+        sample->wait_event_info = info;
+        sample->state = (idle && sql_id == 0) ? PG_TRACE_ASH_IDLE_IN_XACT : PG_TRACE_ASH_ACTIVE;
+        sample->blocker_pid = ((info & 0xFF000000) == PG_WAIT_LOCK) ? ash_blocker_pid(proc) : 0;
+
+        /* Only the worker writes the counters, so no atomic increment */
+        if (sample->state == PG_TRACE_ASH_ACTIVE &&
+            backend_id != InvalidBackendId && backend_id <= MaxBackends &&
+            PgTraceAshWaitClass(info) < PG_TRACE_ASH_WAIT_CLASSES)
+        {
+            pg_atomic_uint64 *counter =
+                &AshWaitCounts(ash_shared, backend_id)[PgTraceAshWaitClass(info)];
+
+            pg_atomic_write_u64(counter, pg_atomic_read_u64(counter) + 1);
+        }
+    }
+
+    return nsamples;
+}
+
+/*
+ * Append one tick of samples to the ring. If the spiller fell behind, the
+ * oldest unspilled samples are dropped.
+ */
+static void
+ash_append(PgTraceAshSample *samples, int nsamples)
+{
+    PgTraceAshSample *ring = AshRing(ash_shared);
+    uint64 ring_size = ash_shared->ring_size;
+    int i;
+
+    if (nsamples == 0)
+        return;
+
+    LWLockAcquire(&ash_shared->lock, LW_EXCLUSIVE);
+
+    if (ash_shared->head + nsamples - ash_shared->spilled > ring_size)
+    {
+        uint64 spilled = ash_shared->head + nsamples - ring_size;
+
+        ash_shared->dropped += spilled - ash_shared->spilled;
+        ash_shared->spilled = spilled;
+    }
+
+    for (i = 0; i < nsamples; i++)
+        ring[(ash_shared->head + i) % ring_size] = samples[i];
+    ash_shared->head += nsamples;
+
+    LWLockRelease(&ash_shared->lock);
+}
+
+static void
+ash_segment_path(char *path, TimestampTz from, TimestampTz to)
+{
+    snprintf(path, MAXPGPATH, "%s/%016llX-%016llX.ash",
+             PG_TRACE_ASH_DIR, (unsigned long long) from, (unsigned long long) to);
+}
+
+static bool
+ash_parse_segment_name(const char *name, TimestampTz *from, TimestampTz *to)
+{
+    unsigned long long f;
+    unsigned long long t;
+
+    if (strlen(name) != 37 || strcmp(name + 33, ".ash") != 0 ||
+        sscanf(name, "%16llX-%16llX", &f, &t) != 2)
+        return false;
+
+    *from = (TimestampTz) f;
+    *to = (TimestampTz) t;
+    return true;
+}
+
+/*
+ * Write everything not yet on disk into one segment. Worker only; the
+ * worker is the only writer of the ring, so no lock is needed to read it.
+ */
+static void
+ash_spill(void)
+{
+    PgTraceAshSample *ring = AshRing(ash_shared);
+    uint64 ring_size = ash_shared->ring_size;
+    uint64 start = ash_shared->spilled;
+    uint64 end = ash_shared->head;
+    AshSegmentHeader header;
+    PgTraceAshSample *samples;
+    char tmppath[MAXPGPATH];
+    char path[MAXPGPATH];
+    uint64 seq;
+    int fd;
+    int n = 0;
+
+    if (end == start)
+        return;
+
+    samples = (PgTraceAshSample *) palloc((end - start) * sizeof(PgTraceAshSample));
+    for (seq = start; seq < end; seq++)
+        samples[n++] = ring[seq % ring_size];
+
+    header.magic = ASH_SEGMENT_MAGIC;
+    header.version = ASH_SEGMENT_VERSION;
+    header.sample_size = sizeof(PgTraceAshSample);
+    header.nsamples = n;
+
+    ash_segment_path(path, samples[0].sample_time, samples[n - 1].sample_time);
+    snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+    fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0)
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", tmppath)));
+        pfree(samples);
+        return;
+    }
+
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, samples, n * sizeof(PgTraceAshSample)) != n * sizeof(PgTraceAshSample) ||
+        pg_fsync(fd) != 0)
+    {
+        ereport(LOG,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", tmppath)));
+        CloseTransientFile(fd);
+        unlink(tmppath);
+        pfree(samples);
+        return;
+    }
+
+    CloseTransientFile(fd);
+
+    if (durable_rename(tmppath, path, LOG) != 0)
+    {
+        unlink(tmppath);
+        pfree(samples);
+        return;
+    }
+
+    LWLockAcquire(&ash_shared->lock, LW_EXCLUSIVE);
+    /* Samples dropped meanwhile have already moved spilled forward */
+    if (ash_shared->spilled < end)
+        ash_shared->spilled = end;
+    ash_shared->spilled_to = samples[n - 1].sample_time;
+    LWLockRelease(&ash_shared->lock);
+
+    pfree(samples);
+}
+
+/*
+ * Remove segments older than pg_trace.ash_retention, and temporary files
+ * of a spill that was interrupted
+ */
+static void
+ash_remove_old_segments(TimestampTz now)
+{
+    TimestampTz cutoff = now - (TimestampTz) pg_trace_ash_retention * USECS_PER_MINUTE;
+    DIR *dir;
+    struct dirent *de;
+
+    dir = AllocateDir(PG_TRACE_ASH_DIR);
+    while ((de = ReadDir(dir, PG_TRACE_ASH_DIR)) != NULL)
+    {
+        char path[MAXPGPATH];
+        TimestampTz from;
+        TimestampTz to;
+        size_t len = strlen(de->d_name);
+
+        if (ash_parse_segment_name(de->d_name, &from, &to))
+        {
+            if (to >= cutoff)
+                continue;
+        }
+        else if (len < 4 || strcmp(de->d_name + len - 4, ".tmp") != 0)
+            continue;
+
+        snprintf(path, MAXPGPATH, "%s/%s", PG_TRACE_ASH_DIR, de->d_name);
+        if (unlink(path) != 0 && errno != ENOENT)
+            ereport(LOG,
+                    (errcode_for_file_access(),
+                     errmsg("could not remove file \"%s\": %m", path)));
+    }
+    FreeDir(dir);
+}
+
+static void
+ash_worker_shutdown(int code, Datum arg)
+{
+    ash_spill();
+}
+
+/*
+ * Background worker entry point
+ */
+void
+pg_trace_ash_main(Datum main_arg)
+{
+    PgTraceAshSample *samples;
+    TimestampTz next_sample;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    if (MakePGDirectory(PG_TRACE_ASH_DIR) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create directory \"%s\": %m", PG_TRACE_ASH_DIR)));
+
+    ash_remove_old_segments(GetCurrentTimestamp());
+    before_shmem_exit(ash_worker_shutdown, (Datum) 0);
+
+    samples = (PgTraceAshSample *)
+        palloc(ProcGlobal->allProcCount * sizeof(PgTraceAshSample));
+
+    next_sample = GetCurrentTimestamp();
+
+    for (;;)
+    {
+        TimestampTz now = GetCurrentTimestamp();
+        long timeout;
+
+        timeout = TimestampDifferenceMilliseconds(now, next_sample);
+        if (timeout > 0)
+        {
+            (void) WaitLatch(MyLatch,
+                             WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                             timeout,
+                             PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+        }
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        now = GetCurrentTimestamp();
+        if (now < next_sample)
+            continue;
+
+        ash_append(samples, ash_sample_procs(samples, now));
+
+        if (ash_shared->head - ash_shared->spilled >= (uint64) ash_shared->ring_size / 2)
+        {
+            ash_spill();
+            ash_remove_old_segments(now);
+        }
+
+        /* Stay on the grid; skip ticks we are too late for */
+        next_sample = TimestampTzPlusMilliseconds(next_sample, pg_trace_ash_interval_ms);
+        if (next_sample <= now)
+            next_sample = TimestampTzPlusMilliseconds(now, pg_trace_ash_interval_ms);
+    }
+}
+
+/*---- SQL interface ----*/
+
+static void
+ash_put_sample(ReturnSetInfo *rsinfo, PgTraceAshSample *sample)
+{
+    Datum values[9];
+    bool nulls[9];
+    const char *event;
+    const char *event_type;
+
+    memset(nulls, 0, sizeof(nulls));
+
+    if (sample->wait_event_info == 0)
+    {
+        event = "CPU";
+        event_type = "CPU";
+    }
+    else
+    {
+        event = pgstat_get_wait_event(sample->wait_event_info);
+        event_type = pgstat_get_wait_event_type(sample->wait_event_info);
+    }
+
+    values[0] = TimestampTzGetDatum(sample->sample_time);
+    values[1] = Int32GetDatum(sample->pid);
+    values[2] = ObjectIdGetDatum(sample->dbid);
+    values[3] = ObjectIdGetDatum(sample->roleid);
+    values[4] = CStringGetTextDatum(sample->state == PG_TRACE_ASH_ACTIVE ?
+                                    "active" : "idle in transaction");
+    if (event_type)
+        values[5] = CStringGetTextDatum(event_type);
+    else
+        nulls[5] = true;
+    if (event)
+        values[6] = CStringGetTextDatum(event);
+    else
+        nulls[6] = true;
+    values[7] = Int64GetDatum((int64) sample->sql_id);
+    if (sample->blocker_pid != 0)
+        values[8] = Int32GetDatum(sample->blocker_pid);
+    else
+        nulls[8] = true;
+
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+/*
+ * Emit the samples of one segment file that fall into [from, to]
+ */
+static void
+ash_read_segment(ReturnSetInfo *rsinfo, const char *path,
+                 TimestampTz from, TimestampTz to)
+{
+    AshSegmentHeader header;
+    PgTraceAshSample sample;
+    FILE *file;
+    uint32 i;
+
+    file = AllocateFile(path, PG_BINARY_R);
+    if (!file)
+    {
+        /* Removed by the worker meanwhile */
+        if (errno == ENOENT)
+            return;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\": %m", path)));
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != ASH_SEGMENT_MAGIC ||
+        header.version != ASH_SEGMENT_VERSION ||
+        header.sample_size != sizeof(PgTraceAshSample))
+    {
+        ereport(WARNING,
+                (errmsg("pg_trace: skipping invalid ASH segment \"%s\"", path)));
+        FreeFile(file);
+        return;
+    }
+
+    for (i = 0; i < header.nsamples; i++)
+    {
+        if (fread(&sample, sizeof(sample), 1, file) != 1)
+            break;
+        if (sample.sample_time >= from && sample.sample_time <= to)
+            ash_put_sample(rsinfo, &sample);
+    }
+
+    FreeFile(file);
+}
+
+/*
+ * SQL function: pg_trace_ash(start_time, end_time)
+ */
+Datum
+pg_trace_ash_history(PG_FUNCTION_ARGS)
+{
+    TimestampTz from = PG_GETARG_TIMESTAMPTZ(0);
+    TimestampTz to = PG_GETARG_TIMESTAMPTZ(1);
+    ReturnSetInfo *rsinfo;
+    PgTraceAshSample *ring;
+    PgTraceAshSample *recent;
+    TimestampTz spilled_to;
+    uint64 seq;
+    int nrecent = 0;
+    int i;
+    DIR *dir;
+    struct dirent *de;
+
+    if (!ash_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    /* Samples still only in memory, and where the disk part ends */
+    ring = AshRing(ash_shared);
+    recent = (PgTraceAshSample *)
+        palloc(ash_shared->ring_size * sizeof(PgTraceAshSample));
+
+    LWLockAcquire(&ash_shared->lock, LW_SHARED);
+    spilled_to = ash_shared->spilled_to;
+    for (seq = ash_shared->spilled; seq < ash_shared->head; seq++)
+    {
+        PgTraceAshSample *sample = &ring[seq % ash_shared->ring_size];
+
+        if (sample->sample_time >= from && sample->sample_time <= to)
+            recent[nrecent++] = *sample;
+    }
+    LWLockRelease(&ash_shared->lock);
+
+    /* Segments overlapping the range; newer ones are covered by the ring copy */
+    if (from <= spilled_to)
+    {
+        dir = AllocateDir(PG_TRACE_ASH_DIR);
+        while ((de = ReadDirExtended(dir, PG_TRACE_ASH_DIR, DEBUG1)) != NULL)
+        {
+            char path[MAXPGPATH];
+            TimestampTz seg_from;
+            TimestampTz seg_to;
+
+            if (!ash_parse_segment_name(de->d_name, &seg_from, &seg_to))
+                continue;
+            if (seg_to > spilled_to || seg_to < from || seg_from > to)
+                continue;
+
+            snprintf(path, MAXPGPATH, "%s/%s", PG_TRACE_ASH_DIR, de->d_name);
+            ash_read_segment(rsinfo, path, from, to);
+        }
+        FreeDir(dir);
+    }
+
+    for (i = 0; i < nrecent; i++)
+        ash_put_sample(rsinfo, &recent[i]);
+
+    return (Datum) 0;
+}
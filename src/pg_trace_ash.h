@@ -0,0 +1,84 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_ash.h
+ *    Instance-wide active session history
+ *
+ * A background worker samples every PGPROC at pg_trace.ash_interval_ms
+ * without taking ProcArrayLock: all fields are read with plain loads and
+ * an occasionally torn sample is accepted. Only the blocker of a lock
+ * wait on something other than a transaction id takes a lock manager
+ * partition lock, in shared mode.
+ * Samples of non-idle sessions go into a ring in shared memory; the
+ * worker spills the older half of the ring into segment files under
+ * $PGDATA/pg_trace_ash, whose names carry the time range they cover so
+ * pg_trace_ash(from, to) opens only the segments it needs.
+ *
+ * The running statement is not in PGPROC, so each backend publishes its
+ * sql_id in its own slot with a single atomic store.
+ *
+ * The worker also counts, per backend, the active samples seen in each
+ * wait event class. A backend reads its own counters before and after a
+ * statement to split the statement's wait time by class.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_ASH_H
+#define PG_TRACE_ASH_H
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "executor/execdesc.h"
+#include "storage/proc.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#define PG_TRACE_ASH_DIR        "pg_trace_ash"
+
+/* On CPU (0), then the wait event classes by the top byte of PG_WAIT_* */
+#define PG_TRACE_ASH_WAIT_CLASSES   ((PG_WAIT_IO >> 24) + 1)
+#define PgTraceAshWaitClass(info)   ((info) >> 24)
+
+/* Session state, as far as PGPROC tells */
+typedef enum PgTraceAshState
+{
+    PG_TRACE_ASH_ACTIVE,
+    PG_TRACE_ASH_IDLE_IN_XACT
+} PgTraceAshState;
+
+/* One sample of one session */
+typedef struct PgTraceAshSample
+{
+    TimestampTz sample_time;
+    uint64 sql_id;              /* 0 when not executing a statement */
+    int32 pid;
+    int32 blocker_pid;          /* 0 when unknown or not blocked */
+    Oid dbid;
+    Oid roleid;
+    uint32 wait_event_info;     /* 0 means on CPU */
+    uint8 state;                /* PgTraceAshState */
+} PgTraceAshSample;
+
+/* GUCs */
+extern bool pg_trace_ash;
+extern int pg_trace_ash_interval_ms;
+extern int pg_trace_ash_buffer_samples;
+extern int pg_trace_ash_retention;
+
+extern Size pg_trace_ash_shmem_size(void);
+extern void pg_trace_ash_shmem_init(void);
+extern void pg_trace_ash_register_worker(void);
+
+/* Called by every backend around its outermost statement */
+extern void pg_trace_ash_begin(QueryDesc *queryDesc, uint64 sql_id);
+extern void pg_trace_ash_end(QueryDesc *queryDesc);
+extern void pg_trace_ash_abort(SubTransactionId subid);
+
+/* Lock-free lookups, also safe in a signal handler */
+extern uint64 pg_trace_ash_sql_id(BackendId backend_id);
+extern PGPROC *pg_trace_ash_blocker(PGPROC *waiter);
+extern bool pg_trace_ash_wait_counts(uint64 *counts);
+
+extern PGDLLEXPORT void pg_trace_ash_main(Datum main_arg);
+
+#endif /* PG_TRACE_ASH_H */
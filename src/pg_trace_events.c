@@ -0,0 +1,273 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_events.c
+ *    Per-backend lock-free rings of trace events in shared memory
+ *
+ * Traced cursors append PARSE, EXEC and END EXEC events to their
+ * backend's ring; pg_trace_read_events() drains all rings and
+ * pg_trace_event_rings() shows how many events each ring holds and has
+ * dropped because it was full.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/backendid.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+
+#include "pg_trace_events.h"
+
+#define EVENTS_TRANCHE_NAME     "pg_trace_events"
+
+/* Shared header; MaxBackends rings follow, ring_stride bytes apart */
+typedef struct PgTraceEventsShared
+{
+    LWLock lock;                /* Serializes consumers only */
+    int lock_tranche;
+    int nrings;
+    int ring_size;              /* Events per ring */
+    Size ring_stride;
+} PgTraceEventsShared;
+
+#define EventRing(shared, i) \
+    ((PgTraceEventRing *) ((char *) (shared) + CACHELINEALIGN(sizeof(PgTraceEventsShared)) + \
+                           (Size) (i) * (shared)->ring_stride))
+
+/* GUC */
+int pg_trace_event_ring_size = 1000;
+
+static PgTraceEventsShared *events_shared = NULL;
+static PgTraceEventRing *my_ring = NULL;
+
+PG_FUNCTION_INFO_V1(pg_trace_read_events);
+PG_FUNCTION_INFO_V1(pg_trace_event_rings);
+
+/*
+ * Bytes per backend ring, cache line aligned
+ */
+static Size
+ring_stride(void)
+{
+    return CACHELINEALIGN(add_size(offsetof(PgTraceEventRing, events),
+                                   mul_size(pg_trace_event_ring_size, sizeof(PgTraceEvent))));
+}
+
+Size
+pg_trace_events_shmem_size(void)
+{
+    return add_size(CACHELINEALIGN(sizeof(PgTraceEventsShared)),
+                    mul_size(MaxBackends, ring_stride()));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_events_shmem_init(void)
+{
+    bool found;
+    int i;
+
+    events_shared = ShmemInitStruct("pg_trace_events", pg_trace_events_shmem_size(), &found);
+
+    if (!found)
+    {
+        events_shared->lock_tranche = LWLockNewTrancheId();
+        LWLockInitialize(&events_shared->lock, events_shared->lock_tranche);
+        events_shared->nrings = MaxBackends;
+        events_shared->ring_size = pg_trace_event_ring_size;
+        events_shared->ring_stride = ring_stride();
+
+        for (i = 0; i < events_shared->nrings; i++)
+        {
+            PgTraceEventRing *ring = EventRing(events_shared, i);
+
+            pg_atomic_init_u64(&ring->head, 0);
+            pg_atomic_init_u64(&ring->dropped, 0);
+            pg_atomic_init_u64(&ring->tail, 0);
+            ring->pid = 0;
+        }
+    }
+
+    LWLockRegisterTranche(events_shared->lock_tranche, EVENTS_TRANCHE_NAME);
+}
+
+/*
+ * Append an event to this backend's ring. Only this backend writes head
+ * and dropped, so plain atomic stores suffice; the write barrier makes the
+ * event visible before the consumer can see the new head.
+ */
+void
+pg_trace_events_emit(PgTraceEventType type, int64 cursor_id, uint64 sql_id,
+                     double duration_ms, int64 rows,
+                     int64 shared_blks_hit, int64 shared_blks_read)
+{
+    PgTraceEventRing *ring;
+    PgTraceEvent *event;
+    uint64 head;
+    uint64 tail;
+
+    if (!my_ring)
+    {
+        if (!events_shared || MyBackendId == InvalidBackendId ||
+            MyBackendId > events_shared->nrings)
+            return;
+        my_ring = EventRing(events_shared, MyBackendId - 1);
+        my_ring->pid = MyProcPid;
+    }
+    ring = my_ring;
+
+    head = pg_atomic_read_u64(&ring->head);
+    tail = pg_atomic_read_u64(&ring->tail);
+
+    if (head - tail >= (uint64) events_shared->ring_size)
+    {
+        pg_atomic_write_u64(&ring->dropped, pg_atomic_read_u64(&ring->dropped) + 1);
+        return;
+    }
+
+    event = &ring->events[head % events_shared->ring_size];
+    event->timestamp = GetCurrentTimestamp();
+    event->pid = MyProcPid;
+    event->type = type;
+    event->cursor_id = cursor_id;
+    event->sql_id = sql_id;
+    event->duration_ms = duration_ms;
+    event->rows = rows;
+    event->shared_blks_hit = shared_blks_hit;
+    event->shared_blks_read = shared_blks_read;
+
+    pg_write_barrier();
+    pg_atomic_write_u64(&ring->head, head + 1);
+}
+
+static void
+check_loaded(void)
+{
+    if (!events_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * SQL function: pg_trace_read_events()
+ * Drain the event rings of all backends. Consumers serialize on the
+ * events lock; producers never touch it.
+ */
+Datum
+pg_trace_read_events(PG_FUNCTION_ARGS)
+{
+    static const char *const event_names[] = {"PARSE", "EXEC", "END EXEC"};
+    ReturnSetInfo *rsinfo;
+    PgTraceEvent *batch;
+    int i;
+
+    check_loaded();
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    batch = (PgTraceEvent *) palloc(events_shared->ring_size * sizeof(PgTraceEvent));
+
+    LWLockAcquire(&events_shared->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < events_shared->nrings; i++)
+    {
+        PgTraceEventRing *ring = EventRing(events_shared, i);
+        uint64 head;
+        uint64 tail;
+        uint64 pos;
+        int n = 0;
+        int j;
+
+        tail = pg_atomic_read_u64(&ring->tail);
+        head = pg_atomic_read_u64(&ring->head);
+        if (head == tail)
+            continue;
+
+        /* Pairs with the producer's write barrier before advancing head */
+        pg_read_barrier();
+
+        for (pos = tail; pos < head; pos++)
+            batch[n++] = ring->events[pos % events_shared->ring_size];
+
+        /* Finish copying before handing the slots back to the producer */
+        pg_memory_barrier();
+        pg_atomic_write_u64(&ring->tail, head);
+
+        for (j = 0; j < n; j++)
+        {
+            PgTraceEvent *event = &batch[j];
+            Datum values[9];
+            bool nulls[9];
+
+            memset(nulls, 0, sizeof(nulls));
+
+            values[0] = TimestampTzGetDatum(event->timestamp);
+            values[1] = Int32GetDatum(event->pid);
+            values[2] = CStringGetTextDatum(event_names[event->type]);
+            values[3] = Int64GetDatum(event->cursor_id);
+            values[4] = Int64GetDatum((int64) event->sql_id);
+            values[5] = Float8GetDatum(event->duration_ms);
+            values[6] = Int64GetDatum(event->rows);
+            values[7] = Int64GetDatum(event->shared_blks_hit);
+            values[8] = Int64GetDatum(event->shared_blks_read);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+    }
+
+    LWLockRelease(&events_shared->lock);
+
+    pfree(batch);
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: pg_trace_event_rings()
+ * Fill level and lost events of every ring that has been used. Reads
+ * without the lock: the counters are only ever advanced.
+ */
+Datum
+pg_trace_event_rings(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo;
+    int i;
+
+    check_loaded();
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    for (i = 0; i < events_shared->nrings; i++)
+    {
+        PgTraceEventRing *ring = EventRing(events_shared, i);
+        uint64 tail = pg_atomic_read_u64(&ring->tail);
+        uint64 head = pg_atomic_read_u64(&ring->head);
+        uint64 dropped = pg_atomic_read_u64(&ring->dropped);
+        Datum values[5];
+        bool nulls[5];
+
+        if (head == 0 && dropped == 0)
+            continue;
+
+        memset(nulls, 0, sizeof(nulls));
+
+        values[0] = Int32GetDatum(i + 1);
+        values[1] = Int32GetDatum(ring->pid);
+        values[2] = Int64GetDatum((int64) (head >= tail ? head - tail : 0));
+        values[3] = Int64GetDatum((int64) head);
+        values[4] = Int64GetDatum((int64) dropped);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
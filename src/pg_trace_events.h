@@ -0,0 +1,70 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_events.h
+ *    Per-backend lock-free rings of trace events in shared memory
+ *
+ * Each backend owns one single-producer / single-consumer ring, indexed
+ * by its BackendId. The owner is the only writer of the ring's head and
+ * dropped counter; the consumer is the only writer of the tail. Producers
+ * never take a lock or touch a cache line another producer writes, so
+ * event throughput scales with the number of traced backends. Consumers
+ * (pg_trace_read_events()) serialize among themselves on one LWLock.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_EVENTS_H
+#define PG_TRACE_EVENTS_H
+
+#include "postgres.h"
+
+#include "port/atomics.h"
+#include "utils/timestamp.h"
+
+/* Event types */
+typedef enum PgTraceEventType
+{
+    PG_TRACE_EVENT_PARSE,
+    PG_TRACE_EVENT_EXEC,
+    PG_TRACE_EVENT_EXEC_END
+} PgTraceEventType;
+
+/* One buffered trace event */
+typedef struct PgTraceEvent
+{
+    TimestampTz timestamp;
+    int pid;
+    PgTraceEventType type;
+    int64 cursor_id;
+    uint64 sql_id;
+    double duration_ms;
+    int64 rows;
+    int64 shared_blks_hit;
+    int64 shared_blks_read;
+} PgTraceEvent;
+
+/*
+ * Per-backend ring header. head and tail live on separate cache lines so
+ * the producer and the consumer do not false-share.
+ */
+typedef struct PgTraceEventRing
+{
+    pg_atomic_uint64 head;      /* Next slot to write, producer only */
+    pg_atomic_uint64 dropped;   /* Events lost to a full ring, producer only */
+    int pid;                    /* Last owner, producer only */
+    char pad1[PG_CACHE_LINE_SIZE - 2 * sizeof(pg_atomic_uint64) - sizeof(int)];
+    pg_atomic_uint64 tail;      /* Next slot to read, consumer only */
+    char pad2[PG_CACHE_LINE_SIZE - sizeof(pg_atomic_uint64)];
+    PgTraceEvent events[FLEXIBLE_ARRAY_MEMBER];
+} PgTraceEventRing;
+
+/* GUC */
+extern int pg_trace_event_ring_size;
+
+extern Size pg_trace_events_shmem_size(void);
+extern void pg_trace_events_shmem_init(void);
+
+extern void pg_trace_events_emit(PgTraceEventType type, int64 cursor_id, uint64 sql_id,
+                                 double duration_ms, int64 rows,
+                                 int64 shared_blks_hit, int64 shared_blks_read);
+
+#endif /* PG_TRACE_EVENTS_H */
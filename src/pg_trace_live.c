@@ -0,0 +1,398 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_live.c
+ *    Live per-node progress of traced queries, readable from any session
+ *
+ * The owner publishes a snapshot when the query starts, every
+ * pg_trace.live_refresh_ms while ExecutorRun is active (from a timeout
+ * handler, so no allocation and no locks), and once more each time
+ * ExecutorRun returns.
+ * The timer is armed only inside ExecutorRun: outside of it the plan
+ * state may be torn down by an error at any moment.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "executor/instrument.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/backendid.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/timeout.h"
+
+#include "pg_trace_live.h"
+
+#define LIVE_READ_ATTEMPTS  1000
+
+/* Shared slots, MaxBackends of them */
+static PgTraceLiveSlot *live_slots = NULL;
+
+/* Owner state */
+static PgTraceLiveSlot *my_slot = NULL;
+static QueryDesc *live_query = NULL;
+static PgTracePlan *live_plan = NULL;
+static SubTransactionId live_subid = InvalidSubTransactionId;
+static int live_refresh_ms = 0;
+static TimeoutId live_timeout = MAX_TIMEOUTS;
+static volatile sig_atomic_t live_running = false;
+static volatile sig_atomic_t live_writing = false;
+
+PG_FUNCTION_INFO_V1(pg_trace_live);
+
+Size
+pg_trace_live_shmem_size(void)
+{
+    return mul_size(MaxBackends, sizeof(PgTraceLiveSlot));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_live_shmem_init(void)
+{
+    bool found;
+    int i;
+
+    live_slots = ShmemInitStruct("pg_trace_live",
+                                 pg_trace_live_shmem_size(),
+                                 &found);
+
+    if (!found)
+    {
+        memset(live_slots, 0, pg_trace_live_shmem_size());
+        for (i = 0; i < MaxBackends; i++)
+            pg_atomic_init_u32(&live_slots[i].changecount, 0);
+    }
+}
+
+/*
+ * Copy the current instrumentation into our slot. Runs in the timeout
+ * handler, so it must not allocate, elog or take locks.
+ */
+static void
+live_publish(void)
+{
+    PgTraceLiveSlot *slot = my_slot;
+    int nnodes;
+    int i;
+
+    if (!slot || !live_plan || live_writing)
+        return;
+
+    live_writing = true;
+
+    pg_atomic_write_u32(&slot->changecount,
+                        pg_atomic_read_u32(&slot->changecount) + 1);
+    pg_write_barrier();
+
+    nnodes = Min(live_plan->nnodes, PG_TRACE_LIVE_MAX_NODES);
+    for (i = 0; i < nnodes; i++)
+    {
+        PgTracePlanNode *pn = &live_plan->nodes[i];
+        PgTraceLiveNode *ln = &slot->nodes[i];
+        Instrumentation *instr = pn->planstate->instrument;
+
+        if (!instr)
+            continue;
+
+        ln->rows = instr->ntuples + instr->tuplecount;
+        ln->loops = instr->nloops + (instr->running ? 1 : 0);
+        ln->elapsed_ms = (instr->total + INSTR_TIME_GET_DOUBLE(instr->counter)) * 1000.0;
+        ln->shared_hit = instr->bufusage.shared_blks_hit;
+        ln->shared_read = instr->bufusage.shared_blks_read;
+        ln->temp_read = instr->bufusage.temp_blks_read;
+        ln->temp_written = instr->bufusage.temp_blks_written;
+    }
+    slot->snapshot_time = GetCurrentTimestamp();
+
+    pg_write_barrier();
+    pg_atomic_write_u32(&slot->changecount,
+                        pg_atomic_read_u32(&slot->changecount) + 1);
+
+    live_writing = false;
+}
+
+static void
+live_timeout_handler(void)
+{
+    if (live_running)
+        live_publish();
+}
+
+/*
+ * Per-backend setup; timeouts cannot be registered from the postmaster
+ */
+void
+pg_trace_live_init(void)
+{
+    if (my_slot)
+        return;
+
+    if (!live_slots || MyBackendId == InvalidBackendId || MyBackendId > MaxBackends)
+        return;
+
+    my_slot = &live_slots[MyBackendId - 1];
+    live_timeout = RegisterTimeout(USER_TIMEOUT, live_timeout_handler);
+}
+
+/*
+ * Start publishing queryDesc. Only one query per backend is published;
+ * a nested statement while the outer one is live is ignored.
+ */
+bool
+pg_trace_live_begin(QueryDesc *queryDesc, int64 cursor_id,
+                    const char *sql, PgTracePlan *plan, int refresh_ms)
+{
+    PgTraceLiveSlot *slot;
+    int i;
+
+    pg_trace_live_init();
+
+    if (!my_slot || live_query || !plan)
+        return false;
+
+    slot = my_slot;
+    live_query = queryDesc;
+    live_plan = plan;
+    live_subid = GetCurrentSubTransactionId();
+    live_refresh_ms = refresh_ms;
+
+    pg_atomic_write_u32(&slot->changecount,
+                        pg_atomic_read_u32(&slot->changecount) + 1);
+    pg_write_barrier();
+
+    slot->pid = MyProcPid;
+    slot->roleid = GetUserId();
+    slot->cursor_id = cursor_id;
+    slot->query_start = GetCurrentTimestamp();
+    slot->snapshot_time = slot->query_start;
+    strlcpy(slot->sql, sql ? sql : "", sizeof(slot->sql));
+
+    slot->nnodes = Min(plan->nnodes, PG_TRACE_LIVE_MAX_NODES);
+    for (i = 0; i < slot->nnodes; i++)
+    {
+        PgTracePlanNode *pn = &plan->nodes[i];
+        PgTraceLiveNode *ln = &slot->nodes[i];
+
+        memset(ln, 0, sizeof(PgTraceLiveNode));
+        ln->plan_node_id = pn->plan_node_id;
+        ln->parent_node_id = pn->parent >= 0 ? plan->nodes[pn->parent].plan_node_id : -1;
+        ln->depth = pn->depth;
+        strlcpy(ln->name, pn->name, sizeof(ln->name));
+        ln->plan_rows = pn->planstate->plan ? pn->planstate->plan->plan_rows : 0;
+    }
+
+    pg_write_barrier();
+    pg_atomic_write_u32(&slot->changecount,
+                        pg_atomic_read_u32(&slot->changecount) + 1);
+
+    return true;
+}
+
+/*
+ * Arm or disarm the refresh timer around ExecutorRun
+ */
+void
+pg_trace_live_run(QueryDesc *queryDesc, bool running)
+{
+    if (queryDesc != live_query || live_refresh_ms <= 0)
+        return;
+
+    if (running && !live_running)
+    {
+        live_running = true;
+        enable_timeout_every(live_timeout,
+                             TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                         live_refresh_ms),
+                             live_refresh_ms);
+    }
+    else if (!running && live_running)
+    {
+        live_running = false;
+        disable_timeout(live_timeout, false);
+        live_publish();
+    }
+}
+
+static void
+live_clear(void)
+{
+    if (live_running)
+    {
+        live_running = false;
+        disable_timeout(live_timeout, false);
+    }
+
+    if (my_slot)
+    {
+        pg_atomic_write_u32(&my_slot->changecount,
+                            pg_atomic_read_u32(&my_slot->changecount) + 1);
+        pg_write_barrier();
+        my_slot->pid = 0;
+        my_slot->nnodes = 0;
+        pg_write_barrier();
+        pg_atomic_write_u32(&my_slot->changecount,
+                            pg_atomic_read_u32(&my_slot->changecount) + 1);
+    }
+
+    live_query = NULL;
+    live_plan = NULL;
+    live_subid = InvalidSubTransactionId;
+}
+
+/*
+ * Final snapshot is not kept: once the query ends the trace file has it
+ */
+void
+pg_trace_live_end(QueryDesc *queryDesc)
+{
+    if (queryDesc != live_query)
+        return;
+
+    live_clear();
+}
+
+/*
+ * (Sub)transaction abort: the plan state is gone or about to be
+ */
+void
+pg_trace_live_abort(SubTransactionId subid)
+{
+    if (!live_query)
+        return;
+
+    if (subid == InvalidSubTransactionId || subid == live_subid)
+        live_clear();
+}
+
+/*
+ * A single unsynchronized read: a torn value only shows up while the
+ * owner switches queries
+ */
+int64
+pg_trace_live_cursor_id(int backend_id)
+{
+    PgTraceLiveSlot *slot;
+
+    if (!live_slots || backend_id <= 0 || backend_id > MaxBackends)
+        return 0;
+
+    slot = &live_slots[backend_id - 1];
+    if (slot->pid == 0)
+        return 0;
+
+    return slot->cursor_id;
+}
+
+/*
+ * Consistent copy of a slot; gives up rather than waiting on the owner
+ */
+static bool
+live_read_slot(PgTraceLiveSlot *slot, PgTraceLiveSlot *copy)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < LIVE_READ_ATTEMPTS; attempt++)
+    {
+        uint32 before;
+        uint32 after;
+
+        before = pg_atomic_read_u32(&slot->changecount);
+        pg_read_barrier();
+
+        if ((before & 1) == 0)
+        {
+            memcpy(copy, slot, sizeof(PgTraceLiveSlot));
+            pg_read_barrier();
+            after = pg_atomic_read_u32(&slot->changecount);
+            if (before == after)
+                return true;
+        }
+
+        CHECK_FOR_INTERRUPTS();
+        pg_spin_delay();
+    }
+
+    return false;
+}
+
+/*
+ * SQL function: pg_trace_live(pid integer)
+ * Current per-node counters of a traced query running in another backend
+ */
+Datum
+pg_trace_live(PG_FUNCTION_ARGS)
+{
+    int pid = PG_GETARG_INT32(0);
+    ReturnSetInfo *rsinfo;
+    PgTraceLiveSlot *copy;
+    bool visible;
+    int i;
+    int n;
+
+    if (!live_slots)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    copy = (PgTraceLiveSlot *) palloc(sizeof(PgTraceLiveSlot));
+
+    for (i = 0; i < MaxBackends; i++)
+    {
+        if (live_slots[i].pid != pid)
+            continue;
+
+        if (!live_read_slot(&live_slots[i], copy) || copy->pid != pid)
+        {
+            ereport(NOTICE,
+                    (errmsg("could not get a consistent snapshot of PID %d", pid)));
+            break;
+        }
+
+        visible = (copy->roleid == GetUserId() ||
+                   has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS));
+
+        for (n = 0; n < copy->nnodes; n++)
+        {
+            PgTraceLiveNode *ln = &copy->nodes[n];
+            Datum values[15];
+            bool nulls[15];
+
+            memset(nulls, 0, sizeof(nulls));
+
+            values[0] = Int64GetDatum(copy->cursor_id);
+            values[1] = TimestampTzGetDatum(copy->snapshot_time);
+            values[2] = Int32GetDatum(ln->plan_node_id);
+            values[3] = Int32GetDatum(ln->parent_node_id);
+            nulls[3] = (ln->parent_node_id < 0);
+            values[4] = Int32GetDatum(ln->depth);
+            values[5] = CStringGetTextDatum(ln->name);
+            values[6] = Float8GetDatum(ln->plan_rows);
+            values[7] = Float8GetDatum(ln->rows);
+            values[8] = Float8GetDatum(ln->loops);
+            values[9] = Float8GetDatum(ln->elapsed_ms);
+            values[10] = Int64GetDatum(ln->shared_hit);
+            values[11] = Int64GetDatum(ln->shared_read);
+            values[12] = Int64GetDatum(ln->temp_read);
+            values[13] = Int64GetDatum(ln->temp_written);
+            values[14] = CStringGetTextDatum(visible ? copy->sql : "<insufficient privilege>");
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        break;
+    }
+
+    pfree(copy);
+
+    return (Datum) 0;
+}
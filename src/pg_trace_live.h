@@ -0,0 +1,76 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_live.h
+ *    Live per-node progress of traced queries, readable from any session
+ *
+ * Every backend owns one slot in shared memory, indexed by its BackendId.
+ * While a traced query runs, the owner periodically copies the plan's
+ * Instrumentation counters into its slot under a change counter (seqlock).
+ * Readers retry on a torn copy and never take a lock, so the traced
+ * backend is never blocked by pg_trace_live().
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_LIVE_H
+#define PG_TRACE_LIVE_H
+
+#include "postgres.h"
+
+#include "executor/execdesc.h"
+#include "port/atomics.h"
+#include "utils/timestamp.h"
+
+#include "pg_trace_plan.h"
+
+#define PG_TRACE_LIVE_MAX_NODES     64      /* Nodes published per query */
+#define PG_TRACE_LIVE_SQL_LEN       256     /* Leading part of SQL text */
+#define PG_TRACE_LIVE_NAME_LEN      24
+
+/* Snapshot of one plan node */
+typedef struct PgTraceLiveNode
+{
+    int32 plan_node_id;
+    int32 parent_node_id;
+    int32 depth;
+    char name[PG_TRACE_LIVE_NAME_LEN];
+    double plan_rows;
+    double rows;                /* Finished loops + current loop */
+    double loops;
+    double elapsed_ms;
+    int64 shared_hit;
+    int64 shared_read;
+    int64 temp_read;
+    int64 temp_written;
+} PgTraceLiveNode;
+
+/* One backend's slot */
+typedef struct PgTraceLiveSlot
+{
+    pg_atomic_uint32 changecount;   /* Odd while the owner is writing */
+    int pid;                        /* 0 when no traced query is running */
+    Oid roleid;
+    int64 cursor_id;
+    TimestampTz query_start;
+    TimestampTz snapshot_time;
+    int nnodes;
+    char sql[PG_TRACE_LIVE_SQL_LEN];
+    PgTraceLiveNode nodes[PG_TRACE_LIVE_MAX_NODES];
+} PgTraceLiveSlot;
+
+/* Shared memory */
+extern Size pg_trace_live_shmem_size(void);
+extern void pg_trace_live_shmem_init(void);
+
+/* Owner side */
+extern void pg_trace_live_init(void);
+extern bool pg_trace_live_begin(QueryDesc *queryDesc, int64 cursor_id,
+                                const char *sql, PgTracePlan *plan,
+                                int refresh_ms);
+extern void pg_trace_live_run(QueryDesc *queryDesc, bool running);
+extern void pg_trace_live_end(QueryDesc *queryDesc);
+extern void pg_trace_live_abort(SubTransactionId subid);
+
+/* Cursor a backend is publishing, 0 if none; lock-free, signal safe */
+extern int64 pg_trace_live_cursor_id(int backend_id);
+
+#endif /* PG_TRACE_LIVE_H */
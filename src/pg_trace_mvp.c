@@ -27,6 +27,8 @@
 #include "executor/instrument.h"
 #include "miscadmin.h"
 #include "optimizer/planner.h"
+#include "port/atomics.h"
+#include "storage/backendid.h"
 #include "storage/ipc.h"
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
@@ -60,23 +62,28 @@ typedef struct CurrentQuery {
 
 static CurrentQuery *current_query = NULL;
 
-/* Shared memory for eBPF coordination */
+/*
+ * Map PID to cursor_id for eBPF, one slot per backend indexed by BackendId.
+ * Only the owning backend writes its slot, so no lock is needed; the
+ * generation is odd while (pid, cursor_id) is being updated, and readers
+ * retry until they see the same even generation before and after.
+ */
+typedef struct PgTraceCursorSlot {
+    pg_atomic_uint64 generation;
+    int pid;                    /* 0 when no cursor is registered */
+    int64 cursor_id;
+} PgTraceCursorSlot;
+
 typedef struct PgTraceSharedState {
-    LWLock *lock;
-    
-    /* Map PID to cursor_id for eBPF */
-    struct {
-        int pid;
-        int64 cursor_id;
-        bool active;
-    } pid_map[100];  /* Simple fixed array for MVP */
-    
-    int next_slot;
+    int nslots;                 /* MaxBackends */
+    PgTraceCursorSlot slots[FLEXIBLE_ARRAY_MEMBER];
 } PgTraceSharedState;
 
 static PgTraceSharedState *shared_state = NULL;
+static PgTraceCursorSlot *my_cursor_slot = NULL;
 
 /* Saved hooks */
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static planner_hook_type prev_planner_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
@@ -88,6 +95,7 @@ void _PG_init(void);
 void _PG_fini(void);
 
 static Size pg_trace_shmem_size(void);
+static void pg_trace_shmem_request(void);
 static void pg_trace_shmem_startup(void);
 static void trace_printf(const char *fmt, ...) pg_attribute_printf(1, 2);
 static void write_plan_node(PlanState *planstate, int level);
@@ -127,11 +135,10 @@ _PG_init(void)
                                0,
                                NULL, NULL, NULL);
 
-    /* Shared memory */
-    RequestAddinShmemSpace(pg_trace_shmem_size());
-    RequestNamedLWLockTranche("pg_trace_mvp", 1);
-
     /* Install hooks */
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = pg_trace_shmem_request;
+
     prev_shmem_startup_hook = shmem_startup_hook;
     shmem_startup_hook = pg_trace_shmem_startup;
 
@@ -153,6 +160,7 @@ _PG_init(void)
 void
 _PG_fini(void)
 {
+    shmem_request_hook = prev_shmem_request_hook;
     shmem_startup_hook = prev_shmem_startup_hook;
     planner_hook = prev_planner_hook;
     ExecutorStart_hook = prev_ExecutorStart_hook;
@@ -166,7 +174,17 @@ _PG_fini(void)
 static Size
 pg_trace_shmem_size(void)
 {
-    return MAXALIGN(sizeof(PgTraceSharedState));
+    return add_size(offsetof(PgTraceSharedState, slots),
+                    mul_size(MaxBackends, sizeof(PgTraceCursorSlot)));
+}
+
+static void
+pg_trace_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(pg_trace_shmem_size());
 }
 
 static void
@@ -185,9 +203,15 @@ pg_trace_shmem_startup(void)
 
     if (!found)
     {
-        shared_state->lock = &(GetNamedLWLockTranche("pg_trace_mvp")->lock);
-        shared_state->next_slot = 0;
-        memset(shared_state->pid_map, 0, sizeof(shared_state->pid_map));
+        int i;
+
+        shared_state->nslots = MaxBackends;
+        for (i = 0; i < shared_state->nslots; i++)
+        {
+            pg_atomic_init_u64(&shared_state->slots[i].generation, 0);
+            shared_state->slots[i].pid = 0;
+            shared_state->slots[i].cursor_id = 0;
+        }
     }
 
     LWLockRelease(AddinShmemInitLock);
@@ -214,54 +238,49 @@ trace_printf(const char *fmt, ...)
 }
 
 /*
- * Register current cursor with eBPF (via shared memory)
+ * Publish (pid, cursor_id) in this backend's slot
  */
 static void
-register_cursor_for_ebpf(int64 cursor_id)
+set_cursor_slot(int pid, int64 cursor_id)
 {
-    int i;
+    PgTraceCursorSlot *slot;
+    uint64 generation;
 
     if (!shared_state)
         return;
 
-    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
-
-    /* Find a slot */
-    for (i = 0; i < 100; i++)
+    if (!my_cursor_slot)
     {
-        if (!shared_state->pid_map[i].active)
-        {
-            shared_state->pid_map[i].pid = MyProcPid;
-            shared_state->pid_map[i].cursor_id = cursor_id;
-            shared_state->pid_map[i].active = true;
-            break;
-        }
+        if (MyBackendId == InvalidBackendId || MyBackendId > shared_state->nslots)
+            return;
+        my_cursor_slot = &shared_state->slots[MyBackendId - 1];
     }
+    slot = my_cursor_slot;
+
+    generation = pg_atomic_read_u64(&slot->generation);
+    pg_atomic_write_u64(&slot->generation, generation + 1);
+    pg_write_barrier();
+
+    slot->pid = pid;
+    slot->cursor_id = cursor_id;
 
-    LWLockRelease(shared_state->lock);
+    pg_write_barrier();
+    pg_atomic_write_u64(&slot->generation, generation + 2);
 }
 
+/*
+ * Register current cursor with eBPF (via shared memory)
+ */
 static void
-unregister_cursor_for_ebpf(void)
+register_cursor_for_ebpf(int64 cursor_id)
 {
-    int i;
-
-    if (!shared_state)
-        return;
-
-    LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
-
-    for (i = 0; i < 100; i++)
-    {
-        if (shared_state->pid_map[i].active &&
-            shared_state->pid_map[i].pid == MyProcPid)
-        {
-            shared_state->pid_map[i].active = false;
-            break;
-        }
-    }
+    set_cursor_slot(MyProcPid, cursor_id);
+}
 
-    LWLockRelease(shared_state->lock);
+static void
+unregister_cursor_for_ebpf(void)
+{
+    set_cursor_slot(0, 0);
 }
 
 /*
@@ -0,0 +1,236 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_plan.c
+ *    Plan tree helpers shared by the tracing modules
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "common/hashfn.h"
+#include "executor/executor.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/plannodes.h"
+#include "utils/rel.h"
+
+#include "pg_trace_plan.h"
+
+/* Marks the end of a node's children so different shapes hash apart */
+#define PLAN_ID_END_CHILDREN    UINT64CONST(0x9e3779b97f4a7c15)
+
+typedef struct FlattenContext
+{
+    PgTracePlan *plan;
+    int parent;
+    int depth;
+} FlattenContext;
+
+/*
+ * Short node type name, without spaces so it can be used as a path
+ * component (flame graphs) as well as in trace lines.
+ */
+const char *
+pg_trace_plan_node_name(Plan *plan)
+{
+    if (!plan)
+        return "Unknown";
+
+    switch (nodeTag(plan))
+    {
+        case T_Result:              return "Result";
+        case T_ProjectSet:          return "ProjectSet";
+        case T_ModifyTable:         return "ModifyTable";
+        case T_Append:              return "Append";
+        case T_MergeAppend:         return "MergeAppend";
+        case T_RecursiveUnion:      return "RecursiveUnion";
+        case T_BitmapAnd:           return "BitmapAnd";
+        case T_BitmapOr:            return "BitmapOr";
+        case T_SeqScan:             return "SeqScan";
+        case T_SampleScan:          return "SampleScan";
+        case T_IndexScan:           return "IndexScan";
+        case T_IndexOnlyScan:       return "IndexOnlyScan";
+        case T_BitmapIndexScan:     return "BitmapIndexScan";
+        case T_BitmapHeapScan:      return "BitmapHeapScan";
+        case T_TidScan:             return "TidScan";
+        case T_TidRangeScan:        return "TidRangeScan";
+        case T_SubqueryScan:        return "SubqueryScan";
+        case T_FunctionScan:        return "FunctionScan";
+        case T_ValuesScan:          return "ValuesScan";
+        case T_TableFuncScan:       return "TableFuncScan";
+        case T_CteScan:             return "CteScan";
+        case T_NamedTuplestoreScan: return "NamedTuplestoreScan";
+        case T_WorkTableScan:       return "WorkTableScan";
+        case T_ForeignScan:         return "ForeignScan";
+        case T_CustomScan:          return "CustomScan";
+        case T_NestLoop:            return "NestLoop";
+        case T_MergeJoin:           return "MergeJoin";
+        case T_HashJoin:            return "HashJoin";
+        case T_Material:            return "Material";
+        case T_Memoize:             return "Memoize";
+        case T_Sort:                return "Sort";
+        case T_IncrementalSort:     return "IncrementalSort";
+        case T_Group:               return "Group";
+        case T_Agg:                 return "Agg";
+        case T_WindowAgg:           return "WindowAgg";
+        case T_Unique:              return "Unique";
+        case T_Gather:              return "Gather";
+        case T_GatherMerge:         return "GatherMerge";
+        case T_Hash:                return "Hash";
+        case T_SetOp:               return "SetOp";
+        case T_LockRows:            return "LockRows";
+        case T_Limit:               return "Limit";
+        default:                    return "Unknown";
+    }
+}
+
+/*
+ * Walker callbacks: the first pass only counts nodes, the second fills
+ * the pre-allocated array. planstate_tree_walker() takes care of the
+ * node-specific child lists (Append, BitmapAnd, subplans, ...).
+ */
+static bool
+count_walker(PlanState *planstate, void *context)
+{
+    (*(int *) context)++;
+    return planstate_tree_walker(planstate, count_walker, context);
+}
+
+static bool
+fill_walker(PlanState *planstate, void *context)
+{
+    FlattenContext *fc = (FlattenContext *) context;
+    PgTracePlanNode *node;
+    int index;
+    int saved_parent;
+    bool result;
+
+    index = fc->plan->nnodes++;
+    node = &fc->plan->nodes[index];
+    node->planstate = planstate;
+    node->plan_node_id = planstate->plan ? planstate->plan->plan_node_id : -1;
+    node->parent = fc->parent;
+    node->depth = fc->depth;
+    node->name = pg_trace_plan_node_name(planstate->plan);
+
+    saved_parent = fc->parent;
+    fc->parent = index;
+    fc->depth++;
+    result = planstate_tree_walker(planstate, fill_walker, context);
+    fc->depth--;
+    fc->parent = saved_parent;
+
+    return result;
+}
+
+/*
+ * Flatten a PlanState tree into a pre-ordered array allocated in cxt
+ */
+PgTracePlan *
+pg_trace_plan_flatten(PlanState *planstate, MemoryContext cxt)
+{
+    PgTracePlan *plan;
+    FlattenContext fc;
+    int count = 0;
+
+    plan = (PgTracePlan *) MemoryContextAllocZero(cxt, sizeof(PgTracePlan));
+    if (!planstate)
+        return plan;
+
+    count_walker(planstate, &count);
+
+    plan->nodes = (PgTracePlanNode *)
+        MemoryContextAllocZero(cxt, count * sizeof(PgTracePlanNode));
+
+    fc.plan = plan;
+    fc.parent = -1;
+    fc.depth = 0;
+    fill_walker(planstate, &fc);
+
+    return plan;
+}
+
+/* Relation name, or 0 when the executor has not opened one */
+static uint64
+plan_id_relname(Relation rel)
+{
+    const char *name;
+
+    if (!rel)
+        return 0;
+
+    name = RelationGetRelationName(rel);
+    return hash_bytes_extended((const unsigned char *) name, strlen(name), 0);
+}
+
+/*
+ * Fold one node into the plan fingerprint: node type plus the names of
+ * the relation and index it reads, so the same shape over different
+ * objects differs. Names, not OIDs, so that plan_id survives a dump and
+ * restore or an upgrade; they come from the relations the executor has
+ * already opened, at no catalog lookup.
+ */
+static bool
+plan_id_walker(PlanState *planstate, void *context)
+{
+    uint64 *hash = (uint64 *) context;
+    Plan *plan = planstate->plan;
+    Relation index = NULL;
+    bool result;
+
+    switch (nodeTag(planstate))
+    {
+        case T_IndexScanState:
+            index = ((IndexScanState *) planstate)->iss_RelationDesc;
+            break;
+        case T_IndexOnlyScanState:
+            index = ((IndexOnlyScanState *) planstate)->ioss_RelationDesc;
+            break;
+        case T_BitmapIndexScanState:
+            index = ((BitmapIndexScanState *) planstate)->biss_RelationDesc;
+            break;
+        default:
+            break;
+    }
+
+    *hash = hash_combine64(*hash, (uint64) nodeTag(plan));
+
+    switch (nodeTag(plan))
+    {
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_IndexScan:
+        case T_IndexOnlyScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+        case T_TidRangeScan:
+            *hash = hash_combine64(*hash,
+                                   plan_id_relname(((ScanState *) planstate)->ss_currentRelation));
+            break;
+        default:
+            break;
+    }
+    if (index)
+        *hash = hash_combine64(*hash, plan_id_relname(index));
+
+    result = planstate_tree_walker(planstate, plan_id_walker, context);
+
+    *hash = hash_combine64(*hash, PLAN_ID_END_CHILDREN);
+
+    return result;
+}
+
+/*
+ * Fingerprint of the plan shape (plan_id), stable across executions
+ */
+uint64
+pg_trace_plan_id(PlanState *planstate)
+{
+    uint64 hash = 0;
+
+    if (!planstate)
+        return 0;
+
+    plan_id_walker(planstate, &hash);
+
+    return hash;
+}
@@ -0,0 +1,43 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_plan.h
+ *    Plan tree helpers shared by the tracing modules
+ *
+ * The executor hands us a PlanState tree. Several consumers (live
+ * progress, samplers, exporters) need a flat, pre-ordered view of it that
+ * can be walked cheaply - including from a signal handler, where we can
+ * neither allocate nor recurse through node-specific child lists.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_PLAN_H
+#define PG_TRACE_PLAN_H
+
+#include "postgres.h"
+
+#include "nodes/execnodes.h"
+#include "utils/memutils.h"
+
+/* One plan node in pre-order */
+typedef struct PgTracePlanNode
+{
+    PlanState *planstate;
+    int plan_node_id;           /* Plan->plan_node_id */
+    int parent;                 /* Index of parent in the array, -1 for root */
+    int depth;                  /* Nesting depth, root is 0 */
+    const char *name;           /* Static node type name ("SeqScan") */
+} PgTracePlanNode;
+
+/* Flattened plan tree */
+typedef struct PgTracePlan
+{
+    int nnodes;
+    PgTracePlanNode *nodes;
+} PgTracePlan;
+
+/* Function declarations */
+extern const char *pg_trace_plan_node_name(Plan *plan);
+extern PgTracePlan *pg_trace_plan_flatten(PlanState *planstate, MemoryContext cxt);
+extern uint64 pg_trace_plan_id(PlanState *planstate);
+
+#endif /* PG_TRACE_PLAN_H */
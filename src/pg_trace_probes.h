@@ -0,0 +1,64 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_probes.h
+ *    USDT probes at the trace points, for perf, bpftrace and SystemTap
+ *
+ * Built with -DPG_TRACE_USDT (the Makefile adds it when <sys/sdt.h> is
+ * present), each probe is a single nop in the code plus a note in the
+ * .note.stapsdt section; a tracer attaching to pg_trace:<name> patches
+ * the nop. Otherwise the macros expand to nothing.
+ *
+ * Probes fire where the trace file is written, so only in sessions that
+ * are being traced. Arguments are values the trace point already has at
+ * hand, so nothing is computed for the probes alone. Times are in
+ * microseconds, ids are the ones written to the trace file:
+ *
+ *   parse_start   (cursor_id, sql_id, query text)
+ *   parse_done    (cursor_id, sql_id, ela_us)
+ *   bind          (cursor_id, index, type oid, value text or NULL)
+ *   exec_start    (cursor_id, sql_id)
+ *   exec_done     (cursor_id, sql_id, ela_us, rows), ela_us and rows 0 on error
+ *   node_done     (cursor_id, plan_node_id, rows, loops, total_us)
+ *   block_read    (cursor_id, relfilenode, block, ela_us)
+ *
+ * Example:
+ *   bpftrace -e 'usdt:$libdir/pg_trace_ultimate.so:pg_trace:exec_done
+ *                { @[arg1] = hist(arg2); }'
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_PROBES_H
+#define PG_TRACE_PROBES_H
+
+#ifdef PG_TRACE_USDT
+
+#include <sys/sdt.h>
+
+#define PG_TRACE_PROBE_PARSE_START(cursor_id, sql_id, text) \
+    DTRACE_PROBE3(pg_trace, parse_start, cursor_id, sql_id, text)
+#define PG_TRACE_PROBE_PARSE_DONE(cursor_id, sql_id, ela_us) \
+    DTRACE_PROBE3(pg_trace, parse_done, cursor_id, sql_id, ela_us)
+#define PG_TRACE_PROBE_BIND(cursor_id, index, type, value) \
+    DTRACE_PROBE4(pg_trace, bind, cursor_id, index, type, value)
+#define PG_TRACE_PROBE_EXEC_START(cursor_id, sql_id) \
+    DTRACE_PROBE2(pg_trace, exec_start, cursor_id, sql_id)
+#define PG_TRACE_PROBE_EXEC_DONE(cursor_id, sql_id, ela_us, rows) \
+    DTRACE_PROBE4(pg_trace, exec_done, cursor_id, sql_id, ela_us, rows)
+#define PG_TRACE_PROBE_NODE_DONE(cursor_id, node_id, rows, loops, total_us) \
+    DTRACE_PROBE5(pg_trace, node_done, cursor_id, node_id, rows, loops, total_us)
+#define PG_TRACE_PROBE_BLOCK_READ(cursor_id, relnode, block, ela_us) \
+    DTRACE_PROBE4(pg_trace, block_read, cursor_id, relnode, block, ela_us)
+
+#else
+
+#define PG_TRACE_PROBE_PARSE_START(cursor_id, sql_id, text)
+#define PG_TRACE_PROBE_PARSE_DONE(cursor_id, sql_id, ela_us)
+#define PG_TRACE_PROBE_BIND(cursor_id, index, type, value)
+#define PG_TRACE_PROBE_EXEC_START(cursor_id, sql_id)
+#define PG_TRACE_PROBE_EXEC_DONE(cursor_id, sql_id, ela_us, rows)
+#define PG_TRACE_PROBE_NODE_DONE(cursor_id, node_id, rows, loops, total_us)
+#define PG_TRACE_PROBE_BLOCK_READ(cursor_id, relnode, block, ela_us)
+
+#endif /* PG_TRACE_USDT */
+
+#endif /* PG_TRACE_PROBES_H */
@@ -8,13 +8,21 @@
  */
 #include "postgres.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
 #include "lib/stringinfo.h"
+#include "storage/fd.h"
+
 #include "pg_trace_procfs.h"
 
 /* System clock ticks per second */
@@ -62,6 +70,185 @@ proc_read_cpu_stats_rusage(ProcCpuStats *stats)
     return true;
 }
 
+/*---- Persistent /proc/self files ----*/
+
+/*
+ * The files of our own process are opened once per backend and reread
+ * with pread() at offset 0: procfs regenerates the content on every read
+ * from the start. That saves the open/close and the stdio buffer per
+ * query. Descriptors opened before fork() would describe the postmaster,
+ * so they are tied to the pid that opened them.
+ */
+typedef enum ProcFile
+{
+    PROC_FILE_STAT,
+    PROC_FILE_IO,
+    PROC_FILE_STATUS,
+    PROC_FILE_SCHEDSTAT,
+    PROC_FILE_COUNT
+} ProcFile;
+
+static const char *const proc_file_names[PROC_FILE_COUNT] = {
+    "stat", "io", "status", "schedstat"
+};
+
+static int proc_fds[PROC_FILE_COUNT] = {-1, -1, -1, -1};
+static pid_t proc_fds_pid = 0;
+
+#define PROC_BUFFER_SIZE    2048
+
+/*
+ * Descriptor of /proc/self/<file>, opened on first use. -1 if it cannot
+ * be opened (no permission on io, no schedstat in the kernel, ...).
+ */
+static int
+proc_self_fd(ProcFile file)
+{
+    pid_t self = getpid();
+    char path[64];
+    int i;
+
+    if (proc_fds_pid != self)
+    {
+        /* Inherited from the parent, they describe the parent */
+        for (i = 0; i < PROC_FILE_COUNT; i++)
+        {
+            if (proc_fds[i] >= 0)
+            {
+                close(proc_fds[i]);
+                ReleaseExternalFD();
+            }
+            proc_fds[i] = -1;
+        }
+        proc_fds_pid = self;
+    }
+
+    if (proc_fds[file] >= 0)
+        return proc_fds[file];
+
+    /* Counted against max_files_per_process like any other kept file */
+    if (!AcquireExternalFD())
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int) self, proc_file_names[file]);
+    proc_fds[file] = open(path, O_RDONLY | O_CLOEXEC);
+    if (proc_fds[file] < 0)
+        ReleaseExternalFD();
+
+    return proc_fds[file];
+}
+
+/*
+ * Read /proc/<pid>/<file> into buf as a NUL-terminated string. Our own
+ * process uses the kept descriptor, others a one-off open.
+ */
+static bool
+proc_read_file(pid_t pid, ProcFile file, char *buf, size_t size)
+{
+    ssize_t len;
+
+    if (pid == getpid())
+    {
+        int fd = proc_self_fd(file);
+
+        if (fd < 0)
+            return false;
+        len = pread(fd, buf, size - 1, 0);
+    }
+    else
+    {
+        char path[64];
+        int fd;
+
+        snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, proc_file_names[file]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        len = pread(fd, buf, size - 1, 0);
+        close(fd);
+    }
+
+    if (len <= 0)
+        return false;
+
+    buf[len] = '\0';
+    return true;
+}
+
+/*---- Scanner ----*/
+
+/*
+ * Parse an unsigned decimal at *p after optional blanks, advance past it
+ */
+static unsigned long long
+scan_ull(const char **p)
+{
+    const char *s = *p;
+    unsigned long long value = 0;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    while (*s >= '0' && *s <= '9')
+        value = value * 10 + (unsigned long long) (*s++ - '0');
+
+    *p = s;
+    return value;
+}
+
+/*
+ * Skip n blank-separated fields
+ */
+static const char *
+skip_fields(const char *p, int n)
+{
+    while (n-- > 0)
+    {
+        while (*p == ' ')
+            p++;
+        while (*p && *p != ' ')
+            p++;
+    }
+    return p;
+}
+
+/*
+ * Parse "key: value" lines: values[i] gets the value of the line whose
+ * key is keys[i], and stays untouched if there is none
+ */
+static void
+scan_keyed_lines(const char *buf, const char *const *keys, int nkeys,
+                 unsigned long long *values)
+{
+    const char *line = buf;
+
+    while (*line)
+    {
+        const char *colon = strchr(line, ':');
+        const char *next = strchr(line, '\n');
+        int i;
+
+        if (!colon || (next && colon > next))
+            break;
+
+        for (i = 0; i < nkeys; i++)
+        {
+            size_t len = strlen(keys[i]);
+
+            if ((size_t) (colon - line) == len && memcmp(line, keys[i], len) == 0)
+            {
+                const char *p = colon + 1;
+
+                values[i] = scan_ull(&p);
+                break;
+            }
+        }
+
+        if (!next)
+            break;
+        line = next + 1;
+    }
+}
+
 /*
  * Read CPU statistics from /proc/[pid]/stat (legacy, 10ms granularity)
  *
@@ -71,53 +258,29 @@ proc_read_cpu_stats_rusage(ProcCpuStats *stats)
 bool
 proc_read_cpu_stats(pid_t pid, ProcCpuStats *stats)
 {
-    char path[256];
-    FILE *fp;
-    char line[2048];
-    int n;
+    char buf[PROC_BUFFER_SIZE];
+    const char *p;
     
     if (!stats)
         return false;
     
     memset(stats, 0, sizeof(ProcCpuStats));
     
-    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-    fp = fopen(path, "r");
-    
-    if (!fp)
-        return false;
-    
-    if (!fgets(line, sizeof(line), fp))
-    {
-        fclose(fp);
+    if (!proc_read_file(pid, PROC_FILE_STAT, buf, sizeof(buf)))
         return false;
-    }
-    
-    fclose(fp);
     
-    /* Parse the stat line - fields are space separated */
-    /* We need fields 14-17 (utime, stime, cutime, cstime) */
-    /* Skip first field (PID) and second field (comm which may contain spaces) */
-    
-    char *p = strchr(line, ')');  /* Find end of comm field */
+    /* comm may contain spaces and parentheses: fields start after the last ')' */
+    p = strrchr(buf, ')');
     if (!p)
         return false;
     
-    p += 2;  /* Skip ") " */
-    
-    /* Now parse remaining fields */
-    unsigned long fields[50];
-    n = sscanf(p, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
-                  "%lu %lu %lu %lu",  /* fields 14-17 */
-                  &fields[0], &fields[1], &fields[2], &fields[3]);
-    
-    if (n < 4)
-        return false;
+    /* Skip state .. cmajflt (fields 3-13) */
+    p = skip_fields(p + 1, 11);
     
-    stats->utime = fields[0];
-    stats->stime = fields[1];
-    stats->cutime = fields[2];
-    stats->cstime = fields[3];
+    stats->utime = (unsigned long) scan_ull(&p);
+    stats->stime = (unsigned long) scan_ull(&p);
+    stats->cutime = (unsigned long) scan_ull(&p);
+    stats->cstime = (unsigned long) scan_ull(&p);
     
     /* Calculate derived fields */
     stats->utime_sec = ticks_to_seconds(stats->utime);
@@ -133,42 +296,31 @@ proc_read_cpu_stats(pid_t pid, ProcCpuStats *stats)
 bool
 proc_read_io_stats(pid_t pid, ProcIoStats *stats)
 {
-    char path[256];
-    FILE *fp;
-    char line[256];
+    static const char *const keys[] = {
+        "rchar", "wchar", "syscr", "syscw",
+        "read_bytes", "write_bytes", "cancelled_write_bytes"
+    };
+    char buf[PROC_BUFFER_SIZE];
+    unsigned long long values[lengthof(keys)] = {0};
     
     if (!stats)
         return false;
     
     memset(stats, 0, sizeof(ProcIoStats));
     
-    snprintf(path, sizeof(path), "/proc/%d/io", pid);
-    fp = fopen(path, "r");
-    
-    if (!fp)
+    if (!proc_read_file(pid, PROC_FILE_IO, buf, sizeof(buf)))
         return false;  /* May not have permission */
     
-    /* Parse each line */
-    while (fgets(line, sizeof(line), fp))
-    {
-        if (sscanf(line, "rchar: %llu", &stats->rchar) == 1)
-            continue;
-        if (sscanf(line, "wchar: %llu", &stats->wchar) == 1)
-            continue;
-        if (sscanf(line, "syscr: %llu", &stats->syscr) == 1)
-            continue;
-        if (sscanf(line, "syscw: %llu", &stats->syscw) == 1)
-            continue;
-        if (sscanf(line, "read_bytes: %llu", &stats->read_bytes) == 1)
-            continue;
-        if (sscanf(line, "write_bytes: %llu", &stats->write_bytes) == 1)
-            continue;
-        if (sscanf(line, "cancelled_write_bytes: %llu", 
-                   &stats->cancelled_write_bytes) == 1)
-            continue;
-    }
+    scan_keyed_lines(buf, keys, lengthof(keys), values);
+    
+    stats->rchar = values[0];
+    stats->wchar = values[1];
+    stats->syscr = values[2];
+    stats->syscw = values[3];
+    stats->read_bytes = values[4];
+    stats->write_bytes = values[5];
+    stats->cancelled_write_bytes = values[6];
     
-    fclose(fp);
     return true;
 }
 
@@ -178,36 +330,79 @@ proc_read_io_stats(pid_t pid, ProcIoStats *stats)
 bool
 proc_read_mem_stats(pid_t pid, ProcMemStats *stats)
 {
-    char path[256];
-    FILE *fp;
-    char line[256];
+    static const char *const keys[] = {"VmPeak", "VmSize", "VmRSS", "VmHWM", "RssAnon"};
+    char buf[PROC_BUFFER_SIZE * 2];
+    unsigned long long values[lengthof(keys)] = {0};
     
     if (!stats)
         return false;
     
     memset(stats, 0, sizeof(ProcMemStats));
     
-    snprintf(path, sizeof(path), "/proc/%d/status", pid);
-    fp = fopen(path, "r");
+    if (!proc_read_file(pid, PROC_FILE_STATUS, buf, sizeof(buf)))
+        return false;
+    
+    scan_keyed_lines(buf, keys, lengthof(keys), values);
     
-    if (!fp)
+    stats->vm_peak_kb = (unsigned long) values[0];
+    stats->vm_size_kb = (unsigned long) values[1];
+    stats->vm_rss_kb = (unsigned long) values[2];
+    stats->vm_hwm_kb = (unsigned long) values[3];
+    stats->rss_anon_kb = (unsigned long) values[4];
+    
+    return true;
+}
+
+/*
+ * Read scheduler statistics from /proc/[pid]/schedstat
+ *
+ * Format: run_ns runqueue_wait_ns timeslices
+ */
+bool
+proc_read_sched_stats(pid_t pid, ProcSchedStats *stats)
+{
+    char buf[128];
+    const char *p = buf;
+    
+    if (!stats)
         return false;
     
-    /* Parse each line */
-    while (fgets(line, sizeof(line), fp))
-    {
-        if (sscanf(line, "VmPeak: %lu kB", &stats->vm_peak_kb) == 1)
-            continue;
-        if (sscanf(line, "VmSize: %lu kB", &stats->vm_size_kb) == 1)
-            continue;
-        if (sscanf(line, "VmRSS: %lu kB", &stats->vm_rss_kb) == 1)
-            continue;
-    }
+    memset(stats, 0, sizeof(ProcSchedStats));
+    
+    if (!proc_read_file(pid, PROC_FILE_SCHEDSTAT, buf, sizeof(buf)))
+        return false;  /* Kernel without CONFIG_SCHEDSTATS */
+    
+    stats->run_ns = scan_ull(&p);
+    stats->wait_ns = scan_ull(&p);
+    stats->timeslices = scan_ull(&p);
     
-    fclose(fp);
     return true;
 }
 
+/*
+ * Per-query snapshot of our own process: I/O and scheduler statistics
+ * from the kept /proc descriptors. Two pread()s, no allocation. CPU time
+ * is not sampled here; phases take it from proc_clock_read(). Statistics
+ * the kernel does not provide are left zero; false if it provides none.
+ */
+bool
+proc_sample_self(ProcStats *stats)
+{
+    pid_t self = getpid();
+    bool io_ok;
+    bool sched_ok;
+    
+    if (!stats)
+        return false;
+    
+    memset(&stats->cpu, 0, sizeof(ProcCpuStats));
+    io_ok = proc_read_io_stats(self, &stats->io);
+    sched_ok = proc_read_sched_stats(self, &stats->sched);
+    stats->valid = io_ok || sched_ok;
+    
+    return stats->valid;
+}
+
 /*
  * Read all statistics at once
  */
@@ -224,11 +419,230 @@ proc_read_all_stats(pid_t pid, ProcStats *stats)
     ok &= proc_read_cpu_stats(pid, &stats->cpu);
     ok &= proc_read_io_stats(pid, &stats->io);
     ok &= proc_read_mem_stats(pid, &stats->mem);
+    proc_read_sched_stats(pid, &stats->sched);     /* Optional in the kernel */
     
     stats->valid = ok;
     return ok;
 }
 
+/*---- perf_event counters ----*/
+
+/*
+ * Two counter groups of our own process, each read with a single read():
+ * software events always, hardware events when the PMU lets us. They are
+ * separate because a hardware group is all-or-nothing on open and may be
+ * multiplexed with other users of the PMU; values are scaled by the share
+ * of time they were actually counting.
+ */
+typedef struct PerfCounterDef
+{
+    uint32 type;
+    uint64 config;
+    size_t offset;              /* In ProcPerfStats */
+} PerfCounterDef;
+
+static const PerfCounterDef perf_sw_counters[] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, offsetof(ProcPerfStats, task_clock_ns)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, offsetof(ProcPerfStats, page_faults)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, offsetof(ProcPerfStats, context_switches)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, offsetof(ProcPerfStats, cpu_migrations)},
+};
+
+static const PerfCounterDef perf_hw_counters[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, offsetof(ProcPerfStats, cycles)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, offsetof(ProcPerfStats, instructions)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, offsetof(ProcPerfStats, cache_misses)},
+};
+
+#define PERF_MAX_GROUP      4
+
+typedef struct PerfGroup
+{
+    const PerfCounterDef *defs;
+    int ncounters;
+    int fds[PERF_MAX_GROUP];
+} PerfGroup;
+
+static PerfGroup perf_sw = {perf_sw_counters, lengthof(perf_sw_counters), {-1, -1, -1, -1}};
+static PerfGroup perf_hw = {perf_hw_counters, lengthof(perf_hw_counters), {-1, -1, -1, -1}};
+static pid_t perf_pid = 0;
+static bool perf_tried = false;
+
+static void
+perf_group_close(PerfGroup *group)
+{
+    int i;
+
+    for (i = group->ncounters - 1; i >= 0; i--)
+    {
+        if (group->fds[i] >= 0)
+        {
+            close(group->fds[i]);
+            ReleaseExternalFD();
+        }
+        group->fds[i] = -1;
+    }
+}
+
+/*
+ * Open all counters of a group or none. Kernel-side counting needs
+ * perf_event_paranoid <= 1; with the default of 2 we fall back to user
+ * space only, where context switches and migrations read as zero.
+ */
+static bool
+perf_group_open(PerfGroup *group)
+{
+    int exclude_kernel;
+
+    for (exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++)
+    {
+        int i;
+
+        for (i = 0; i < group->ncounters; i++)
+        {
+            struct perf_event_attr attr;
+
+            if (!AcquireExternalFD())
+                break;
+
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = group->defs[i].type;
+            attr.config = group->defs[i].config;
+            attr.read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = exclude_kernel;
+            attr.exclude_hv = 1;
+
+            group->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1,
+                                          i == 0 ? -1 : group->fds[0],
+                                          PERF_FLAG_FD_CLOEXEC);
+            if (group->fds[i] < 0)
+            {
+                ReleaseExternalFD();
+                break;
+            }
+        }
+
+        if (i == group->ncounters)
+            return true;
+
+        perf_group_close(group);
+        if (errno != EACCES && errno != EPERM)
+            break;
+    }
+
+    return false;
+}
+
+/*
+ * Open the counters of this backend once. False if perf_event is not
+ * usable at all (no kernel support, perf_event_paranoid 3, seccomp ...).
+ */
+bool
+proc_perf_open(void)
+{
+    if (perf_pid != getpid())
+    {
+        /* Counters opened before fork() count the parent */
+        perf_group_close(&perf_sw);
+        perf_group_close(&perf_hw);
+        perf_pid = getpid();
+        perf_tried = false;
+    }
+
+    if (!perf_tried)
+    {
+        perf_tried = true;
+        if (perf_group_open(&perf_sw))
+            perf_group_open(&perf_hw);
+    }
+
+    return perf_sw.fds[0] >= 0;
+}
+
+bool
+proc_perf_has_hw(void)
+{
+    return perf_hw.fds[0] >= 0;
+}
+
+static bool
+perf_group_read(PerfGroup *group, ProcPerfStats *stats)
+{
+    uint64 buf[3 + PERF_MAX_GROUP];     /* nr, time_enabled, time_running, values */
+    ssize_t len;
+    int i;
+
+    if (group->fds[0] < 0)
+        return false;
+
+    len = read(group->fds[0], buf, sizeof(buf));
+    if (len < (ssize_t) (3 * sizeof(uint64)) || buf[0] != (uint64) group->ncounters)
+        return false;
+
+    for (i = 0; i < group->ncounters; i++)
+    {
+        uint64 value = buf[3 + i];
+
+        /* Scale up if the PMU was shared with other events */
+        if (buf[2] > 0 && buf[2] < buf[1])
+            value = (uint64) ((double) value * buf[1] / buf[2]);
+
+        *(unsigned long long *) ((char *) stats + group->defs[i].offset) = value;
+    }
+
+    return true;
+}
+
+/*
+ * Current counter values: at most two read() calls, no allocation, so it
+ * can be called from a signal handler. Counters that are not available
+ * read as zero.
+ */
+bool
+proc_perf_read(ProcPerfStats *stats)
+{
+    int save_errno = errno;
+    bool ok;
+
+    memset(stats, 0, sizeof(ProcPerfStats));
+    ok = perf_group_read(&perf_sw, stats);
+    perf_group_read(&perf_hw, stats);
+
+    errno = save_errno;
+    return ok;
+}
+
+void
+proc_perf_stats_diff(const ProcPerfStats *start,
+                     const ProcPerfStats *end,
+                     ProcPerfStats *diff)
+{
+    if (!start || !end || !diff)
+        return;
+    
+    diff->task_clock_ns = end->task_clock_ns - start->task_clock_ns;
+    diff->page_faults = end->page_faults - start->page_faults;
+    diff->context_switches = end->context_switches - start->context_switches;
+    diff->cpu_migrations = end->cpu_migrations - start->cpu_migrations;
+    diff->cycles = end->cycles - start->cycles;
+    diff->instructions = end->instructions - start->instructions;
+    diff->cache_misses = end->cache_misses - start->cache_misses;
+}
+
+void
+proc_perf_stats_add(ProcPerfStats *sum, const ProcPerfStats *delta)
+{
+    sum->task_clock_ns += delta->task_clock_ns;
+    sum->page_faults += delta->page_faults;
+    sum->context_switches += delta->context_switches;
+    sum->cpu_migrations += delta->cpu_migrations;
+    sum->cycles += delta->cycles;
+    sum->instructions += delta->instructions;
+    sum->cache_misses += delta->cache_misses;
+}
+
 /*
  * Calculate difference between two CPU stat snapshots
  */
@@ -286,6 +700,22 @@ proc_io_stats_diff(const ProcIoStats *start,
                                   start->cancelled_write_bytes;
 }
 
+/*
+ * Calculate difference between two scheduler stat snapshots
+ */
+void
+proc_sched_stats_diff(const ProcSchedStats *start,
+                      const ProcSchedStats *end,
+                      ProcSchedStats *diff)
+{
+    if (!start || !end || !diff)
+        return;
+    
+    diff->run_ns = end->run_ns - start->run_ns;
+    diff->wait_ns = end->wait_ns - start->wait_ns;
+    diff->timeslices = end->timeslices - start->timeslices;
+}
+
 /*
  * Format CPU statistics as string (Oracle 10046 style)
  */
@@ -11,6 +11,7 @@
 #ifndef PG_TRACE_PROCFS_H
 #define PG_TRACE_PROCFS_H
 
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -46,14 +47,70 @@ typedef struct ProcMemStats
     unsigned long vm_peak_kb;   /* Peak virtual memory */
     unsigned long vm_size_kb;   /* Current virtual memory */
     unsigned long vm_rss_kb;    /* Resident set size */
+    unsigned long vm_hwm_kb;    /* Peak resident set size */
+    unsigned long rss_anon_kb;  /* Resident anonymous memory (private heap) */
 } ProcMemStats;
 
+/* Scheduler statistics from /proc/[pid]/schedstat (CONFIG_SCHEDSTATS) */
+typedef struct ProcSchedStats
+{
+    unsigned long long run_ns;          /* Time on CPU */
+    unsigned long long wait_ns;         /* Time runnable, waiting for a CPU */
+    unsigned long long timeslices;      /* Times scheduled in */
+} ProcSchedStats;
+
+/*
+ * perf_event counters of our own process. The hardware ones stay zero
+ * without a usable PMU (most VMs, perf_event_paranoid > 2 ...).
+ */
+typedef struct ProcPerfStats
+{
+    unsigned long long task_clock_ns;   /* Time on CPU */
+    unsigned long long page_faults;
+    unsigned long long context_switches;
+    unsigned long long cpu_migrations;
+    unsigned long long cycles;
+    unsigned long long instructions;
+    unsigned long long cache_misses;    /* Last level cache */
+} ProcPerfStats;
+
+/*
+ * Thread CPU and monotonic wall clock, read together at phase boundaries.
+ * Nanosecond resolution; the monotonic clock is served by the vDSO and
+ * the thread CPU clock is one light syscall, both far cheaper than
+ * getrusage(). Off-CPU time of a phase is wall minus CPU.
+ */
+typedef struct ProcClock
+{
+    int64 cpu_ns;
+    int64 wall_ns;
+} ProcClock;
+
+static inline void
+proc_clock_read(ProcClock *clock)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    clock->cpu_ns = (int64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    clock->wall_ns = (int64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+proc_clock_diff(const ProcClock *start, const ProcClock *end, ProcClock *diff)
+{
+    diff->cpu_ns = end->cpu_ns - start->cpu_ns;
+    diff->wall_ns = end->wall_ns - start->wall_ns;
+}
+
 /* Combined statistics snapshot */
 typedef struct ProcStats
 {
     ProcCpuStats cpu;
     ProcIoStats io;
     ProcMemStats mem;
+    ProcSchedStats sched;
     bool valid;
 } ProcStats;
 
@@ -62,7 +119,9 @@ extern bool proc_read_cpu_stats_rusage(ProcCpuStats *stats);  /* MICROSECOND pre
 extern bool proc_read_cpu_stats(pid_t pid, ProcCpuStats *stats);  /* Legacy /proc */
 extern bool proc_read_io_stats(pid_t pid, ProcIoStats *stats);
 extern bool proc_read_mem_stats(pid_t pid, ProcMemStats *stats);
+extern bool proc_read_sched_stats(pid_t pid, ProcSchedStats *stats);
 extern bool proc_read_all_stats(pid_t pid, ProcStats *stats);
+extern bool proc_sample_self(ProcStats *stats);   /* io, sched; no open() */
 
 extern void proc_cpu_stats_diff(const ProcCpuStats *start, 
                                  const ProcCpuStats *end,
@@ -70,6 +129,17 @@ extern void proc_cpu_stats_diff(const ProcCpuStats *start,
 extern void proc_io_stats_diff(const ProcIoStats *start,
                                 const ProcIoStats *end,
                                 ProcIoStats *diff);
+extern void proc_sched_stats_diff(const ProcSchedStats *start,
+                                   const ProcSchedStats *end,
+                                   ProcSchedStats *diff);
+
+extern bool proc_perf_open(void);
+extern bool proc_perf_has_hw(void);
+extern bool proc_perf_read(ProcPerfStats *stats);    /* Signal handler safe */
+extern void proc_perf_stats_diff(const ProcPerfStats *start,
+                                  const ProcPerfStats *end,
+                                  ProcPerfStats *diff);
+extern void proc_perf_stats_add(ProcPerfStats *sum, const ProcPerfStats *delta);
 
 /* Formatting helpers */
 extern char *proc_format_cpu_stats(const ProcCpuStats *stats);
@@ -0,0 +1,163 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_shmem.c
+ *    Dynamic shared memory area shared by all pg_trace backends
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "pg_trace_shmem.h"
+#include "pg_trace_sqlstats.h"
+#include "pg_trace_sqltext.h"
+
+#define PG_TRACE_DSA_TRANCHE_NAME   "pg_trace_dsa"
+#define PG_TRACE_HASH_TRANCHE_NAME  "pg_trace_hash"
+
+typedef struct PgTraceShmemControl
+{
+    int dsa_tranche;
+    int hash_tranche;
+    dshash_table_handle hash_handles[PG_TRACE_NUM_HASHES];
+    /* The in-place DSA area follows */
+} PgTraceShmemControl;
+
+#define PgTraceRawArea(ctl) ((char *) (ctl) + MAXALIGN(sizeof(PgTraceShmemControl)))
+
+static PgTraceShmemControl *shmem_control = NULL;
+
+/* Per-backend attachments */
+static dsa_area *area = NULL;
+static dshash_table *hashes[PG_TRACE_NUM_HASHES];
+
+/*
+ * Parameters of each shared hash table; tranche_id is filled in at use
+ */
+static dshash_parameters
+hash_params(PgTraceSharedHash which)
+{
+    dshash_parameters params;
+
+    memset(&params, 0, sizeof(params));
+
+    switch (which)
+    {
+        case PG_TRACE_HASH_SQLTEXT:
+            params.key_size = sizeof(uint64);
+            params.entry_size = sizeof(PgTraceSqlTextEntry);
+            break;
+        case PG_TRACE_HASH_SQLSTATS:
+            params.key_size = sizeof(PgTraceSqlStatsKey);
+            params.entry_size = sizeof(PgTraceSqlStatsEntry);
+            break;
+        default:
+            elog(ERROR, "unrecognized pg_trace shared hash %d", (int) which);
+    }
+
+    params.compare_function = dshash_memcmp;
+    params.hash_function = dshash_memhash;
+    params.tranche_id = shmem_control->hash_tranche;
+
+    return params;
+}
+
+Size
+pg_trace_shmem_size(void)
+{
+    return add_size(MAXALIGN(sizeof(PgTraceShmemControl)), PG_TRACE_DSA_INIT_SIZE);
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_shmem_init(void)
+{
+    bool found;
+
+    shmem_control = ShmemInitStruct("pg_trace_shmem", pg_trace_shmem_size(), &found);
+
+    if (!found)
+    {
+        dsa_area *dsa;
+        int i;
+
+        shmem_control->dsa_tranche = LWLockNewTrancheId();
+        shmem_control->hash_tranche = LWLockNewTrancheId();
+
+        dsa = dsa_create_in_place(PgTraceRawArea(shmem_control),
+                                  PG_TRACE_DSA_INIT_SIZE,
+                                  shmem_control->dsa_tranche,
+                                  NULL);
+        dsa_pin(dsa);
+
+        /*
+         * Keep the hash tables' initial allocations inside the in-place
+         * segment; the postmaster must not create DSM segments.
+         */
+        dsa_set_size_limit(dsa, PG_TRACE_DSA_INIT_SIZE);
+        for (i = 0; i < PG_TRACE_NUM_HASHES; i++)
+        {
+            dshash_parameters params = hash_params((PgTraceSharedHash) i);
+            dshash_table *hash = dshash_create(dsa, &params, NULL);
+
+            shmem_control->hash_handles[i] = dshash_get_hash_table_handle(hash);
+            dshash_detach(hash);
+        }
+        dsa_set_size_limit(dsa, -1);
+
+        dsa_detach(dsa);
+    }
+
+    LWLockRegisterTranche(shmem_control->dsa_tranche, PG_TRACE_DSA_TRANCHE_NAME);
+    LWLockRegisterTranche(shmem_control->hash_tranche, PG_TRACE_HASH_TRANCHE_NAME);
+}
+
+/*
+ * Attach to the area in this backend on first use
+ */
+dsa_area *
+pg_trace_dsa(void)
+{
+    MemoryContext oldcxt;
+
+    if (area)
+        return area;
+
+    if (!shmem_control)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    area = dsa_attach_in_place(PgTraceRawArea(shmem_control), NULL);
+    dsa_pin_mapping(area);
+    MemoryContextSwitchTo(oldcxt);
+
+    return area;
+}
+
+dshash_table *
+pg_trace_hash(PgTraceSharedHash which)
+{
+    MemoryContext oldcxt;
+    dshash_parameters params;
+
+    Assert(which >= 0 && which < PG_TRACE_NUM_HASHES);
+
+    if (hashes[which])
+        return hashes[which];
+
+    pg_trace_dsa();
+
+    params = hash_params(which);
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    hashes[which] = dshash_attach(area, &params, shmem_control->hash_handles[which], NULL);
+    MemoryContextSwitchTo(oldcxt);
+
+    return hashes[which];
+}
@@ -0,0 +1,38 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_shmem.h
+ *    Dynamic shared memory area shared by all pg_trace backends
+ *
+ * A DSA area is created in place inside the fixed shared memory segment
+ * at postmaster start, the same way the cumulative statistics system does
+ * it, so it exists before any backend needs it. Shared hash tables
+ * (dshash) are created in it up front and attached lazily by backends.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_SHMEM_H
+#define PG_TRACE_SHMEM_H
+
+#include "postgres.h"
+
+#include "lib/dshash.h"
+#include "utils/dsa.h"
+
+/* Initial (in-place) size of the area; it grows into DSM segments */
+#define PG_TRACE_DSA_INIT_SIZE      (1024 * 1024)
+
+/* Shared hash tables living in the area */
+typedef enum PgTraceSharedHash
+{
+    PG_TRACE_HASH_SQLTEXT,
+    PG_TRACE_HASH_SQLSTATS,
+    PG_TRACE_NUM_HASHES
+} PgTraceSharedHash;
+
+extern Size pg_trace_shmem_size(void);
+extern void pg_trace_shmem_init(void);
+
+extern dsa_area *pg_trace_dsa(void);
+extern dshash_table *pg_trace_hash(PgTraceSharedHash which);
+
+#endif /* PG_TRACE_SHMEM_H */
@@ -0,0 +1,429 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_sqlstats.c
+ *    Always-on response-time aggregates per sql_id and plan_id
+ *
+ * Query timing and buffer usage come from queryDesc->totaltime, the same
+ * whole-query instrumentation pg_stat_statements uses; CPU comes from
+ * getrusage() via proc_read_cpu_stats_rusage(). Time per wait class is
+ * the number of ASH samples of this backend in each class during the
+ * statement, times pg_trace.ash_interval_ms. Merging a backend's
+ * partial entries takes only the dshash partition lock of each entry.
+ * When the shared table is full, new statements are counted as dropped
+ * until pg_trace_sql_stats_reset().
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "executor/instrument.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "pg_trace_plan.h"
+#include "pg_trace_procfs.h"
+#include "pg_trace_shmem.h"
+#include "pg_trace_sqlstats.h"
+#include "pg_trace_sqltext.h"
+
+#define SQLSTATS_MAX_NESTING    64
+
+typedef struct PgTraceSqlStatsShared
+{
+    pg_atomic_uint32 nentries;
+    pg_atomic_uint64 dropped;   /* Calls not recorded because the table was full */
+} PgTraceSqlStatsShared;
+
+/* Backend-local partial entry */
+typedef struct LocalSqlStats
+{
+    PgTraceSqlStatsKey key;
+    PgTraceSqlStatsCounters counters;
+    char *text;                 /* Set until the text reached the shared store */
+} LocalSqlStats;
+
+/* Start state of a statement being measured */
+typedef struct SqlStatsFrame
+{
+    QueryDesc *queryDesc;
+    uint64 plan_id;
+    ProcCpuStats cpu_start;
+    bool waits_valid;
+    uint64 waits_start[PG_TRACE_ASH_WAIT_CLASSES];
+} SqlStatsFrame;
+
+/* GUCs */
+bool pg_trace_sql_stats = true;
+int pg_trace_sql_stats_max = 5000;
+int pg_trace_sql_stats_flush_interval = 1000;
+
+static PgTraceSqlStatsShared *sqlstats_shared = NULL;
+
+static HTAB *local_stats = NULL;
+static TimestampTz last_flush = 0;
+static bool exit_callback_registered = false;
+
+static SqlStatsFrame frames[SQLSTATS_MAX_NESTING];
+static int nframes = 0;
+
+PG_FUNCTION_INFO_V1(pg_trace_sql_stats);
+PG_FUNCTION_INFO_V1(pg_trace_sql_stats_reset);
+
+Size
+pg_trace_sqlstats_shmem_size(void)
+{
+    return MAXALIGN(sizeof(PgTraceSqlStatsShared));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_sqlstats_shmem_init(void)
+{
+    bool found;
+
+    sqlstats_shared = ShmemInitStruct("pg_trace_sqlstats",
+                                      pg_trace_sqlstats_shmem_size(),
+                                      &found);
+    if (!found)
+    {
+        pg_atomic_init_u32(&sqlstats_shared->nentries, 0);
+        pg_atomic_init_u64(&sqlstats_shared->dropped, 0);
+    }
+}
+
+static void
+counters_add(PgTraceSqlStatsCounters *dst, const PgTraceSqlStatsCounters *src)
+{
+    int i;
+
+    dst->calls += src->calls;
+    dst->rows += src->rows;
+    dst->total_ms += src->total_ms;
+    dst->max_ms = Max(dst->max_ms, src->max_ms);
+    dst->cpu_user_ms += src->cpu_user_ms;
+    dst->cpu_sys_ms += src->cpu_sys_ms;
+    dst->shared_blks_hit += src->shared_blks_hit;
+    dst->shared_blks_read += src->shared_blks_read;
+    dst->shared_blks_dirtied += src->shared_blks_dirtied;
+    dst->shared_blks_written += src->shared_blks_written;
+    dst->temp_blks_read += src->temp_blks_read;
+    dst->temp_blks_written += src->temp_blks_written;
+    dst->io_read_ms += src->io_read_ms;
+    dst->io_write_ms += src->io_write_ms;
+    dst->other_wait_ms += src->other_wait_ms;
+    for (i = 0; i < PG_TRACE_ASH_WAIT_CLASSES; i++)
+        dst->wait_ms[i] += src->wait_ms[i];
+}
+
+/*
+ * Merge all partial entries into the shared table
+ */
+static void
+sqlstats_flush(bool store_text)
+{
+    HASH_SEQ_STATUS status;
+    dshash_table *hash;
+    LocalSqlStats *local;
+
+    if (!local_stats || hash_get_num_entries(local_stats) == 0)
+        return;
+
+    hash = pg_trace_hash(PG_TRACE_HASH_SQLSTATS);
+
+    hash_seq_init(&status, local_stats);
+    while ((local = (LocalSqlStats *) hash_seq_search(&status)) != NULL)
+    {
+        PgTraceSqlStatsEntry *entry;
+        bool found;
+
+        entry = dshash_find(hash, &local->key, true);
+        if (!entry)
+        {
+            if (pg_atomic_read_u32(&sqlstats_shared->nentries) >= (uint32) pg_trace_sql_stats_max)
+            {
+                pg_atomic_fetch_add_u64(&sqlstats_shared->dropped, local->counters.calls);
+                goto next;
+            }
+
+            entry = dshash_find_or_insert(hash, &local->key, &found);
+            if (!found)
+            {
+                memset(&entry->counters, 0, sizeof(PgTraceSqlStatsCounters));
+                pg_atomic_fetch_add_u32(&sqlstats_shared->nentries, 1);
+            }
+        }
+
+        counters_add(&entry->counters, &local->counters);
+        dshash_release_lock(hash, entry);
+
+        if (local->text && store_text)
+            pg_trace_sqltext_acquire(local->key.sql_id, local->text);
+
+next:
+        if (local->text)
+            pfree(local->text);
+        hash_search(local_stats, &local->key, HASH_REMOVE, NULL);
+    }
+
+    last_flush = GetCurrentTimestamp();
+}
+
+/*
+ * Backend exit: do not lose the last partial counters
+ */
+static void
+sqlstats_shutdown(int code, Datum arg)
+{
+    if (!sqlstats_shared || code != 0)
+        return;
+
+    sqlstats_flush(false);
+}
+
+/*
+ * ExecutorStart, after the standard one: remember where we started
+ */
+void
+pg_trace_sqlstats_start(QueryDesc *queryDesc)
+{
+    SqlStatsFrame *frame;
+    MemoryContext oldcxt;
+
+    if (!pg_trace_sql_stats || !sqlstats_shared || !queryDesc->planstate)
+        return;
+
+    if (nframes >= SQLSTATS_MAX_NESTING)
+        return;
+
+    if (queryDesc->totaltime == NULL)
+    {
+        oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+        queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    frame = &frames[nframes++];
+    frame->queryDesc = queryDesc;
+    frame->plan_id = pg_trace_plan_id(queryDesc->planstate);
+    proc_read_cpu_stats_rusage(&frame->cpu_start);
+    frame->waits_valid = pg_trace_ash_wait_counts(frame->waits_start);
+}
+
+/*
+ * ExecutorEnd, before the standard one: add the statement to the
+ * backend-local partial entry, and merge if the flush interval passed
+ */
+void
+pg_trace_sqlstats_end(QueryDesc *queryDesc)
+{
+    SqlStatsFrame *frame = NULL;
+    LocalSqlStats *local;
+    PgTraceSqlStatsKey key;
+    PgTraceSqlStatsCounters *c;
+    ProcCpuStats cpu_end;
+    ProcCpuStats cpu_diff;
+    Instrumentation *instr;
+    TimestampTz now;
+    bool found;
+    int i;
+
+    /* Frames above ours belong to statements that errored out */
+    for (i = nframes - 1; i >= 0; i--)
+    {
+        if (frames[i].queryDesc == queryDesc)
+        {
+            frame = &frames[i];
+            nframes = i;
+            break;
+        }
+    }
+
+    if (!frame || !queryDesc->totaltime)
+        return;
+
+    instr = queryDesc->totaltime;
+    InstrEndLoop(instr);
+
+    proc_read_cpu_stats_rusage(&cpu_end);
+    proc_cpu_stats_diff(&frame->cpu_start, &cpu_end, &cpu_diff);
+
+    if (!local_stats)
+    {
+        HASHCTL ctl;
+
+        ctl.keysize = sizeof(PgTraceSqlStatsKey);
+        ctl.entrysize = sizeof(LocalSqlStats);
+        ctl.hcxt = TopMemoryContext;
+        local_stats = hash_create("pg_trace local sql stats", 128, &ctl,
+                                  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    if (!exit_callback_registered)
+    {
+        before_shmem_exit(sqlstats_shutdown, (Datum) 0);
+        exit_callback_registered = true;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.sql_id = pg_trace_sqltext_id(queryDesc->sourceText, queryDesc->plannedstmt->queryId);
+    key.plan_id = frame->plan_id;
+    key.dbid = MyDatabaseId;
+
+    local = (LocalSqlStats *) hash_search(local_stats, &key, HASH_ENTER, &found);
+    if (!found)
+    {
+        memset(&local->counters, 0, sizeof(PgTraceSqlStatsCounters));
+        local->text = queryDesc->sourceText ?
+            MemoryContextStrdup(TopMemoryContext, queryDesc->sourceText) : NULL;
+    }
+
+    c = &local->counters;
+    c->calls++;
+    c->rows += queryDesc->estate->es_processed;
+    c->total_ms += instr->total * 1000.0;
+    c->max_ms = Max(c->max_ms, instr->total * 1000.0);
+    c->cpu_user_ms += cpu_diff.utime_sec * 1000.0;
+    c->cpu_sys_ms += cpu_diff.stime_sec * 1000.0;
+    c->shared_blks_hit += instr->bufusage.shared_blks_hit;
+    c->shared_blks_read += instr->bufusage.shared_blks_read;
+    c->shared_blks_dirtied += instr->bufusage.shared_blks_dirtied;
+    c->shared_blks_written += instr->bufusage.shared_blks_written;
+    c->temp_blks_read += instr->bufusage.temp_blks_read;
+    c->temp_blks_written += instr->bufusage.temp_blks_written;
+    c->io_read_ms += INSTR_TIME_GET_MILLISEC(instr->bufusage.blk_read_time);
+    c->io_write_ms += INSTR_TIME_GET_MILLISEC(instr->bufusage.blk_write_time);
+    c->other_wait_ms += Max(0.0, instr->total * 1000.0
+                                 - cpu_diff.total_sec * 1000.0
+                                 - INSTR_TIME_GET_MILLISEC(instr->bufusage.blk_read_time)
+                                 - INSTR_TIME_GET_MILLISEC(instr->bufusage.blk_write_time));
+
+    if (frame->waits_valid)
+    {
+        uint64 waits_end[PG_TRACE_ASH_WAIT_CLASSES];
+
+        if (pg_trace_ash_wait_counts(waits_end))
+        {
+            for (i = 0; i < PG_TRACE_ASH_WAIT_CLASSES; i++)
+                c->wait_ms[i] += (double) (waits_end[i] - frame->waits_start[i]) *
+                    pg_trace_ash_interval_ms;
+        }
+    }
+
+    /* Only the outermost statement flushes; nested ones are mid-flight */
+    if (nframes == 0)
+    {
+        now = GetCurrentTimestamp();
+        if (TimestampDifferenceExceeds(last_flush, now, pg_trace_sql_stats_flush_interval))
+            sqlstats_flush(true);
+    }
+}
+
+/*
+ * Transaction abort: statements in flight will never reach ExecutorEnd
+ */
+void
+pg_trace_sqlstats_abort(void)
+{
+    nframes = 0;
+}
+
+/*
+ * SQL function: pg_trace_sql_stats()
+ */
+Datum
+pg_trace_sql_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo;
+    dshash_seq_status status;
+    PgTraceSqlStatsEntry *entry;
+
+    if (!sqlstats_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    /* Include our own partial counters */
+    sqlstats_flush(true);
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    dshash_seq_init(&status, pg_trace_hash(PG_TRACE_HASH_SQLSTATS), false);
+    while ((entry = dshash_seq_next(&status)) != NULL)
+    {
+        PgTraceSqlStatsCounters *c = &entry->counters;
+        Datum values[27];
+        bool nulls[27];
+
+        memset(nulls, 0, sizeof(nulls));
+
+        values[0] = Int64GetDatum((int64) entry->key.sql_id);
+        values[1] = Int64GetDatum((int64) entry->key.plan_id);
+        values[2] = ObjectIdGetDatum(entry->key.dbid);
+        values[3] = Int64GetDatum(c->calls);
+        values[4] = Int64GetDatum(c->rows);
+        values[5] = Float8GetDatum(c->total_ms);
+        values[6] = Float8GetDatum(c->calls > 0 ? c->total_ms / c->calls : 0);
+        values[7] = Float8GetDatum(c->max_ms);
+        values[8] = Float8GetDatum(c->cpu_user_ms);
+        values[9] = Float8GetDatum(c->cpu_sys_ms);
+        values[10] = Int64GetDatum(c->shared_blks_hit);
+        values[11] = Int64GetDatum(c->shared_blks_read);
+        values[12] = Int64GetDatum(c->shared_blks_dirtied);
+        values[13] = Int64GetDatum(c->shared_blks_written);
+        values[14] = Int64GetDatum(c->temp_blks_read);
+        values[15] = Int64GetDatum(c->temp_blks_written);
+        values[16] = Float8GetDatum(c->io_read_ms);
+        values[17] = Float8GetDatum(c->io_write_ms);
+        values[18] = Float8GetDatum(c->other_wait_ms);
+        values[19] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_LWLOCK)]);
+        values[20] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_LOCK)]);
+        values[21] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_BUFFER_PIN)]);
+        values[22] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_IO)]);
+        values[23] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_IPC)]);
+        values[24] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_CLIENT)]);
+        values[25] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_TIMEOUT)]);
+        values[26] = Float8GetDatum(c->wait_ms[PgTraceAshWaitClass(PG_WAIT_EXTENSION)]);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    dshash_seq_term(&status);
+
+    return (Datum) 0;
+}
+
+/*
+ * SQL function: pg_trace_sql_stats_reset()
+ */
+Datum
+pg_trace_sql_stats_reset(PG_FUNCTION_ARGS)
+{
+    dshash_seq_status status;
+
+    if (!sqlstats_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    dshash_seq_init(&status, pg_trace_hash(PG_TRACE_HASH_SQLSTATS), true);
+    while (dshash_seq_next(&status) != NULL)
+    {
+        dshash_delete_current(&status);
+        pg_atomic_fetch_sub_u32(&sqlstats_shared->nentries, 1);
+    }
+    dshash_seq_term(&status);
+
+    pg_atomic_write_u64(&sqlstats_shared->dropped, 0);
+
+    PG_RETURN_VOID();
+}
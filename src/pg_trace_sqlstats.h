@@ -0,0 +1,72 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_sqlstats.h
+ *    Always-on response-time aggregates per sql_id and plan_id
+ *
+ * Every statement (traced or not) adds elapsed, CPU, buffer, I/O time and
+ * off-CPU wait time to a backend-local partial entry. Wait time is split
+ * by wait event class from the active session history sampler's samples
+ * of the backend, so it has that sampler's resolution. Partial entries are
+ * merged into the shared dshash at most every
+ * pg_trace.sql_stats_flush_interval and at backend exit, so the hot path
+ * touches no shared state at all. Exposed as the pg_trace_sql_stats view.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_SQLSTATS_H
+#define PG_TRACE_SQLSTATS_H
+
+#include "postgres.h"
+
+#include "executor/execdesc.h"
+
+#include "pg_trace_ash.h"
+
+/* Hash key; zeroed before filling so padding compares equal */
+typedef struct PgTraceSqlStatsKey
+{
+    uint64 sql_id;
+    uint64 plan_id;
+    Oid dbid;
+} PgTraceSqlStatsKey;
+
+typedef struct PgTraceSqlStatsCounters
+{
+    int64 calls;
+    int64 rows;
+    double total_ms;
+    double max_ms;
+    double cpu_user_ms;
+    double cpu_sys_ms;
+    int64 shared_blks_hit;
+    int64 shared_blks_read;
+    int64 shared_blks_dirtied;
+    int64 shared_blks_written;
+    int64 temp_blks_read;
+    int64 temp_blks_written;
+    double io_read_ms;
+    double io_write_ms;
+    double other_wait_ms;       /* Elapsed - CPU - I/O time */
+    double wait_ms[PG_TRACE_ASH_WAIT_CLASSES];  /* Sampled, by PgTraceAshWaitClass */
+} PgTraceSqlStatsCounters;
+
+/* Shared (and backend-local) hash entry */
+typedef struct PgTraceSqlStatsEntry
+{
+    PgTraceSqlStatsKey key;
+    PgTraceSqlStatsCounters counters;
+} PgTraceSqlStatsEntry;
+
+/* GUCs */
+extern bool pg_trace_sql_stats;
+extern int pg_trace_sql_stats_max;
+extern int pg_trace_sql_stats_flush_interval;
+
+extern Size pg_trace_sqlstats_shmem_size(void);
+extern void pg_trace_sqlstats_shmem_init(void);
+
+extern void pg_trace_sqlstats_start(QueryDesc *queryDesc);
+extern void pg_trace_sqlstats_end(QueryDesc *queryDesc);
+extern void pg_trace_sqlstats_abort(void);
+
+#endif /* PG_TRACE_SQLSTATS_H */
@@ -0,0 +1,312 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_sqltext.c
+ *    Shared, deduplicated store of SQL texts keyed by sql_id
+ *
+ * Reference counting: a backend takes one reference per sql_id per
+ * transaction and drops all of them at transaction end, so the count is
+ * the number of open transactions that may still print the text. When the
+ * store grows past pg_trace.sql_text_max entries, the least recently used
+ * unreferenced texts are evicted by whichever backend noticed first.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "common/hashfn.h"
+#include "fmgr.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "pg_trace_shmem.h"
+#include "pg_trace_sqltext.h"
+
+/* Evict down to this fraction of pg_trace.sql_text_max */
+#define SQLTEXT_EVICT_TARGET    0.9
+
+typedef struct PgTraceSqlTextShared
+{
+    pg_atomic_uint32 nentries;
+    pg_atomic_flag evicting;
+} PgTraceSqlTextShared;
+
+/* GUC */
+int pg_trace_sql_text_max = 5000;
+
+static PgTraceSqlTextShared *sqltext_shared = NULL;
+
+/* sql_ids this backend holds a reference on in the current transaction */
+static HTAB *held_sql_ids = NULL;
+
+PG_FUNCTION_INFO_V1(pg_trace_sql_text);
+
+Size
+pg_trace_sqltext_shmem_size(void)
+{
+    return MAXALIGN(sizeof(PgTraceSqlTextShared));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held
+ */
+void
+pg_trace_sqltext_shmem_init(void)
+{
+    bool found;
+
+    sqltext_shared = ShmemInitStruct("pg_trace_sqltext",
+                                     pg_trace_sqltext_shmem_size(),
+                                     &found);
+    if (!found)
+    {
+        pg_atomic_init_u32(&sqltext_shared->nentries, 0);
+        pg_atomic_init_flag(&sqltext_shared->evicting);
+    }
+}
+
+/*
+ * sql_id of a statement: the core query identifier when available,
+ * otherwise a hash of the text
+ */
+uint64
+pg_trace_sqltext_id(const char *text, uint64 query_id)
+{
+    if (query_id != UINT64CONST(0))
+        return query_id;
+
+    if (!text)
+        return UINT64CONST(0);
+
+    return hash_bytes_extended((const unsigned char *) text, strlen(text), 0);
+}
+
+static int
+timestamp_cmp(const void *a, const void *b)
+{
+    TimestampTz ta = *(const TimestampTz *) a;
+    TimestampTz tb = *(const TimestampTz *) b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Drop the least recently used unreferenced texts. The first pass finds
+ * the cutoff under shared partition locks, the second deletes under
+ * exclusive ones.
+ */
+static void
+sqltext_evict(dshash_table *hash, dsa_area *area)
+{
+    dshash_seq_status status;
+    PgTraceSqlTextEntry *entry;
+    TimestampTz *stamps;
+    uint32 nentries;
+    int nstamps = 0;
+    int ndelete;
+    TimestampTz cutoff;
+
+    nentries = pg_atomic_read_u32(&sqltext_shared->nentries);
+    ndelete = nentries - (int) (pg_trace_sql_text_max * SQLTEXT_EVICT_TARGET);
+    if (ndelete <= 0)
+        return;
+
+    stamps = (TimestampTz *) palloc(nentries * sizeof(TimestampTz));
+
+    dshash_seq_init(&status, hash, false);
+    while ((entry = dshash_seq_next(&status)) != NULL)
+    {
+        if (entry->refcount == 0 && nstamps < nentries)
+            stamps[nstamps++] = entry->last_used;
+    }
+    dshash_seq_term(&status);
+
+    if (nstamps == 0)
+    {
+        pfree(stamps);
+        return;
+    }
+
+    qsort(stamps, nstamps, sizeof(TimestampTz), timestamp_cmp);
+    cutoff = stamps[Min(ndelete, nstamps) - 1];
+    pfree(stamps);
+
+    dshash_seq_init(&status, hash, true);
+    while ((entry = dshash_seq_next(&status)) != NULL)
+    {
+        if (entry->refcount == 0 && entry->last_used <= cutoff)
+        {
+            dsa_free(area, entry->text);
+            dshash_delete_current(&status);
+            pg_atomic_fetch_sub_u32(&sqltext_shared->nentries, 1);
+        }
+    }
+    dshash_seq_term(&status);
+}
+
+/*
+ * Make sure the text is stored and hold a reference on it until the end
+ * of the current transaction
+ */
+void
+pg_trace_sqltext_acquire(uint64 sql_id, const char *text)
+{
+    dshash_table *hash;
+    dsa_area *area;
+    PgTraceSqlTextEntry *entry;
+    bool found;
+
+    if (!sqltext_shared || !text)
+        return;
+
+    if (!held_sql_ids)
+    {
+        HASHCTL ctl;
+
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(uint64);
+        ctl.hcxt = TopMemoryContext;
+        held_sql_ids = hash_create("pg_trace held sql_ids", 64, &ctl,
+                                   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    hash_search(held_sql_ids, &sql_id, HASH_ENTER, &found);
+
+    area = pg_trace_dsa();
+    hash = pg_trace_hash(PG_TRACE_HASH_SQLTEXT);
+
+    entry = dshash_find(hash, &sql_id, true);
+    if (!entry)
+    {
+        Size len = strlen(text);
+        dsa_pointer dp;
+
+        /* Copy the text before taking the partition lock */
+        dp = dsa_allocate_extended(area, len + 1, DSA_ALLOC_NO_OOM);
+        if (!DsaPointerIsValid(dp))
+        {
+            if (!found)
+                hash_search(held_sql_ids, &sql_id, HASH_REMOVE, NULL);
+            return;
+        }
+        memcpy(dsa_get_address(area, dp), text, len + 1);
+
+        entry = dshash_find_or_insert(hash, &sql_id, &found);
+        if (found)
+        {
+            /* Somebody else inserted it meanwhile */
+            dsa_free(area, dp);
+        }
+        else
+        {
+            entry->text = dp;
+            entry->text_len = (int32) len;
+            entry->refcount = 0;
+            pg_atomic_fetch_add_u32(&sqltext_shared->nentries, 1);
+        }
+
+        /* A new entry always takes a reference, whatever held_sql_ids says */
+        found = false;
+    }
+
+    if (!found)
+        entry->refcount++;
+    entry->last_used = GetCurrentTimestamp();
+    dshash_release_lock(hash, entry);
+
+    if (pg_atomic_read_u32(&sqltext_shared->nentries) > (uint32) pg_trace_sql_text_max &&
+        pg_atomic_test_set_flag(&sqltext_shared->evicting))
+    {
+        PG_TRY();
+        {
+            sqltext_evict(hash, area);
+        }
+        PG_FINALLY();
+        {
+            pg_atomic_clear_flag(&sqltext_shared->evicting);
+        }
+        PG_END_TRY();
+    }
+}
+
+/*
+ * Transaction end: drop every reference this backend holds
+ */
+void
+pg_trace_sqltext_release_all(void)
+{
+    HASH_SEQ_STATUS status;
+    dshash_table *hash;
+    uint64 *sql_id;
+
+    if (!held_sql_ids)
+        return;
+
+    if (hash_get_num_entries(held_sql_ids) > 0)
+    {
+        hash = pg_trace_hash(PG_TRACE_HASH_SQLTEXT);
+
+        hash_seq_init(&status, held_sql_ids);
+        while ((sql_id = (uint64 *) hash_seq_search(&status)) != NULL)
+        {
+            PgTraceSqlTextEntry *entry = dshash_find(hash, sql_id, true);
+
+            if (entry)
+            {
+                if (entry->refcount > 0)
+                    entry->refcount--;
+                dshash_release_lock(hash, entry);
+            }
+        }
+    }
+
+    hash_destroy(held_sql_ids);
+    held_sql_ids = NULL;
+}
+
+/*
+ * Copy of the stored text in the current memory context, or NULL
+ */
+char *
+pg_trace_sqltext_get(uint64 sql_id)
+{
+    dshash_table *hash;
+    PgTraceSqlTextEntry *entry;
+    char *result = NULL;
+
+    if (!sqltext_shared)
+        return NULL;
+
+    hash = pg_trace_hash(PG_TRACE_HASH_SQLTEXT);
+    entry = dshash_find(hash, &sql_id, false);
+    if (entry)
+    {
+        result = pnstrdup(dsa_get_address(pg_trace_dsa(), entry->text), entry->text_len);
+        dshash_release_lock(hash, entry);
+    }
+
+    return result;
+}
+
+/*
+ * SQL function: pg_trace_sql_text(sql_id bigint)
+ */
+Datum
+pg_trace_sql_text(PG_FUNCTION_ARGS)
+{
+    uint64 sql_id = (uint64) PG_GETARG_INT64(0);
+    char *text;
+
+    if (!sqltext_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_trace_ultimate must be loaded via shared_preload_libraries")));
+
+    text = pg_trace_sqltext_get(sql_id);
+    if (!text)
+        PG_RETURN_NULL();
+
+    PG_RETURN_TEXT_P(cstring_to_text(text));
+}
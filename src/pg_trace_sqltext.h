@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_sqltext.h
+ *    Shared, deduplicated store of SQL texts keyed by sql_id
+ *
+ * Each distinct statement text is kept once for the whole instance in the
+ * pg_trace DSA area. Trace files carry only the sql_id after the first
+ * time a statement is written, and the text can be looked up with
+ * pg_trace_sql_text(sql_id).
+ *
+ * sql_id is the core query identifier (the same value as
+ * pg_stat_statements.queryid) when compute_query_id is active, so
+ * statements differing only in constants share one entry. Otherwise it is
+ * a hash of the text.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_SQLTEXT_H
+#define PG_TRACE_SQLTEXT_H
+
+#include "postgres.h"
+
+#include "utils/dsa.h"
+#include "utils/timestamp.h"
+
+/* Shared hash entry */
+typedef struct PgTraceSqlTextEntry
+{
+    uint64 sql_id;              /* Hash key */
+    dsa_pointer text;           /* NUL-terminated statement text */
+    int32 text_len;
+    int32 refcount;             /* Open transactions referencing the text */
+    TimestampTz last_used;
+} PgTraceSqlTextEntry;
+
+extern int pg_trace_sql_text_max;
+
+extern Size pg_trace_sqltext_shmem_size(void);
+extern void pg_trace_sqltext_shmem_init(void);
+
+extern uint64 pg_trace_sqltext_id(const char *text, uint64 query_id);
+extern void pg_trace_sqltext_acquire(uint64 sql_id, const char *text);
+extern void pg_trace_sqltext_release_all(void);
+extern char *pg_trace_sqltext_get(uint64 sql_id);
+
+#endif /* PG_TRACE_SQLTEXT_H */
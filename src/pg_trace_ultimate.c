@@ -5,11 +5,17 @@
  *
  * This extension provides:
  * - SQL text, bind variables, execution plans
+ * - Utility statements (COPY, CREATE INDEX, VACUUM, ...) with I/O and WAL
  * - CPU time from /proc
  * - Aggregate I/O from /proc
  * - PER-BLOCK I/O timing (with track_io_timing)
  * - OS cache vs physical disk distinction
  * - File paths and relation names
+ * - SQL text stored once per instance, traces carry the sql_id
+ * - Sampled wait events per plan node
+ * - Instance-wide active session history (background worker)
+ * - PARSE/EXEC events in per-backend lock-free shared memory rings
+ * - USDT probes at the trace points (pg_trace_probes.h)
  * - All without eBPF or root!
  *
  * Requirements:
@@ -27,24 +33,44 @@
 
 #include "access/heapam.h"
 #include "access/tableam.h"
+#include "access/xact.h"
 #include "catalog/catalog.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 #include "common/relpath.h"
 #include "executor/executor.h"
+#include "executor/hashjoin.h"
 #include "executor/instrument.h"
+#include "funcapi.h"
 #include "miscadmin.h"
 #include "optimizer/planner.h"
 #include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/lock.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/timestamp.h"
-
+#include "utils/tuplesort.h"
+#include "utils/wait_event.h"
+
+#include "pg_trace_ash.h"
+#include "pg_trace_events.h"
+#include "pg_trace_live.h"
+#include "pg_trace_plan.h"
+#include "pg_trace_probes.h"
 #include "pg_trace_procfs.h"
+#include "pg_trace_shmem.h"
+#include "pg_trace_sqlstats.h"
+#include "pg_trace_sqltext.h"
+#include "pg_trace_waitsample.h"
 
 PG_MODULE_MAGIC;
 
@@ -56,12 +82,17 @@ void _PG_fini(void);
 static char *trace_output_directory = NULL;
 static bool trace_enabled = false;
 static int os_cache_threshold_us = 500;  /* Threshold to distinguish OS cache vs disk */
+static int live_refresh_ms = 1000;       /* pg_trace_live() snapshot interval */
+static int wait_sample_interval_us = 1000;   /* In-backend wait sampling period */
+static bool perf_counters = false;       /* perf_event counters per query and node */
+static bool trace_trivial_utility = false;   /* Cursors for BEGIN, SET, SHOW, ... */
 
 /*---- Per-session state ----*/
 static FILE *trace_file = NULL;
 static char trace_filename[MAXPGPATH];
 static int64 cursor_sequence = 0;
 static TimestampTz session_start_time;
+static HTAB *written_sql_ids = NULL;     /* sql_ids whose text is in this trace file */
 
 /*---- Block I/O tracking ----*/
 typedef struct BlockIoStat
@@ -76,18 +107,48 @@ typedef struct BlockIoStat
     bool was_hit;           /* Buffer hit (no syscall) */
 } BlockIoStat;
 
+/* For tracking buffer state between calls */
+typedef struct BufferTracker
+{
+    BufferUsage last_bufusage;
+    instr_time last_io_time;
+    BlockNumber last_block[100];  /* Track recent blocks per relation */
+    int last_block_count;
+} BufferTracker;
+
 /*---- Query execution context ----*/
 typedef struct QueryTraceContext
 {
     int64 cursor_id;
-    char *sql_text;
+    uint64 sql_id;
     TimestampTz start_time;
     TimestampTz parse_time;
     TimestampTz exec_start_time;
+    ProcClock exec_clock_start;     /* ExecutorStart entry */
     BufferUsage buffer_usage_start;
     ProcStats os_stats_start;
+    ProcPerfStats perf_start;
+    bool perf_valid;
+    ProcMemStats mem_start;         /* /proc/self/status at ExecutorStart */
+    Size mem_max;                   /* Executor context tree, largest seen */
+
+    /* Nesting: statements run by functions, triggers and utility statements */
+    QueryDesc *query_desc;          /* NULL until ExecutorStart, and for utility */
+    bool utility;                   /* Owned by trace_ProcessUtility */
+    int depth;                      /* Oracle's dep= */
+    struct QueryTraceContext *parent;   /* Cursor this one runs for, NULL at top */
+    struct QueryTraceContext *next;     /* Open contexts, newest first */
+    SubTransactionId subid;         /* Opened in this subtransaction */
+
+    /* Recursive statements that ended, included in this cursor's own totals */
+    long rec_calls;
+    long rec_cr;
+    long rec_pr;
+    int64 rec_cpu_ns;
+    int64 rec_wall_ns;
     
     /* Block-level I/O tracking */
+    BufferTracker buffer_tracker;
     List *block_ios;
     
     /* Accumulated statistics */
@@ -98,45 +159,62 @@ typedef struct QueryTraceContext
     double total_disk_time_us;
 } QueryTraceContext;
 
-static QueryTraceContext *current_query_context = NULL;
-
-/* For tracking buffer state between calls */
-typedef struct BufferTracker
-{
-    BufferUsage last_bufusage;
-    instr_time last_io_time;
-    BlockNumber last_block[100];  /* Track recent blocks per relation */
-    int last_block_count;
-} BufferTracker;
-
-static BufferTracker buffer_tracker;
+static QueryTraceContext *current_query_context = NULL;  /* The cursor being written */
+static QueryTraceContext *open_contexts = NULL;
+static int nesting_level = 0;
 
 /*---- Saved hooks ----*/
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static planner_hook_type prev_planner_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish_hook = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
 
 /*---- Function declarations ----*/
 static void trace_printf(const char *fmt, ...) pg_attribute_printf(1, 2);
+static long long trace_tim(void);
 static void track_block_io_during_execution(void);
 static void write_block_io_summary(void);
+static void write_wait_samples(QueryDesc *queryDesc);
+static void write_lock_waits(QueryDesc *queryDesc);
+static void write_lwlock_stats(const char *label, PgTraceLWLockStat *stats, int nstats);
+static void write_perf_stats(const char *prefix, const ProcPerfStats *perf, double rows);
+static void write_exec_stats(const BufferUsage *buffer_end, uint64 rows);
+static void write_phase_time(const char *label, const ProcClock *start, const ProcClock *end);
+static void write_node_memory(PlanState *planstate, const char *indent);
 static void write_plan_tree(PlanState *planstate, int level);
+static void write_binds(ParamListInfo params);
+static void context_abort(SubTransactionId subid);
+static void context_commit(void);
 static const char *fork_names[] = {"main", "fsm", "vm", "init"};
 
 /* Hook implementations */
+static void trace_shmem_request(void);
+static void trace_shmem_startup(void);
+static void trace_xact_callback(XactEvent event, void *arg);
+static void trace_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                   SubTransactionId parentSubid, void *arg);
 static PlannedStmt *trace_planner(Query *parse, const char *query_string,
                                   int cursorOptions, ParamListInfo boundParams);
 static void trace_ExecutorStart(QueryDesc *queryDesc, int eflags);
 static void trace_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
                               uint64 count, bool execute_once);
+static void trace_ExecutorFinish(QueryDesc *queryDesc);
 static void trace_ExecutorEnd(QueryDesc *queryDesc);
+static void trace_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+                                 bool readOnlyTree, ProcessUtilityContext context,
+                                 ParamListInfo params, QueryEnvironment *queryEnv,
+                                 DestReceiver *dest, QueryCompletion *qc);
 
 /* SQL functions */
 PG_FUNCTION_INFO_V1(pg_trace_start_trace);
 PG_FUNCTION_INFO_V1(pg_trace_stop_trace);
 PG_FUNCTION_INFO_V1(pg_trace_get_tracefile);
 PG_FUNCTION_INFO_V1(pg_trace_set_cache_threshold);
+PG_FUNCTION_INFO_V1(pg_trace_bench);
 
 /*
  * Module initialization
@@ -166,6 +244,143 @@ _PG_init(void)
                             0,
                             NULL, NULL, NULL);
 
+    DefineCustomIntVariable("pg_trace.live_refresh_ms",
+                            "Interval in milliseconds between pg_trace_live() snapshots",
+                            "0 publishes only at query start and when ExecutorRun returns",
+                            &live_refresh_ms,
+                            1000,
+                            0, 60000,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.wait_sample_interval_us",
+                            "Interval in microseconds between wait event samples of traced queries",
+                            "0 disables sampling; values below 100 are treated as 100",
+                            &wait_sample_interval_us,
+                            1000,
+                            0, 1000000,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_trace.perf_counters",
+                             "Read perf_event counters per traced query and plan node",
+                             "Software counters always, cycles/instructions/cache misses when the PMU allows; "
+                             "per-node values are sampled with pg_trace.wait_sample_interval_us",
+                             &perf_counters,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_trace.trace_trivial_utility",
+                             "Trace transaction control, SET, SHOW and similar utility statements",
+                             "Off: they run untraced, as they do no work worth a cursor",
+                             &trace_trivial_utility,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.sql_text_max",
+                            "Maximum number of distinct SQL texts kept in shared memory",
+                            "Least recently used texts not referenced by an open transaction are evicted beyond this",
+                            &pg_trace_sql_text_max,
+                            5000,
+                            100, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_trace.sql_stats",
+                             "Collect per-statement response time aggregates",
+                             "Independent of tracing; exposed in the pg_trace_sql_stats view",
+                             &pg_trace_sql_stats,
+                             true,
+                             PGC_SUSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.sql_stats_max",
+                            "Maximum number of statement/plan pairs tracked",
+                            "New statements are not tracked once the table is full",
+                            &pg_trace_sql_stats_max,
+                            5000,
+                            100, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.sql_stats_flush_interval",
+                            "Minimum interval between merges of backend-local statement stats",
+                            NULL,
+                            &pg_trace_sql_stats_flush_interval,
+                            1000,
+                            0, 60000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.event_ring_size",
+                            "Number of trace events buffered per backend",
+                            "Each backend has its own ring of this many events in shared memory, "
+                            "drained by pg_trace_read_events()",
+                            &pg_trace_event_ring_size,
+                            1000,
+                            100, 100000,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_trace.ash",
+                             "Start the active session history sampler",
+                             NULL,
+                             &pg_trace_ash,
+                             true,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.ash_interval_ms",
+                            "Interval between active session history samples",
+                            NULL,
+                            &pg_trace_ash_interval_ms,
+                            1000,
+                            10, 60000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.ash_buffer_samples",
+                            "Number of active session history samples kept in shared memory",
+                            "Older samples are spilled to $PGDATA/pg_trace_ash",
+                            &pg_trace_ash_buffer_samples,
+                            65536,
+                            1024, INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_trace.ash_retention",
+                            "How long spilled active session history is kept",
+                            NULL,
+                            &pg_trace_ash_retention,
+                            1440,
+                            1, INT_MAX / 2,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MIN,
+                            NULL, NULL, NULL);
+
+    if (pg_trace_ash)
+        pg_trace_ash_register_worker();
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = trace_shmem_request;
+
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = trace_shmem_startup;
+
     prev_planner_hook = planner_hook;
     planner_hook = trace_planner;
 
@@ -175,27 +390,113 @@ _PG_init(void)
     prev_ExecutorRun_hook = ExecutorRun_hook;
     ExecutorRun_hook = trace_ExecutorRun;
 
+    prev_ExecutorFinish_hook = ExecutorFinish_hook;
+    ExecutorFinish_hook = trace_ExecutorFinish;
+
     prev_ExecutorEnd_hook = ExecutorEnd_hook;
     ExecutorEnd_hook = trace_ExecutorEnd;
 
+    prev_ProcessUtility_hook = ProcessUtility_hook;
+    ProcessUtility_hook = trace_ProcessUtility;
+
+    RegisterXactCallback(trace_xact_callback, NULL);
+    RegisterSubXactCallback(trace_subxact_callback, NULL);
+
     session_start_time = GetCurrentTimestamp();
-    
-    /* Initialize buffer tracker */
-    memset(&buffer_tracker, 0, sizeof(BufferTracker));
 }
 
 void
 _PG_fini(void)
 {
+    shmem_request_hook = prev_shmem_request_hook;
+    shmem_startup_hook = prev_shmem_startup_hook;
     planner_hook = prev_planner_hook;
     ExecutorStart_hook = prev_ExecutorStart_hook;
     ExecutorRun_hook = prev_ExecutorRun_hook;
+    ExecutorFinish_hook = prev_ExecutorFinish_hook;
     ExecutorEnd_hook = prev_ExecutorEnd_hook;
+    ProcessUtility_hook = prev_ProcessUtility_hook;
     
     if (trace_file)
         fclose(trace_file);
 }
 
+/*
+ * Shared memory setup
+ */
+static void
+trace_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(pg_trace_live_shmem_size());
+    RequestAddinShmemSpace(pg_trace_shmem_size());
+    RequestAddinShmemSpace(pg_trace_sqltext_shmem_size());
+    RequestAddinShmemSpace(pg_trace_sqlstats_shmem_size());
+    RequestAddinShmemSpace(pg_trace_ash_shmem_size());
+    RequestAddinShmemSpace(pg_trace_events_shmem_size());
+}
+
+static void
+trace_shmem_startup(void)
+{
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    pg_trace_live_shmem_init();
+    pg_trace_shmem_init();
+    pg_trace_sqltext_shmem_init();
+    pg_trace_sqlstats_shmem_init();
+    pg_trace_ash_shmem_init();
+    pg_trace_events_shmem_init();
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Transaction callbacks - stop publishing plan state that is being freed,
+ * drop this transaction's references on shared SQL texts and the trace
+ * contexts of statements that will not end
+ */
+static void
+trace_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            pg_trace_live_abort(InvalidSubTransactionId);
+            pg_trace_waitsample_abort(InvalidSubTransactionId);
+            pg_trace_sqlstats_abort();
+            pg_trace_ash_abort(InvalidSubTransactionId);
+            pg_trace_sqltext_release_all();
+            context_abort(InvalidSubTransactionId);
+            break;
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_PREPARE:
+            pg_trace_sqltext_release_all();
+            context_commit();
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+trace_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                       SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+    {
+        pg_trace_live_abort(mySubid);
+        pg_trace_waitsample_abort(mySubid);
+        pg_trace_ash_abort(mySubid);
+        context_abort(mySubid);
+    }
+}
+
 /*
  * Printf to trace file
  */
@@ -216,6 +517,228 @@ trace_printf(const char *fmt, ...)
     fflush(trace_file);
 }
 
+/*
+ * Oracle-style tim=: wall clock in microseconds since the Unix epoch, the
+ * clock the eBPF wait tracer stamps its events with, so pg_trace_merge can
+ * interleave both by time
+ */
+static long long
+trace_tim(void)
+{
+    return (long long) GetCurrentTimestamp() +
+        (long long) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC;
+}
+
+/*
+ * "<label> ela=... cpu=... offcpu=..." for the phase from start to end,
+ * without the line end so callers can append to it
+ */
+static void
+write_phase_time(const char *label, const ProcClock *start, const ProcClock *end)
+{
+    ProcClock diff;
+
+    proc_clock_diff(start, end, &diff);
+
+    trace_printf("%s ela=%.6f sec cpu=%.6f sec offcpu=%.6f sec",
+                 label,
+                 diff.wall_ns / 1e9,
+                 diff.cpu_ns / 1e9,
+                 Max(diff.wall_ns - diff.cpu_ns, 0) / 1e9);
+}
+
+/*
+ * Has the text of sql_id already been written to the current trace file?
+ * Marks it as written if not.
+ */
+static bool
+sql_text_already_written(uint64 sql_id)
+{
+    bool found;
+
+    if (!written_sql_ids)
+    {
+        HASHCTL ctl;
+
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(uint64);
+        ctl.hcxt = TopMemoryContext;
+        written_sql_ids = hash_create("pg_trace written sql_ids", 256, &ctl,
+                                      HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    hash_search(written_sql_ids, &sql_id, HASH_ENTER, &found);
+
+    return found;
+}
+
+/*---- Query context stack ----*/
+
+/*
+ * Every traced statement has a context from its planning (or ExecutorStart,
+ * for cached plans) to ExecutorEnd. Statements run by a function, trigger
+ * or utility statement while another one executes get a context one level
+ * deeper, with the running one as parent; they are written as cursors of
+ * their own (dep=) and their costs are added to the parent's recursive
+ * totals when they end. The executor hooks find their context by QueryDesc,
+ * so a portal fetched from later finds its own.
+ */
+static QueryTraceContext *
+context_create(uint64 sql_id)
+{
+    QueryTraceContext *context;
+
+    context = (QueryTraceContext *) MemoryContextAllocZero(TopMemoryContext,
+                                                           sizeof(QueryTraceContext));
+    context->cursor_id = ++cursor_sequence;
+    context->sql_id = sql_id;
+    context->depth = nesting_level;
+    context->parent = current_query_context;
+    context->subid = GetCurrentSubTransactionId();
+    context->next = open_contexts;
+    open_contexts = context;
+
+    return context;
+}
+
+static QueryTraceContext *
+context_find(QueryDesc *queryDesc)
+{
+    QueryTraceContext *context;
+
+    for (context = open_contexts; context; context = context->next)
+    {
+        if (context->query_desc == queryDesc)
+            return context;
+    }
+    return NULL;
+}
+
+/*
+ * The statement the planner last opened a context for at this level, not
+ * started yet
+ */
+static QueryTraceContext *
+context_find_planned(void)
+{
+    QueryTraceContext *context;
+
+    for (context = open_contexts; context; context = context->next)
+    {
+        if (!context->query_desc && !context->utility &&
+            context->depth == nesting_level && context->parent == current_query_context)
+            return context;
+    }
+    return NULL;
+}
+
+/*
+ * Unlink and free a context. Block I/O lists are freed only after a clean
+ * end; on error they went with the memory context they were built in.
+ */
+static void
+context_release(QueryTraceContext *context, bool free_lists)
+{
+    QueryTraceContext **link;
+    QueryTraceContext *other;
+
+    for (link = &open_contexts; *link; link = &(*link)->next)
+    {
+        if (*link == context)
+        {
+            *link = context->next;
+            break;
+        }
+    }
+
+    /* A portal opened by a function can outlive the statement that ran it */
+    for (other = open_contexts; other; other = other->next)
+    {
+        if (other->parent == context)
+            other->parent = NULL;
+    }
+
+    if (current_query_context == context)
+        current_query_context = context->parent;
+
+    if (free_lists && context->block_ios)
+        list_free_deep(context->block_ios);
+    pfree(context);
+}
+
+/*
+ * Error cleanup: statement contexts opened in the aborted subtransaction,
+ * or all of them for a top-level abort. Utility contexts are left to
+ * their hook: after an error it releases them while the error unwinds,
+ * and a top-level abort with one still open is a ROLLBACK inside a CALL
+ * or DO block, which goes on running. Statements it runs next nest below
+ * the innermost one.
+ */
+static void
+context_abort(SubTransactionId subid)
+{
+    QueryTraceContext *context = open_contexts;
+    QueryTraceContext *innermost = NULL;
+
+    while (context)
+    {
+        QueryTraceContext *next = context->next;
+
+        if (context->utility)
+        {
+            if (!innermost || context->depth > innermost->depth)
+                innermost = context;
+        }
+        else if (subid == InvalidSubTransactionId || context->subid == subid)
+            context_release(context, false);
+        context = next;
+    }
+
+    if (subid == InvalidSubTransactionId)
+    {
+        current_query_context = innermost;
+        nesting_level = innermost ? innermost->depth + 1 : 0;
+    }
+}
+
+/*
+ * Commit: every portal has been through ExecutorEnd, so the statement
+ * contexts left were planned but never started, or belonged to portals
+ * dropped with a subtransaction. Utility contexts are still running
+ * (a procedure that commits).
+ */
+static void
+context_commit(void)
+{
+    QueryTraceContext *context = open_contexts;
+
+    while (context)
+    {
+        QueryTraceContext *next = context->next;
+
+        if (!context->utility)
+            context_release(context, false);
+        context = next;
+    }
+}
+
+/*
+ * Start of a cursor section of current_query_context: PARSE line, SQL_ID
+ * and, the first time in this file, the SQL text
+ */
+static void
+write_parse_header(const char *sql)
+{
+    trace_printf("=====================================================================\n");
+    trace_printf("PARSE #%lld dep=%d tim=%lld\n",
+                 (long long) current_query_context->cursor_id,
+                 current_query_context->depth, trace_tim());
+    trace_printf("SQL_ID: %lld\n", (long long) current_query_context->sql_id);
+    if (!sql_text_already_written(current_query_context->sql_id))
+        trace_printf("SQL: %s\n", sql);
+    trace_printf("---------------------------------------------------------------------\n");
+}
+
 /*
  * Get relation name from RelFileNode
  * Note: RelidByRelfilenode may not be available in all PostgreSQL versions
@@ -251,12 +774,12 @@ capture_buffer_io_stats(void)
     
     /* Check if any new I/O happened */
     new_reads = current_bufusage.shared_blks_read - 
-                buffer_tracker.last_bufusage.shared_blks_read;
+                current_query_context->buffer_tracker.last_bufusage.shared_blks_read;
     
     if (new_reads > 0)
     {
         instr_time io_delta = current_io_time;
-        INSTR_TIME_SUBTRACT(io_delta, buffer_tracker.last_io_time);
+        INSTR_TIME_SUBTRACT(io_delta, current_query_context->buffer_tracker.last_io_time);
         io_time_us = INSTR_TIME_GET_MICROSEC(io_delta);
         avg_time_per_block = io_time_us / new_reads;
         
@@ -266,7 +789,7 @@ capture_buffer_io_stats(void)
     
     /* Update hits */
     current_query_context->pg_cache_hits += current_bufusage.shared_blks_hit - 
-                                            buffer_tracker.last_bufusage.shared_blks_hit;
+                                            current_query_context->buffer_tracker.last_bufusage.shared_blks_hit;
     
     /* Scan buffer descriptors to capture which specific blocks were accessed */
     for (i = 0; i < NBuffers && i < 10000; i++)  /* Limit scan */
@@ -303,6 +826,11 @@ capture_buffer_io_stats(void)
             /* Estimate timing for this block */
             stat->was_hit = (BUF_STATE_GET_REFCOUNT(buf_state) > 1);
             stat->io_time_us = stat->was_hit ? 0 : avg_time_per_block;
+
+            if (!stat->was_hit)
+                PG_TRACE_PROBE_BLOCK_READ(current_query_context->cursor_id,
+                                          stat->relNode, stat->blocknum,
+                                          (int64) stat->io_time_us);
             
             current_query_context->block_ios = lappend(current_query_context->block_ios, stat);
             
@@ -318,8 +846,8 @@ capture_buffer_io_stats(void)
     }
     
     /* Update tracker */
-    buffer_tracker.last_bufusage = current_bufusage;
-    buffer_tracker.last_io_time = current_io_time;
+    current_query_context->buffer_tracker.last_bufusage = current_bufusage;
+    current_query_context->buffer_tracker.last_io_time = current_io_time;
 }
 
 /*
@@ -394,81 +922,405 @@ write_block_io_summary(void)
 }
 
 /*
- * Recursively finalize instrumentation for all nodes
+ * EXEC STATS and EXEC OS lines: buffers, thread CPU and wall clock since
+ * exec_clock_start, and the /proc I/O and scheduler deltas. Adds them to
+ * the parent's recursive totals and emits the END EXEC event.
  */
 static void
-finalize_plan_instrumentation(PlanState *planstate)
+write_exec_stats(const BufferUsage *buffer_end, uint64 rows)
+{
+    QueryTraceContext *context = current_query_context;
+    BufferUsage *buffer_start = &context->buffer_usage_start;
+    long cr = buffer_end->shared_blks_hit - buffer_start->shared_blks_hit;
+    long pr = buffer_end->shared_blks_read - buffer_start->shared_blks_read;
+    ProcClock now;
+    ProcClock diff;
+    ProcStats os_end;
+
+    proc_clock_read(&now);
+    proc_clock_diff(&context->exec_clock_start, &now, &diff);
+
+    trace_printf("EXEC STATS: cr=%ld pr=%ld cpu=%.6f sec elapsed=%.6f sec offcpu=%.6f sec dep=%d tim=%lld\n",
+                 cr, pr,
+                 diff.cpu_ns / 1e9,
+                 diff.wall_ns / 1e9,
+                 Max(diff.wall_ns - diff.cpu_ns, 0) / 1e9,
+                 context->depth,
+                 trace_tim());
+
+    pg_trace_events_emit(PG_TRACE_EVENT_EXEC_END, context->cursor_id, context->sql_id,
+                         diff.wall_ns / 1000000.0, (int64) rows, cr, pr);
+
+    /* Part of the above spent in statements this one ran */
+    if (context->rec_calls > 0)
+        trace_printf("EXEC RECURSIVE: calls=%ld cr=%ld pr=%ld cpu=%.6f sec elapsed=%.6f sec\n",
+                     context->rec_calls, context->rec_cr, context->rec_pr,
+                     context->rec_cpu_ns / 1e9, context->rec_wall_ns / 1e9);
+
+    if (context->parent)
+    {
+        context->parent->rec_calls++;
+        context->parent->rec_cr += cr;
+        context->parent->rec_pr += pr;
+        context->parent->rec_cpu_ns += diff.cpu_ns;
+        context->parent->rec_wall_ns += diff.wall_ns;
+    }
+
+    if (proc_sample_self(&os_end))
+    {
+        ProcStats *os_start = &context->os_stats_start;
+        ProcIoStats io_diff;
+        ProcSchedStats sched_diff;
+
+        proc_io_stats_diff(&os_start->io, &os_end.io, &io_diff);
+        proc_sched_stats_diff(&os_start->sched, &os_end.sched, &sched_diff);
+
+        /* runq is time runnable but not running: CPU starvation */
+        trace_printf("EXEC OS: read_bytes=%llu write_bytes=%llu syscr=%llu syscw=%llu "
+                     "run=%.6f sec runq=%.6f sec slices=%llu\n",
+                     io_diff.read_bytes, io_diff.write_bytes,
+                     io_diff.syscr, io_diff.syscw,
+                     sched_diff.run_ns / 1e9, sched_diff.wait_ns / 1e9,
+                     sched_diff.timeslices);
+    }
+}
+
+/*
+ * One line per LWLock tranche: waits are runs of consecutive samples in
+ * the tranche, ela is samples times the sampling interval
+ */
+static void
+write_lwlock_stats(const char *label, PgTraceLWLockStat *stats, int nstats)
 {
     int i;
-    
-    if (!planstate)
-        return;
-    
-    /* Finalize this node if needed */
-    if (planstate->instrument && planstate->instrument->running)
-        InstrEndLoop(planstate->instrument);
-    
-    /* Recurse to child nodes */
-    if (planstate->lefttree)
-        finalize_plan_instrumentation(planstate->lefttree);
-    if (planstate->righttree)
-        finalize_plan_instrumentation(planstate->righttree);
-    
-    /* Handle special multi-child nodes */
-    if (IsA(planstate, AppendState))
+
+    for (i = 0; i < nstats; i++)
     {
-        AppendState *as = (AppendState *) planstate;
-        for (i = 0; i < as->as_nplans; i++)
-            finalize_plan_instrumentation(as->appendplans[i]);
+        const char *tranche = pgstat_get_wait_event(stats[i].wait_event_info);
+
+        trace_printf("%s: tranche='%s' waits=%u samples=%u ela=%.3f ms\n",
+                     label,
+                     tranche ? tranche : "unknown",
+                     stats[i].waits,
+                     stats[i].samples,
+                     stats[i].ela_us / 1000.0);
     }
-    else if (IsA(planstate, SubqueryScanState))
+}
+
+/*
+ * One line of perf_event counters. IPC and cache misses per row tell a
+ * memory-bound plan from a CPU-bound one; without a PMU only the software
+ * counters are shown.
+ */
+static void
+write_perf_stats(const char *prefix, const ProcPerfStats *perf, double rows)
+{
+    trace_printf("%s task_clock=%.6f sec faults=%llu cs=%llu migrations=%llu",
+                 prefix,
+                 perf->task_clock_ns / 1e9,
+                 perf->page_faults,
+                 perf->context_switches,
+                 perf->cpu_migrations);
+
+    if (proc_perf_has_hw())
     {
-        SubqueryScanState *sss = (SubqueryScanState *) planstate;
-        finalize_plan_instrumentation(sss->subplan);
+        trace_printf(" cycles=%llu instructions=%llu ipc=%.2f cache_misses=%llu",
+                     perf->cycles,
+                     perf->instructions,
+                     perf->cycles > 0 ? (double) perf->instructions / perf->cycles : 0.0,
+                     perf->cache_misses);
+        if (rows > 0)
+            trace_printf(" misses/row=%.1f", perf->cache_misses / rows);
     }
+
+    trace_printf("\n");
 }
 
 /*
- * Write plan tree with statistics - ENHANCED with per-node detail
+ * Write heavyweight lock waits seen by the sampler, Oracle enqueue style:
+ * p1..p3 are the first three lock tag fields (database/relation/block for
+ * relation and tuple locks, the xid for transaction locks)
  */
 static void
-write_plan_tree(PlanState *planstate, int level)
+write_lock_waits(QueryDesc *queryDesc)
 {
-    if (!planstate)
-        return;
-    
-    Instrumentation *instr;
-    char indent[256];
+    PgTraceWaitSamples *samples = pg_trace_waitsample_get(queryDesc);
     int i;
-    char *node_type_name;
-    char type_buf[256];
-    NodeTag tag;
-    
-    /* Create indentation first */
-    for (i = 0; i < level * 2 && i < 255; i++)
-        indent[i] = ' ';
-    indent[i] = '\0';
-    
-    /* Get node type name and plan details */
-    if (planstate->plan)
+
+    if (!samples)
+        return;
+
+    for (i = 0; i < samples->nlockwaits; i++)
     {
-        Plan *plan = planstate->plan;
-        
-        /* Use nodeToString but extract just the type name (format: "{NODETYPE :field...}") */
-        node_type_name = nodeToString((Node *)planstate->plan);
-        
-        /* Extract node type: skip '{' and get text up to first ':' or space */
-        if (node_type_name[0] == '{')
+        PgTraceLockWait *wait = &samples->lockwaits[i];
+        LOCKTAG *tag = &wait->tag;
+        long ela_us = (long) (wait->last_seen - wait->start);
+
+        trace_printf("WAIT #%lld: nam='enq: %s - %s' ela=%ld p1=%u p2=%u p3=%u",
+                     (long long) current_query_context->cursor_id,
+                     GetLockNameFromTagType(tag->locktag_type),
+                     GetLockmodeName(tag->locktag_lockmethodid, wait->mode),
+                     Max(ela_us, 0L),
+                     tag->locktag_field1, tag->locktag_field2, tag->locktag_field3);
+
+        if (tag->locktag_type == LOCKTAG_TUPLE)
+            trace_printf(" offset=%u", (unsigned) tag->locktag_field4);
+        trace_printf(" node=%d", wait->plan_node_id);
+
+        if (wait->blocker_pid != 0)
         {
-            char *start;
-            char *end;
-            int type_len;
-            
-            start = node_type_name + 1;  /* Skip '{' */
-            end = strchr(start, ':');
-            if (!end)
-                end = strchr(start, ' ');
-            if (!end)
+            trace_printf(" blocker_pid=%d", wait->blocker_pid);
+            if (wait->blocker_cursor != 0)
+                trace_printf(" blocker_cursor=#%lld", (long long) wait->blocker_cursor);
+            if (wait->blocker_sql_id != 0)
+                trace_printf(" blocker_sql_id=%lld", (long long) wait->blocker_sql_id);
+        }
+        trace_printf("\n");
+
+        if ((tag->locktag_type == LOCKTAG_RELATION ||
+             tag->locktag_type == LOCKTAG_TUPLE ||
+             tag->locktag_type == LOCKTAG_PAGE) &&
+            tag->locktag_field1 == MyDatabaseId)
+        {
+            char *relname = get_rel_name((Oid) tag->locktag_field2);
+
+            if (relname)
+                trace_printf("  table='%s'\n", relname);
+        }
+    }
+
+    if (samples->lockwaits_lost > 0)
+        trace_printf("  ... (%u more lock waits not recorded)\n", samples->lockwaits_lost);
+}
+
+/*
+ * Write the sampled wait profile of every plan node that got samples
+ */
+static void
+write_wait_samples(QueryDesc *queryDesc)
+{
+    PgTraceWaitSamples *samples = pg_trace_waitsample_get(queryDesc);
+    uint32 total = 0;
+    int i;
+    int j;
+
+    if (!samples)
+        return;
+
+    for (i = 0; i <= samples->plan->nnodes; i++)
+        total += samples->profiles[i].total;
+
+    trace_printf("---------------------------------------------------------------------\n");
+    trace_printf("WAIT SAMPLES #%lld (every %d us, %u samples):\n",
+                 (long long) current_query_context->cursor_id,
+                 samples->interval_us, total);
+    trace_printf("---------------------------------------------------------------------\n");
+
+    if (total == 0)
+    {
+        trace_printf("  (query finished before the first sample)\n");
+        return;
+    }
+
+    for (i = 0; i <= samples->plan->nnodes; i++)
+    {
+        PgTraceWaitProfile *profile = &samples->profiles[i];
+        int id = -1;
+        const char *name = "Executor";
+
+        if (profile->total == 0)
+            continue;
+
+        if (i < samples->plan->nnodes)
+        {
+            id = samples->plan->nodes[i].plan_node_id;
+            name = samples->plan->nodes[i].name;
+        }
+
+        for (j = 0; j < profile->nwaits; j++)
+        {
+            uint32 info = profile->waits[j].wait_event_info;
+            const char *event = info ? pgstat_get_wait_event(info) : "CPU";
+            const char *wait_class = info ? pgstat_get_wait_event_type(info) : "CPU";
+
+            trace_printf("  id=%d op=%s nam='%s' class=%s samples=%u ela=%.3f ms\n",
+                         id, name,
+                         event ? event : "unknown",
+                         wait_class ? wait_class : "unknown",
+                         profile->waits[j].samples,
+                         profile->waits[j].samples * samples->interval_us / 1000.0);
+        }
+
+        if (profile->overflow > 0)
+            trace_printf("  id=%d op=%s nam='other' samples=%u ela=%.3f ms\n",
+                         id, name, profile->overflow,
+                         profile->overflow * samples->interval_us / 1000.0);
+    }
+}
+
+/*
+ * Memory of the work_mem consumers of one node, from the statistics the
+ * nodes keep for EXPLAIN ANALYZE: peaks, not current values, and nothing
+ * sampled while tuples flow
+ */
+static void
+write_node_memory(PlanState *planstate, const char *indent)
+{
+    long peak_kb = -1;
+    long disk_kb = 0;
+    int batches = 0;
+
+    switch (nodeTag(planstate))
+    {
+        case T_SortState:
+            {
+                SortState *sortstate = (SortState *) planstate;
+
+                if (sortstate->sort_Done && sortstate->tuplesortstate)
+                {
+                    TuplesortInstrumentation stats;
+
+                    tuplesort_get_stats((Tuplesortstate *) sortstate->tuplesortstate, &stats);
+                    if (stats.spaceType == SORT_SPACE_TYPE_DISK)
+                        disk_kb = (long) stats.spaceUsed;
+                    else
+                        peak_kb = (long) stats.spaceUsed;
+                }
+            }
+            break;
+
+        case T_HashState:
+            {
+                HashState *hashstate = (HashState *) planstate;
+
+                if (hashstate->hinstrument)
+                {
+                    peak_kb = (long) ((hashstate->hinstrument->space_peak + 1023) / 1024);
+                    batches = hashstate->hinstrument->nbatch;
+                }
+                else if (hashstate->hashtable)
+                {
+                    peak_kb = (long) ((hashstate->hashtable->spacePeak + 1023) / 1024);
+                    batches = hashstate->hashtable->nbatch;
+                }
+            }
+            break;
+
+        case T_AggState:
+            {
+                AggState *aggstate = (AggState *) planstate;
+
+                if (aggstate->hash_metacxt)
+                {
+                    peak_kb = (long) ((aggstate->hash_mem_peak + 1023) / 1024);
+                    disk_kb = (long) aggstate->hash_disk_used;
+                    batches = aggstate->hash_batches_used;
+                }
+            }
+            break;
+
+        case T_MemoizeState:
+            {
+                MemoizeState *mstate = (MemoizeState *) planstate;
+                uint64 mem_peak;
+
+                /* mem_peak is only maintained once the cache starts evicting */
+                mem_peak = mstate->stats.mem_peak > 0 ? mstate->stats.mem_peak : mstate->mem_used;
+                peak_kb = (long) ((mem_peak + 1023) / 1024);
+            }
+            break;
+
+        default:
+            return;
+    }
+
+    if (peak_kb < 0 && disk_kb == 0)
+        return;
+
+    trace_printf("%s   Memory: peak=%ld kB work_mem=%d kB", indent, Max(peak_kb, 0L), work_mem);
+    if (disk_kb > 0)
+        trace_printf(" spilled=%ld kB", disk_kb);
+    if (batches > 1)
+        trace_printf(" batches=%d", batches);
+    trace_printf("\n");
+}
+
+/*
+ * Recursively finalize instrumentation for all nodes
+ */
+static void
+finalize_plan_instrumentation(PlanState *planstate)
+{
+    int i;
+    
+    if (!planstate)
+        return;
+    
+    /* Finalize this node if needed */
+    if (planstate->instrument && planstate->instrument->running)
+        InstrEndLoop(planstate->instrument);
+    
+    /* Recurse to child nodes */
+    if (planstate->lefttree)
+        finalize_plan_instrumentation(planstate->lefttree);
+    if (planstate->righttree)
+        finalize_plan_instrumentation(planstate->righttree);
+    
+    /* Handle special multi-child nodes */
+    if (IsA(planstate, AppendState))
+    {
+        AppendState *as = (AppendState *) planstate;
+        for (i = 0; i < as->as_nplans; i++)
+            finalize_plan_instrumentation(as->appendplans[i]);
+    }
+    else if (IsA(planstate, SubqueryScanState))
+    {
+        SubqueryScanState *sss = (SubqueryScanState *) planstate;
+        finalize_plan_instrumentation(sss->subplan);
+    }
+}
+
+/*
+ * Write plan tree with statistics - ENHANCED with per-node detail
+ */
+static void
+write_plan_tree(PlanState *planstate, int level)
+{
+    if (!planstate)
+        return;
+    
+    Instrumentation *instr;
+    char indent[256];
+    int i;
+    char *node_type_name;
+    char type_buf[256];
+    NodeTag tag;
+    
+    /* Create indentation first */
+    for (i = 0; i < level * 2 && i < 255; i++)
+        indent[i] = ' ';
+    indent[i] = '\0';
+    
+    /* Get node type name and plan details */
+    if (planstate->plan)
+    {
+        Plan *plan = planstate->plan;
+        
+        /* Use nodeToString but extract just the type name (format: "{NODETYPE :field...}") */
+        node_type_name = nodeToString((Node *)planstate->plan);
+        
+        /* Extract node type: skip '{' and get text up to first ':' or space */
+        if (node_type_name[0] == '{')
+        {
+            char *start;
+            char *end;
+            int type_len;
+            
+            start = node_type_name + 1;  /* Skip '{' */
+            end = strchr(start, ':');
+            if (!end)
+                end = strchr(start, ' ');
+            if (!end)
                 end = start + strlen(start);
             
             type_len = end - start;
@@ -512,6 +1364,11 @@ write_plan_tree(PlanState *planstate, int level)
         
         trace_printf(" (actual rows=%.0f loops=%.0f)\n", 
                      instr->ntuples / instr->nloops, instr->nloops);
+
+        PG_TRACE_PROBE_NODE_DONE(current_query_context->cursor_id,
+                                 planstate->plan ? planstate->plan->plan_node_id : -1,
+                                 (int64) instr->ntuples, (int64) instr->nloops,
+                                 (int64) (instr->total * 1000000.0));
         
         /* Print node-specific details (table/index names) */
         if (planstate->plan)
@@ -720,6 +1577,42 @@ write_plan_tree(PlanState *planstate, int level)
                          instr->walusage.wal_fpi,
                          instr->walusage.wal_bytes);
         }
+
+        write_node_memory(planstate, indent);
+
+        /* Sampled LWLock waits inside this node */
+        {
+            int interval_us;
+            PgTraceWaitProfile *profile = pg_trace_waitsample_node_profile(planstate, &interval_us);
+            bool first = true;
+
+            for (i = 0; profile && i < profile->nwaits; i++)
+            {
+                uint32 info = profile->waits[i].wait_event_info;
+
+                if ((info & 0xFF000000) != PG_WAIT_LWLOCK)
+                    continue;
+
+                trace_printf("%s%s %s samples=%u (~%.3f ms)",
+                             first ? indent : ",",
+                             first ? "   LWLock:" : "",
+                             pgstat_get_wait_event(info),
+                             profile->waits[i].samples,
+                             profile->waits[i].samples * interval_us / 1000.0);
+                first = false;
+            }
+            if (!first)
+                trace_printf("\n");
+
+            /* Counters charged to this node by the sampler (self, not children) */
+            if (profile && profile->perf.task_clock_ns > 0)
+            {
+                char prefix[300];
+
+                snprintf(prefix, sizeof(prefix), "%s   Perf (sampled):", indent);
+                write_perf_stats(prefix, &profile->perf, instr->ntuples);
+            }
+        }
     }
     else
     {
@@ -754,11 +1647,13 @@ trace_planner(Query *parse, const char *query_string,
               int cursorOptions, ParamListInfo boundParams)
 {
     PlannedStmt *result;
-    TimestampTz start, end;
-    long secs;
-    int microsecs;
+    ProcClock start;
+    ProcClock end;
     BufferUsage buffer_before, buffer_after;
     long planning_buffers;
+    QueryTraceContext *saved_context = current_query_context;
+    QueryTraceContext *stale_context;
+    QueryTraceContext *context;
 
     if (!trace_enabled || !query_string)
     {
@@ -768,97 +1663,206 @@ trace_planner(Query *parse, const char *query_string,
             return standard_planner(parse, query_string, cursorOptions, boundParams);
     }
 
-    current_query_context = (QueryTraceContext *) MemoryContextAllocZero(
-        TopMemoryContext, sizeof(QueryTraceContext));
-    current_query_context->cursor_id = ++cursor_sequence;
-    current_query_context->sql_text = MemoryContextStrdup(TopMemoryContext, query_string);
-    current_query_context->block_ios = NIL;
+    /* Planned before but never started, e.g. a generic plan the plan cache rejected */
+    stale_context = context_find_planned();
+    if (stale_context)
+        context_release(stale_context, true);
+
+    context = context_create(pg_trace_sqltext_id(query_string, parse->queryId));
+    current_query_context = context;
+
+    /* Text is stored once in shared memory; the trace repeats only the id */
+    pg_trace_sqltext_acquire(context->sql_id, query_string);
+
+    PG_TRACE_PROBE_PARSE_START(context->cursor_id, context->sql_id, query_string);
 
     /* PARSE phase - Oracle 10046 style */
-    trace_printf("=====================================================================\n");
-    trace_printf("PARSE #%lld\n", (long long) current_query_context->cursor_id);
-    trace_printf("SQL: %s\n", query_string);
-    trace_printf("---------------------------------------------------------------------\n");
+    write_parse_header(query_string);
     
     buffer_before = pgBufferUsage;
-    start = GetCurrentTimestamp();
+    proc_clock_read(&start);
 
-    if (prev_planner_hook)
-        result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
-    else
-        result = standard_planner(parse, query_string, cursorOptions, boundParams);
+    /* Functions evaluated while planning run their SQL one level deeper */
+    nesting_level++;
+    PG_TRY();
+    {
+        if (prev_planner_hook)
+            result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+        else
+            result = standard_planner(parse, query_string, cursorOptions, boundParams);
+    }
+    PG_CATCH();
+    {
+        nesting_level--;
+        current_query_context = saved_context;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    nesting_level--;
 
-    end = GetCurrentTimestamp();
+    proc_clock_read(&end);
     buffer_after = pgBufferUsage;
     
-    TimestampDifference(start, end, &secs, &microsecs);
     planning_buffers = (buffer_after.shared_blks_hit - buffer_before.shared_blks_hit) +
                        (buffer_after.shared_blks_read - buffer_before.shared_blks_read);
 
-    trace_printf("PARSE TIME: ela=%ld.%06d sec cpu=0.000 sec (planning)\n", secs, microsecs);
+    write_phase_time("PARSE TIME:", &start, &end);
+    trace_printf(" (planning)\n");
+
+    PG_TRACE_PROBE_PARSE_DONE(context->cursor_id, context->sql_id,
+                              (end.wall_ns - start.wall_ns) / 1000);
+    pg_trace_events_emit(PG_TRACE_EVENT_PARSE, context->cursor_id, context->sql_id,
+                         (end.wall_ns - start.wall_ns) / 1000000.0, 0,
+                         buffer_after.shared_blks_hit - buffer_before.shared_blks_hit,
+                         buffer_after.shared_blks_read - buffer_before.shared_blks_read);
     trace_printf("PARSE STATS: cr=%ld (catalog blocks read during planning)\n", planning_buffers);
 
+    /* ExecutorStart picks the context up again */
+    current_query_context = saved_context;
+
     return result;
 }
 
+/*
+ * BINDS section: one line per parameter with its output function text
+ */
+static void
+write_binds(ParamListInfo params)
+{
+    int i;
+
+    trace_printf("---------------------------------------------------------------------\n");
+    trace_printf("BINDS #%lld:\n", (long long) current_query_context->cursor_id);
+
+    for (i = 0; i < params->numParams; i++)
+    {
+        ParamExternData *param = &params->params[i];
+        
+        if (!param->isnull)
+        {
+            Oid typoutput;
+            bool typIsVarlena;
+            char *val_str;
+
+            getTypeOutputInfo(param->ptype, &typoutput, &typIsVarlena);
+            val_str = OidOutputFunctionCall(typoutput, param->value);
+            trace_printf("  bind %d: value=\"%s\" oacdef=%u\n", i, val_str, param->ptype);
+            PG_TRACE_PROBE_BIND(current_query_context->cursor_id, i,
+                                param->ptype, val_str);
+            pfree(val_str);
+        }
+        else
+        {
+            trace_printf("  bind %d: value=NULL oacdef=%u\n", i, param->ptype);
+            PG_TRACE_PROBE_BIND(current_query_context->cursor_id, i,
+                                param->ptype, (char *) NULL);
+        }
+    }
+}
+
 /*
  * ExecutorStart hook
  */
 static void
 trace_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-    if (trace_enabled && current_query_context)
+    QueryTraceContext *saved_context = current_query_context;
+    QueryTraceContext *context = NULL;
+    ProcClock bind_start;
+    ProcClock bind_end;
+    uint64 sql_id = pg_trace_sqltext_id(queryDesc->sourceText,
+                                        queryDesc->plannedstmt->queryId);
+
+    pg_trace_ash_begin(queryDesc, sql_id);
+
+    if (trace_enabled)
+    {
+        context = context_find_planned();
+        if (!context && queryDesc->sourceText)
+        {
+            /* Cached plan, no planner call: the cursor starts here */
+            context = context_create(sql_id);
+            current_query_context = context;
+            pg_trace_sqltext_acquire(sql_id, queryDesc->sourceText);
+            write_parse_header(queryDesc->sourceText);
+        }
+    }
+
+    if (context)
     {
+        context->query_desc = queryDesc;
+        current_query_context = context;
+
+        proc_clock_read(&context->exec_clock_start);
+
         /* Enable full instrumentation */
         queryDesc->instrument_options = INSTRUMENT_ALL;
         
         /* Capture starting state */
-        current_query_context->buffer_usage_start = pgBufferUsage;
+        context->buffer_usage_start = pgBufferUsage;
         
-        /* Use getrusage() for microsecond-precision CPU timing */
-        proc_read_cpu_stats_rusage(&current_query_context->os_stats_start.cpu);
-        proc_read_io_stats(MyProcPid, &current_query_context->os_stats_start.io);
+        /* /proc I/O and scheduler stats; CPU time comes from ProcClock */
+        proc_sample_self(&context->os_stats_start);
+        proc_read_mem_stats(getpid(), &context->mem_start);
+
+        if (perf_counters && proc_perf_open())
+            context->perf_valid = proc_perf_read(&context->perf_start);
         
         /* Initialize buffer tracker */
-        buffer_tracker.last_bufusage = pgBufferUsage;
-        buffer_tracker.last_io_time = pgBufferUsage.blk_read_time;
+        context->buffer_tracker.last_bufusage = pgBufferUsage;
+        context->buffer_tracker.last_io_time = pgBufferUsage.blk_read_time;
         
         /* Write binds if present - Oracle 10046 style */
         if (queryDesc->params && queryDesc->params->numParams > 0)
-        {
-            ParamListInfo params = queryDesc->params;
-            int i;
+            write_binds(queryDesc->params);
+    }
 
-            trace_printf("---------------------------------------------------------------------\n");
-            trace_printf("BINDS #%lld:\n", (long long) current_query_context->cursor_id);
+    /* BIND TIME covers executor startup only, not the tracer's own work */
+    if (context)
+        proc_clock_read(&bind_start);
 
-            for (i = 0; i < params->numParams; i++)
-            {
-                ParamExternData *param = &params->params[i];
-                
-                if (!param->isnull)
-                {
-                    Oid typoutput;
-                    bool typIsVarlena;
-                    char *val_str;
-
-                    getTypeOutputInfo(param->ptype, &typoutput, &typIsVarlena);
-                    val_str = OidOutputFunctionCall(typoutput, param->value);
-                    trace_printf("  bind %d: value=\"%s\" oacdef=%u\n", i, val_str, param->ptype);
-                    pfree(val_str);
-                }
-                else
-                {
-                    trace_printf("  bind %d: value=NULL oacdef=%u\n", i, param->ptype);
-                }
-            }
-        }
+    PG_TRY();
+    {
+        if (prev_ExecutorStart_hook)
+            prev_ExecutorStart_hook(queryDesc, eflags);
+        else
+            standard_ExecutorStart(queryDesc, eflags);
     }
+    PG_CATCH();
+    {
+        current_query_context = saved_context;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
 
-    if (prev_ExecutorStart_hook)
-        prev_ExecutorStart_hook(queryDesc, eflags);
-    else
-        standard_ExecutorStart(queryDesc, eflags);
+    if (context)
+        proc_clock_read(&bind_end);
+
+    if (!(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+        pg_trace_sqlstats_start(queryDesc);
+
+    /* Publish the plan for pg_trace_live() */
+    if (context && queryDesc->planstate && !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+    {
+        PgTracePlan *plan = pg_trace_plan_flatten(queryDesc->planstate,
+                                                  queryDesc->estate->es_query_cxt);
+
+        pg_trace_live_begin(queryDesc, context->cursor_id,
+                            queryDesc->sourceText, plan,
+                            live_refresh_ms);
+        pg_trace_waitsample_begin(queryDesc, plan, wait_sample_interval_us,
+                                  perf_counters);
+    }
+
+    if (context)
+    {
+        if (queryDesc->planstate)
+            trace_printf("PLAN_ID: %lld\n", (long long) pg_trace_plan_id(queryDesc->planstate));
+        write_phase_time("BIND TIME:", &bind_start, &bind_end);
+        trace_printf(" (executor startup)\n");
+    }
+
+    current_query_context = saved_context;
 }
 
 /*
@@ -868,41 +1872,107 @@ static void
 trace_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
                   uint64 count, bool execute_once)
 {
-    TimestampTz start, end;
-    long secs;
-    int microsecs;
+    QueryTraceContext *saved_context = current_query_context;
+    QueryTraceContext *context = trace_enabled ? context_find(queryDesc) : NULL;
+    ProcClock start;
+    ProcClock end;
+    volatile bool finished = false;
 
-    if (trace_enabled && current_query_context)
+    /* Statements run by this one (functions, triggers) are its children */
+    current_query_context = context;
+
+    if (context)
     {
-        start = GetCurrentTimestamp();
-        current_query_context->exec_start_time = start;
+        proc_clock_read(&start);
+        context->exec_start_time = GetCurrentTimestamp();
 
         trace_printf("---------------------------------------------------------------------\n");
-        trace_printf("EXEC #%lld\n", (long long) current_query_context->cursor_id);
-    }
+        trace_printf("EXEC #%lld dep=%d tim=%lld\n",
+                     (long long) context->cursor_id, context->depth, trace_tim());
 
-    /* Capture I/O before execution */
-    if (trace_enabled && current_query_context)
+        PG_TRACE_PROBE_EXEC_START(context->cursor_id, context->sql_id);
+        pg_trace_events_emit(PG_TRACE_EVENT_EXEC, context->cursor_id, context->sql_id,
+                             0, 0, 0, 0);
+
+        /* Capture I/O before execution */
         track_block_io_during_execution();
+    }
 
-    if (prev_ExecutorRun_hook)
-        prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
-    else
-        standard_ExecutorRun(queryDesc, direction, count, execute_once);
+    pg_trace_live_run(queryDesc, true);
+    pg_trace_waitsample_run(queryDesc, true);
+    nesting_level++;
+    PG_TRY();
+    {
+        if (prev_ExecutorRun_hook)
+            prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+        else
+            standard_ExecutorRun(queryDesc, direction, count, execute_once);
+        finished = true;
+    }
+    PG_FINALLY();
+    {
+        nesting_level--;
+        current_query_context = saved_context;
+        pg_trace_waitsample_run(queryDesc, false);
+        pg_trace_live_run(queryDesc, false);
+
+        /* Keep exec_start/exec_done paired for tracers following cursors */
+        if (context && !finished)
+            PG_TRACE_PROBE_EXEC_DONE(context->cursor_id, context->sql_id, 0, 0);
+    }
+    PG_END_TRY();
 
     /* Capture I/O after execution */
-    if (trace_enabled && current_query_context)
+    if (context)
     {
+        current_query_context = context;
+        proc_clock_read(&end);
+
+        /* Largest executor memory seen, checked where it cannot be mid-change */
+        context->mem_max =
+            Max(context->mem_max,
+                MemoryContextMemAllocated(queryDesc->estate->es_query_cxt, true));
+
         track_block_io_during_execution();
-        
-        end = GetCurrentTimestamp();
-        TimestampDifference(start, end, &secs, &microsecs);
 
-        trace_printf("EXEC TIME: ela=%ld.%06d sec rows=%lld\n",
-                     secs, microsecs,
-                     (long long) queryDesc->estate->es_processed);
+        write_phase_time("EXEC TIME:", &start, &end);
+        trace_printf(" rows=%lld tim=%lld\n",
+                     (long long) queryDesc->estate->es_processed,
+                     trace_tim());
         trace_printf("---------------------------------------------------------------------\n");
+
+        PG_TRACE_PROBE_EXEC_DONE(context->cursor_id, context->sql_id,
+                                 (end.wall_ns - start.wall_ns) / 1000,
+                                 queryDesc->estate->es_processed);
+
+        current_query_context = saved_context;
+    }
+}
+
+/*
+ * ExecutorFinish hook: AFTER triggers run here, one level deeper like the
+ * statements run during ExecutorRun
+ */
+static void
+trace_ExecutorFinish(QueryDesc *queryDesc)
+{
+    QueryTraceContext *saved_context = current_query_context;
+
+    current_query_context = trace_enabled ? context_find(queryDesc) : NULL;
+    nesting_level++;
+    PG_TRY();
+    {
+        if (prev_ExecutorFinish_hook)
+            prev_ExecutorFinish_hook(queryDesc);
+        else
+            standard_ExecutorFinish(queryDesc);
+    }
+    PG_FINALLY();
+    {
+        nesting_level--;
+        current_query_context = saved_context;
     }
+    PG_END_TRY();
 }
 
 /*
@@ -911,12 +1981,13 @@ trace_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
 static void
 trace_ExecutorEnd(QueryDesc *queryDesc)
 {
+    QueryTraceContext *saved_context = current_query_context;
+    QueryTraceContext *context = context_find(queryDesc);
     BufferUsage buffer_end;
-    BufferUsage buffer_diff;
-    ProcStats os_end;
     
-    if (trace_enabled && current_query_context)
+    if (context && trace_enabled)
     {
+        current_query_context = context;
         buffer_end = pgBufferUsage;
         
         /* Final I/O capture */
@@ -926,23 +1997,44 @@ trace_ExecutorEnd(QueryDesc *queryDesc)
         if (queryDesc->planstate)
             finalize_plan_instrumentation(queryDesc->planstate);
         
-        /* Write buffer statistics */
-        buffer_diff.shared_blks_hit = buffer_end.shared_blks_hit - 
-                                      current_query_context->buffer_usage_start.shared_blks_hit;
-        buffer_diff.shared_blks_read = buffer_end.shared_blks_read - 
-                                       current_query_context->buffer_usage_start.shared_blks_read;
-
-        /* Write OS stats with MICROSECOND precision CPU timing */
-        if (proc_read_cpu_stats_rusage(&os_end.cpu))
+        write_exec_stats(&buffer_end, queryDesc->estate->es_processed);
+
+        /* Executor memory and process memory growth */
         {
-            ProcCpuStats cpu_diff;
-            proc_cpu_stats_diff(&current_query_context->os_stats_start.cpu, &os_end.cpu, &cpu_diff);
-            
-            trace_printf("EXEC STATS: cr=%ld pr=%ld cpu=%.6f sec elapsed=%.6f sec\n",
-                         buffer_diff.shared_blks_hit,
-                         buffer_diff.shared_blks_read,
-                         cpu_diff.total_sec,
-                         cpu_diff.total_sec);
+            ProcMemStats *mem_start = &current_query_context->mem_start;
+            ProcMemStats mem_end;
+            Size allocated = MemoryContextMemAllocated(queryDesc->estate->es_query_cxt, true);
+
+            current_query_context->mem_max = Max(current_query_context->mem_max, allocated);
+
+            trace_printf("EXEC MEM: allocated=%zu kB max=%zu kB",
+                         allocated / 1024, current_query_context->mem_max / 1024);
+            if (mem_start->vm_rss_kb > 0 && proc_read_mem_stats(getpid(), &mem_end))
+                trace_printf(" rss=%+ld kB anon=%+ld kB hwm=%+ld kB",
+                             (long) mem_end.vm_rss_kb - (long) mem_start->vm_rss_kb,
+                             (long) mem_end.rss_anon_kb - (long) mem_start->rss_anon_kb,
+                             (long) mem_end.vm_hwm_kb - (long) mem_start->vm_hwm_kb);
+            trace_printf("\n");
+        }
+
+        if (current_query_context->perf_valid)
+        {
+            ProcPerfStats perf_end;
+            ProcPerfStats perf_diff;
+
+            if (proc_perf_read(&perf_end))
+            {
+                proc_perf_stats_diff(&current_query_context->perf_start, &perf_end, &perf_diff);
+                write_perf_stats("EXEC PERF:", &perf_diff,
+                                 (double) queryDesc->estate->es_processed);
+            }
+        }
+
+        {
+            PgTraceWaitSamples *samples = pg_trace_waitsample_get(queryDesc);
+
+            if (samples)
+                write_lwlock_stats("EXEC LWLOCK", samples->lwlocks, samples->nlwlocks);
         }
         
         /* STAT section - per-node execution statistics */
@@ -962,18 +2054,22 @@ trace_ExecutorEnd(QueryDesc *queryDesc)
                      (long long) current_query_context->cursor_id);
         trace_printf("---------------------------------------------------------------------\n");
         write_block_io_summary();
+        write_lock_waits(queryDesc);
 
-        trace_printf("=====================================================================\n\n");
+        write_wait_samples(queryDesc);
 
-        /* Cleanup */
-        if (current_query_context->sql_text)
-            pfree(current_query_context->sql_text);
-        if (current_query_context->block_ios)
-            list_free_deep(current_query_context->block_ios);
-        pfree(current_query_context);
-        current_query_context = NULL;
+        trace_printf("=====================================================================\n\n");
     }
+
+    current_query_context = saved_context;
+    if (context)
+        context_release(context, true);
     
+    pg_trace_live_end(queryDesc);
+    pg_trace_ash_end(queryDesc);
+    pg_trace_waitsample_end(queryDesc);
+    pg_trace_sqlstats_end(queryDesc);
+
     /* Call standard executor end to cleanup */
     if (prev_ExecutorEnd_hook)
         prev_ExecutorEnd_hook(queryDesc);
@@ -981,6 +2077,184 @@ trace_ExecutorEnd(QueryDesc *queryDesc)
         standard_ExecutorEnd(queryDesc);
 }
 
+/*
+ * Utility statements that only change session or transaction state
+ */
+static bool
+utility_is_trivial(Node *parsetree)
+{
+    switch (nodeTag(parsetree))
+    {
+        case T_TransactionStmt:
+        case T_VariableSetStmt:
+        case T_VariableShowStmt:
+        case T_ConstraintsSetStmt:
+        case T_DiscardStmt:
+        case T_ListenStmt:
+        case T_UnlistenStmt:
+        case T_NotifyStmt:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * ProcessUtility hook: COPY, CREATE INDEX, VACUUM, CLUSTER, REFRESH and
+ * other utility statements get a cursor of their own, with the EXEC
+ * records of a query but no plan. Statements they run through the
+ * executor (REFRESH, CREATE TABLE AS, COPY from a query, the body of a DO
+ * block or procedure) are its recursive cursors, one level deeper.
+ */
+static void
+trace_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+                     bool readOnlyTree, ProcessUtilityContext context,
+                     ParamListInfo params, QueryEnvironment *queryEnv,
+                     DestReceiver *dest, QueryCompletion *qc)
+{
+    Node *parsetree = pstmt->utilityStmt;
+    QueryTraceContext *saved_context = current_query_context;
+    QueryTraceContext *utility_context;
+    const char *text;
+    int text_len;
+    char *sql;
+    ProcClock start;
+    ProcClock end;
+    BufferUsage buffer_end;
+    WalUsage wal_start;
+
+    /*
+     * Subcommands are part of their parent statement; EXECUTE is traced by
+     * the executor hooks and PREPARE/DEALLOCATE do no work worth a cursor,
+     * nor, unless asked for, do BEGIN/COMMIT, SET, SHOW and the like
+     */
+    if (!trace_enabled || !queryString || context == PROCESS_UTILITY_SUBCOMMAND ||
+        IsA(parsetree, ExecuteStmt) || IsA(parsetree, PrepareStmt) ||
+        IsA(parsetree, DeallocateStmt) ||
+        (!trace_trivial_utility && utility_is_trivial(parsetree)))
+    {
+        if (prev_ProcessUtility_hook)
+            prev_ProcessUtility_hook(pstmt, queryString, readOnlyTree, context,
+                                     params, queryEnv, dest, qc);
+        else
+            standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                    params, queryEnv, dest, qc);
+        return;
+    }
+
+    /* This statement only, not the rest of a multi-statement string */
+    text = queryString;
+    text_len = strlen(queryString);
+    if (pstmt->stmt_location >= 0 && pstmt->stmt_location <= text_len)
+    {
+        text += pstmt->stmt_location;
+        text_len = pstmt->stmt_len > 0 ? Min(pstmt->stmt_len, text_len - pstmt->stmt_location)
+                                       : text_len - pstmt->stmt_location;
+    }
+    sql = pnstrdup(text, text_len);
+
+    utility_context = context_create(pg_trace_sqltext_id(sql, pstmt->queryId));
+    utility_context->utility = true;
+    current_query_context = utility_context;
+
+    pg_trace_sqltext_acquire(utility_context->sql_id, sql);
+
+    write_parse_header(sql);
+    trace_printf("UTILITY: %s\n", GetCommandTagName(CreateCommandTag(parsetree)));
+    trace_printf("---------------------------------------------------------------------\n");
+    trace_printf("EXEC #%lld dep=%d tim=%lld\n",
+                 (long long) utility_context->cursor_id, utility_context->depth, trace_tim());
+
+    PG_TRACE_PROBE_EXEC_START(utility_context->cursor_id, utility_context->sql_id);
+    pg_trace_events_emit(PG_TRACE_EVENT_EXEC, utility_context->cursor_id,
+                         utility_context->sql_id, 0, 0, 0, 0);
+
+    proc_clock_read(&start);
+    utility_context->exec_clock_start = start;
+    utility_context->buffer_usage_start = pgBufferUsage;
+    proc_sample_self(&utility_context->os_stats_start);
+    wal_start = pgWalUsage;
+
+    utility_context->buffer_tracker.last_bufusage = pgBufferUsage;
+    utility_context->buffer_tracker.last_io_time = pgBufferUsage.blk_read_time;
+    track_block_io_during_execution();
+
+    nesting_level++;
+    PG_TRY();
+    {
+        if (prev_ProcessUtility_hook)
+            prev_ProcessUtility_hook(pstmt, queryString, readOnlyTree, context,
+                                     params, queryEnv, dest, qc);
+        else
+            standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                    params, queryEnv, dest, qc);
+    }
+    PG_CATCH();
+    {
+        nesting_level--;
+        current_query_context = saved_context;
+        PG_TRACE_PROBE_EXEC_DONE(utility_context->cursor_id, utility_context->sql_id, 0, 0);
+        context_release(utility_context, false);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    /* A ROLLBACK inside a procedure released what ran below us */
+    nesting_level = utility_context->depth;
+    current_query_context = utility_context;
+
+    proc_clock_read(&end);
+    buffer_end = pgBufferUsage;
+    track_block_io_during_execution();
+
+    write_phase_time("EXEC TIME:", &start, &end);
+    trace_printf(" rows=%llu tim=%lld\n",
+                 (unsigned long long) (qc ? qc->nprocessed : 0), trace_tim());
+    trace_printf("---------------------------------------------------------------------\n");
+
+    PG_TRACE_PROBE_EXEC_DONE(utility_context->cursor_id, utility_context->sql_id,
+                             (end.wall_ns - start.wall_ns) / 1000,
+                             qc ? qc->nprocessed : 0);
+
+    write_exec_stats(&buffer_end, qc ? qc->nprocessed : 0);
+
+    /* Bulk loads, index builds and vacuums write, spill and log */
+    {
+        BufferUsage *buffer_start = &utility_context->buffer_usage_start;
+        WalUsage wal_diff;
+
+        trace_printf("EXEC IO: dirtied=%ld written=%ld temp_read=%ld temp_written=%ld "
+                     "local_read=%ld local_written=%ld read_time=%.3f ms write_time=%.3f ms\n",
+                     buffer_end.shared_blks_dirtied - buffer_start->shared_blks_dirtied,
+                     buffer_end.shared_blks_written - buffer_start->shared_blks_written,
+                     buffer_end.temp_blks_read - buffer_start->temp_blks_read,
+                     buffer_end.temp_blks_written - buffer_start->temp_blks_written,
+                     buffer_end.local_blks_read - buffer_start->local_blks_read,
+                     buffer_end.local_blks_written - buffer_start->local_blks_written,
+                     INSTR_TIME_GET_MILLISEC(buffer_end.blk_read_time) -
+                     INSTR_TIME_GET_MILLISEC(buffer_start->blk_read_time),
+                     INSTR_TIME_GET_MILLISEC(buffer_end.blk_write_time) -
+                     INSTR_TIME_GET_MILLISEC(buffer_start->blk_write_time));
+
+        memset(&wal_diff, 0, sizeof(wal_diff));
+        WalUsageAccumDiff(&wal_diff, &pgWalUsage, &wal_start);
+        trace_printf("EXEC WAL: records=%ld fpi=%ld bytes=%llu\n",
+                     wal_diff.wal_records, wal_diff.wal_fpi,
+                     (unsigned long long) wal_diff.wal_bytes);
+    }
+
+    trace_printf("---------------------------------------------------------------------\n");
+    trace_printf("WAIT #%lld (I/O events during execution):\n",
+                 (long long) utility_context->cursor_id);
+    trace_printf("---------------------------------------------------------------------\n");
+    write_block_io_summary();
+    trace_printf("=====================================================================\n\n");
+
+    current_query_context = saved_context;
+    context_release(utility_context, true);
+    pfree(sql);
+}
+
 /*
  * SQL functions
  */
@@ -1012,6 +2286,14 @@ pg_trace_start_trace(PG_FUNCTION_ARGS)
                 (errcode_for_file_access(),
                  errmsg("could not open trace file \"%s\"", trace_filename)));
 
+    /* New file: every statement text has to be written again */
+    if (written_sql_ids)
+    {
+        hash_destroy(written_sql_ids);
+        written_sql_ids = NULL;
+    }
+    pg_trace_waitsample_session_reset();
+
     trace_printf("***********************************************************************\n");
     trace_printf("*** PostgreSQL Ultimate Trace (Oracle 10046-style + per-block I/O)\n");
     trace_printf("*** PID: %d\n", MyProcPid);
@@ -1026,6 +2308,7 @@ pg_trace_start_trace(PG_FUNCTION_ARGS)
         trace_printf("*** Without it, you won't get per-block I/O timing!\n");
     }
     trace_printf("*** OS cache threshold: %d microseconds\n", os_cache_threshold_us);
+    trace_printf("*** SQL text is written once per SQL_ID; see pg_trace_sql_text(sql_id)\n");
     trace_printf("***********************************************************************\n\n");
 
     trace_enabled = true;
@@ -1049,6 +2332,12 @@ pg_trace_stop_trace(PG_FUNCTION_ARGS)
 
     trace_printf("\n*** Trace ended at %s\n", timestamptz_to_str(GetCurrentTimestamp()));
     trace_printf("*** Total queries traced: %lld\n", (long long) cursor_sequence);
+    {
+        PgTraceLWLockStat *stats;
+        int nstats = pg_trace_waitsample_session_lwlocks(&stats);
+
+        write_lwlock_stats("*** SESSION LWLOCK", stats, nstats);
+    }
 
     fclose(trace_file);
     trace_file = NULL;
@@ -1088,3 +2377,303 @@ pg_trace_set_cache_threshold(PG_FUNCTION_ARGS)
     PG_RETURN_INT32(os_cache_threshold_us);
 }
 
+
+/*---- Microbenchmarks ----*/
+
+/*
+ * pg_trace_bench() times the trace hot paths in the calling backend on
+ * synthetic input, writing to /dev/null instead of the trace file. Each
+ * benchmark runs the requested iterations or for one second, whichever
+ * ends first, resetting a private memory context after every operation.
+ * bytes_per_op is what a separate run of up to 100 operations left
+ * allocated in that context: the memory a traced query holds per call
+ * until its end.
+ */
+
+#define BENCH_TIME_BUDGET_MS    1000.0
+#define BENCH_MEMORY_OPS        100
+
+typedef void (*BenchOp) (void *arg);
+
+static void
+bench_trace_printf(void *arg)
+{
+    trace_printf("WAIT #%lld: nam='%s' ela=%d p1=%u p2=%u p3=%d tim=%lld\n",
+                 (long long) 1, "DataFileRead", 123, 1663, 16384, 0,
+                 (long long) 1718000000000000);
+}
+
+static void
+bench_capture_buffer_io(void *arg)
+{
+    current_query_context->block_ios = NIL;
+    capture_buffer_io_stats();
+}
+
+static void
+bench_write_plan_tree(void *arg)
+{
+    write_plan_tree((PlanState *) arg, 0);
+}
+
+static void
+bench_write_binds(void *arg)
+{
+    write_binds((ParamListInfo) arg);
+}
+
+static void
+bench_proc_sample_self(void *arg)
+{
+    ProcStats stats;
+
+    proc_sample_self(&stats);
+}
+
+static void
+bench_proc_read_mem_stats(void *arg)
+{
+    ProcMemStats stats;
+
+    proc_read_mem_stats(getpid(), &stats);
+}
+
+static void
+bench_proc_perf_read(void *arg)
+{
+    ProcPerfStats stats;
+
+    proc_perf_read(&stats);
+}
+
+/*
+ * Balanced tree of nnodes: NestLoop joins over SeqScans without a range
+ * table entry, with the Instrumentation of a finished execution.
+ */
+static PlanState *
+bench_make_plan(int nnodes, int *next_id)
+{
+    PlanState *planstate;
+    Plan *plan;
+    Instrumentation *instr;
+
+    if (nnodes <= 1)
+    {
+        SeqScan *scan = makeNode(SeqScan);
+        SeqScanState *scanstate = makeNode(SeqScanState);
+
+        plan = &scan->scan.plan;
+        planstate = &scanstate->ss.ps;
+        plan->plan_node_id = (*next_id)++;
+    }
+    else
+    {
+        NestLoop *join = makeNode(NestLoop);
+        NestLoopState *joinstate = makeNode(NestLoopState);
+        int left = nnodes / 2;
+        int right = nnodes - 1 - left;
+
+        plan = &join->join.plan;
+        planstate = &joinstate->js.ps;
+        plan->plan_node_id = (*next_id)++;
+        planstate->lefttree = bench_make_plan(left, next_id);
+        plan->lefttree = planstate->lefttree->plan;
+        if (right > 0)
+        {
+            planstate->righttree = bench_make_plan(right, next_id);
+            plan->righttree = planstate->righttree->plan;
+        }
+    }
+
+    plan->startup_cost = 0.0;
+    plan->total_cost = 1000.0;
+    plan->plan_rows = 1000;
+    plan->plan_width = 8;
+    planstate->plan = plan;
+
+    instr = InstrAlloc(1, INSTRUMENT_ALL, false);
+    instr->nloops = 1;
+    instr->ntuples = 1000;
+    instr->startup = 0.0001;
+    instr->total = 0.002;
+    instr->bufusage.shared_blks_hit = 90;
+    instr->bufusage.shared_blks_read = 10;
+    planstate->instrument = instr;
+
+    return planstate;
+}
+
+/* Alternating int4 and text parameters */
+static ParamListInfo
+bench_make_params(int nparams)
+{
+    ParamListInfo params = makeParamList(nparams);
+    int i;
+
+    for (i = 0; i < nparams; i++)
+    {
+        ParamExternData *prm = &params->params[i];
+
+        prm->isnull = false;
+        prm->pflags = PARAM_FLAG_CONST;
+        if (i % 2 == 0)
+        {
+            prm->ptype = INT4OID;
+            prm->value = Int32GetDatum(i * 12345);
+        }
+        else
+        {
+            prm->ptype = TEXTOID;
+            prm->value = CStringGetTextDatum("bench bind value");
+        }
+    }
+    params->numParams = nparams;
+
+    return params;
+}
+
+static void
+bench_run(ReturnSetInfo *rsinfo, MemoryContext cxt, const char *name,
+          BenchOp op, void *arg, int iterations)
+{
+    MemoryContext oldcxt;
+    instr_time start;
+    instr_time elapsed;
+    Size allocated;
+    int memory_ops = Min(iterations, BENCH_MEMORY_OPS);
+    int done = 0;
+    int i;
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+
+    oldcxt = MemoryContextSwitchTo(cxt);
+
+    /* Memory left behind, which also warms up the caches */
+    allocated = MemoryContextMemAllocated(cxt, true);
+    for (i = 0; i < memory_ops; i++)
+        op(arg);
+    allocated = MemoryContextMemAllocated(cxt, true) - allocated;
+    MemoryContextReset(cxt);
+
+    INSTR_TIME_SET_CURRENT(start);
+    while (done < iterations)
+    {
+        op(arg);
+        MemoryContextReset(cxt);
+        done++;
+
+        if (done % 16 == 0)
+        {
+            CHECK_FOR_INTERRUPTS();
+            INSTR_TIME_SET_CURRENT(elapsed);
+            INSTR_TIME_SUBTRACT(elapsed, start);
+            if (INSTR_TIME_GET_MILLISEC(elapsed) >= BENCH_TIME_BUDGET_MS)
+                break;
+        }
+    }
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, start);
+
+    MemoryContextSwitchTo(oldcxt);
+
+    values[0] = CStringGetTextDatum(name);
+    values[1] = Int32GetDatum(done);
+    values[2] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(elapsed) * 1e9 / done);
+    values[3] = Float8GetDatum((double) allocated / memory_ops);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+Datum
+pg_trace_bench(PG_FUNCTION_ARGS)
+{
+    int iterations = PG_GETARG_INT32(0);
+    ReturnSetInfo *rsinfo;
+    MemoryContext bench_cxt;
+    QueryTraceContext bench_context;
+    FILE *devnull;
+    FILE *saved_file = trace_file;
+    QueryTraceContext *saved_context = current_query_context;
+    bool saved_io_timing = track_io_timing;
+    static const int plan_sizes[] = {10, 100, 1000};
+    static const int bind_counts[] = {10, 100};
+    PlanState *plans[lengthof(plan_sizes)];
+    ParamListInfo binds[lengthof(bind_counts)];
+    int i;
+
+    if (iterations < 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("iterations must be at least 1")));
+
+    InitMaterializedSRF(fcinfo, 0);
+    rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    for (i = 0; i < lengthof(plan_sizes); i++)
+    {
+        int next_id = 0;
+
+        plans[i] = bench_make_plan(plan_sizes[i], &next_id);
+    }
+    for (i = 0; i < lengthof(bind_counts); i++)
+        binds[i] = bench_make_params(bind_counts[i]);
+
+    devnull = AllocateFile("/dev/null", "w");
+    if (!devnull)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open \"/dev/null\": %m")));
+
+    bench_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                      "pg_trace bench",
+                                      ALLOCSET_SMALL_SIZES);
+    memset(&bench_context, 0, sizeof(bench_context));
+
+    PG_TRY();
+    {
+        char name[64];
+
+        trace_file = devnull;
+        current_query_context = &bench_context;
+        track_io_timing = true;     /* capture_buffer_io_stats() does nothing without */
+
+        bench_run(rsinfo, bench_cxt, "trace_printf",
+                  bench_trace_printf, NULL, iterations);
+        bench_run(rsinfo, bench_cxt, "capture_buffer_io_stats",
+                  bench_capture_buffer_io, NULL, iterations);
+
+        for (i = 0; i < lengthof(plan_sizes); i++)
+        {
+            snprintf(name, sizeof(name), "write_plan_tree/%d", plan_sizes[i]);
+            bench_run(rsinfo, bench_cxt, name,
+                      bench_write_plan_tree, plans[i], iterations);
+        }
+        for (i = 0; i < lengthof(bind_counts); i++)
+        {
+            snprintf(name, sizeof(name), "write_binds/%d", bind_counts[i]);
+            bench_run(rsinfo, bench_cxt, name,
+                      bench_write_binds, binds[i], iterations);
+        }
+
+        bench_run(rsinfo, bench_cxt, "proc_sample_self",
+                  bench_proc_sample_self, NULL, iterations);
+        bench_run(rsinfo, bench_cxt, "proc_read_mem_stats",
+                  bench_proc_read_mem_stats, NULL, iterations);
+
+        /* Only when enabled, so the benchmark does not open counters itself */
+        if (perf_counters && proc_perf_open())
+            bench_run(rsinfo, bench_cxt, "proc_perf_read",
+                      bench_proc_perf_read, NULL, iterations);
+    }
+    PG_FINALLY();
+    {
+        trace_file = saved_file;
+        current_query_context = saved_context;
+        track_io_timing = saved_io_timing;
+    }
+    PG_END_TRY();
+
+    FreeFile(devnull);
+    MemoryContextDelete(bench_cxt);
+
+    return (Datum) 0;
+}
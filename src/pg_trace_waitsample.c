@@ -0,0 +1,509 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_waitsample.c
+ *    In-backend wait event sampler attributed to plan nodes
+ *
+ * The currently executing node is tracked by swapping each node's
+ * ExecProcNodeReal for a wrapper; both the plain and the instrumented
+ * ExecProcNode paths call through it. Nodes driven by MultiExecProcNode
+ * (Hash, BitmapIndexScan, ...) are counted against their parent.
+ *
+ * The timer runs on CLOCK_MONOTONIC so that samples are taken while the
+ * backend sleeps, which is the whole point. The signal is installed with
+ * SA_RESTART; interruptible sleeps already retry on EINTR in the backend.
+ *
+ * Heavyweight lock waits are also followed as episodes: the lock tag and
+ * mode come from our own PGPROC, which is stable while we sleep, and the
+ * start time from PGPROC->waitStart. The duration is therefore exact at
+ * the start and accurate to one sampling interval at the end.
+ *
+ * With perf counters on, each sample also reads the backend's counter
+ * group and charges the delta since the previous sample to the running
+ * node. Reading at every ExecProcNode would cost two syscalls per tuple;
+ * this is a statistical self-cost per node at one read per sample.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <signal.h>
+#include <time.h>
+
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "storage/proc.h"
+#include "utils/wait_event.h"
+
+#include "pg_trace_ash.h"
+#include "pg_trace_live.h"
+#include "pg_trace_waitsample.h"
+
+/* A realtime signal the server does not use */
+#define WAIT_SAMPLE_SIGNAL          (SIGRTMIN + 3)
+
+/* Faster sampling costs more than it tells */
+#define WAIT_SAMPLE_MIN_INTERVAL_US 100
+
+/* Sampled query */
+static QueryDesc *ws_query = NULL;
+static SubTransactionId ws_subid = InvalidSubTransactionId;
+static PgTraceWaitSamples *ws_samples = NULL;
+static ExecProcNodeMtd *ws_original = NULL;     /* By flattened index */
+static int *ws_node_by_id = NULL;               /* plan_node_id -> index */
+
+/* Signal handler state */
+static volatile sig_atomic_t ws_running = false;
+static volatile int ws_current = -1;
+static volatile int ws_lockwait = -1;   /* Open lock wait episode */
+static volatile uint32 ws_prev_info = 0;
+static ProcPerfStats ws_perf_last;      /* Counters at the previous sample */
+
+/* LWLock waits of all sampled queries since tracing started */
+static PgTraceLWLockStat session_lwlocks[PG_TRACE_LWLOCK_STATS];
+static int session_nlwlocks = 0;
+
+static timer_t ws_timer;
+static bool ws_timer_created = false;
+
+/*
+ * Blocker of our lock wait, once pg_trace_ash_blocker() knows it: for
+ * relation, tuple and other non-transaction locks only after the ASH
+ * worker's next tick. Signal handler context.
+ */
+static void
+ws_resolve_blocker(PgTraceLockWait *wait)
+{
+    PGPROC *blocker = pg_trace_ash_blocker(MyProc);
+
+    if (blocker)
+    {
+        wait->blocker_pid = blocker->pid;
+        wait->blocker_cursor = pg_trace_live_cursor_id(blocker->backendId);
+        wait->blocker_sql_id = pg_trace_ash_sql_id(blocker->backendId);
+    }
+}
+
+/*
+ * Follow heavyweight lock waits across samples. Signal handler context.
+ */
+static void
+ws_record_lock_wait(uint32 info, int plan_node_id)
+{
+    PgTraceWaitSamples *samples = ws_samples;
+    PgTraceLockWait *wait;
+    LOCK *lock;
+    TimestampTz start;
+    TimestampTz now;
+
+    if ((info & 0xFF000000) != PG_WAIT_LOCK || !(lock = MyProc->waitLock))
+    {
+        ws_lockwait = -1;
+        return;
+    }
+
+    now = GetCurrentTimestamp();
+    start = (TimestampTz) pg_atomic_read_u64(&MyProc->waitStart);
+
+    /* Still the same wait? */
+    if (ws_lockwait >= 0)
+    {
+        wait = &samples->lockwaits[ws_lockwait];
+        if (memcmp(&wait->tag, &lock->tag, sizeof(LOCKTAG)) == 0 &&
+            (start == 0 || start == wait->start))
+        {
+            wait->last_seen = now;
+            if (wait->blocker_pid == 0)
+                ws_resolve_blocker(wait);
+            return;
+        }
+    }
+
+    if (samples->nlockwaits >= PG_TRACE_LOCK_WAITS)
+    {
+        samples->lockwaits_lost++;
+        ws_lockwait = -1;
+        return;
+    }
+
+    ws_lockwait = samples->nlockwaits++;
+    wait = &samples->lockwaits[ws_lockwait];
+    memcpy(&wait->tag, &lock->tag, sizeof(LOCKTAG));
+    wait->mode = MyProc->waitLockMode;
+    wait->start = start != 0 ? start : now;
+    wait->last_seen = now;
+    wait->plan_node_id = plan_node_id;
+
+    ws_resolve_blocker(wait);
+}
+
+/*
+ * Count an LWLock sample against its tranche. Signal handler context.
+ */
+static void
+ws_record_lwlock(uint32 info)
+{
+    PgTraceWaitSamples *samples = ws_samples;
+    PgTraceLWLockStat *stat = NULL;
+    int i;
+
+    for (i = 0; i < samples->nlwlocks; i++)
+    {
+        if (samples->lwlocks[i].wait_event_info == info)
+        {
+            stat = &samples->lwlocks[i];
+            break;
+        }
+    }
+
+    if (!stat)
+    {
+        if (samples->nlwlocks >= PG_TRACE_LWLOCK_STATS)
+            return;
+        stat = &samples->lwlocks[samples->nlwlocks++];
+        stat->wait_event_info = info;
+    }
+
+    if (info != ws_prev_info)
+        stat->waits++;
+    stat->samples++;
+    stat->ela_us += samples->interval_us;
+}
+
+/*
+ * Count one sample against the running node. Signal handler context:
+ * touches only memory set up before the timer was armed.
+ */
+static void
+ws_record(void)
+{
+    PgTraceWaitProfile *profile;
+    uint32 info;
+    int index = ws_current;
+    int i;
+
+    if (index < 0)
+        index = ws_samples->plan->nnodes;
+
+    profile = &ws_samples->profiles[index];
+    info = MyProc ? *((volatile uint32 *) &MyProc->wait_event_info) : 0;
+
+    if (ws_samples->perf)
+    {
+        ProcPerfStats now;
+        ProcPerfStats delta;
+
+        if (proc_perf_read(&now))
+        {
+            proc_perf_stats_diff(&ws_perf_last, &now, &delta);
+            proc_perf_stats_add(&profile->perf, &delta);
+            ws_perf_last = now;
+        }
+    }
+
+    ws_record_lock_wait(info, index < ws_samples->plan->nnodes ?
+                        ws_samples->plan->nodes[index].plan_node_id : -1);
+    if ((info & 0xFF000000) == PG_WAIT_LWLOCK)
+        ws_record_lwlock(info);
+    ws_prev_info = info;
+
+    profile->total++;
+
+    for (i = 0; i < profile->nwaits; i++)
+    {
+        if (profile->waits[i].wait_event_info == info)
+        {
+            profile->waits[i].samples++;
+            return;
+        }
+    }
+
+    if (profile->nwaits < PG_TRACE_WAIT_SLOTS)
+    {
+        profile->waits[profile->nwaits].wait_event_info = info;
+        profile->waits[profile->nwaits].samples = 1;
+        profile->nwaits++;
+    }
+    else
+        profile->overflow++;
+}
+
+static void
+ws_signal_handler(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+
+    if (ws_running)
+        ws_record();
+
+    errno = save_errno;
+}
+
+/*
+ * ExecProcNodeReal wrapper: mark the node as running for the sampler
+ */
+static TupleTableSlot *
+ws_exec_proc_node(PlanState *node)
+{
+    int index = ws_node_by_id[node->plan->plan_node_id];
+    int saved = ws_current;
+    TupleTableSlot *slot;
+
+    ws_current = index;
+    slot = ws_original[index](node);
+    ws_current = saved;
+
+    return slot;
+}
+
+/*
+ * Per-backend setup of the signal and the timer
+ */
+static bool
+ws_init(void)
+{
+    struct sigevent sev;
+
+    if (ws_timer_created)
+        return true;
+
+    pqsignal(WAIT_SAMPLE_SIGNAL, ws_signal_handler);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = WAIT_SAMPLE_SIGNAL;
+
+    if (timer_create(CLOCK_MONOTONIC, &sev, &ws_timer) != 0)
+    {
+        ereport(WARNING,
+                (errmsg("pg_trace: could not create wait sampling timer: %m")));
+        return false;
+    }
+
+    ws_timer_created = true;
+    return true;
+}
+
+static void
+ws_set_timer(int interval_us)
+{
+    struct itimerspec its;
+
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = (long) (interval_us % 1000000) * 1000;
+    its.it_value = its.it_interval;
+
+    timer_settime(ws_timer, 0, &its, NULL);
+}
+
+/*
+ * Start sampling queryDesc. Like pg_trace_live(), only the outermost
+ * traced query is sampled; time spent in nested statements is counted
+ * against the outer node that invoked them.
+ */
+bool
+pg_trace_waitsample_begin(QueryDesc *queryDesc, PgTracePlan *plan, int interval_us,
+                          bool perf_counters)
+{
+    MemoryContext cxt = queryDesc->estate->es_query_cxt;
+    int max_id = 0;
+    int i;
+
+    if (interval_us <= 0 || ws_query || !plan || plan->nnodes == 0)
+        return false;
+
+    if (!ws_init())
+        return false;
+
+    for (i = 0; i < plan->nnodes; i++)
+        max_id = Max(max_id, plan->nodes[i].plan_node_id);
+
+    ws_samples = (PgTraceWaitSamples *) MemoryContextAllocZero(cxt, sizeof(PgTraceWaitSamples));
+    ws_samples->plan = plan;
+    ws_samples->interval_us = Max(interval_us, WAIT_SAMPLE_MIN_INTERVAL_US);
+    ws_samples->perf = perf_counters && proc_perf_open();
+    ws_samples->profiles = (PgTraceWaitProfile *)
+        MemoryContextAllocZero(cxt, (plan->nnodes + 1) * sizeof(PgTraceWaitProfile));
+
+    ws_original = (ExecProcNodeMtd *) MemoryContextAllocZero(cxt, plan->nnodes * sizeof(ExecProcNodeMtd));
+    ws_node_by_id = (int *) MemoryContextAlloc(cxt, (max_id + 1) * sizeof(int));
+    for (i = 0; i <= max_id; i++)
+        ws_node_by_id[i] = -1;
+
+    for (i = 0; i < plan->nnodes; i++)
+    {
+        PlanState *ps = plan->nodes[i].planstate;
+
+        if (!ps->plan || ps->plan->plan_node_id < 0 || !ps->ExecProcNodeReal)
+            continue;
+
+        ws_node_by_id[ps->plan->plan_node_id] = i;
+        ws_original[i] = ps->ExecProcNodeReal;
+        ps->ExecProcNodeReal = ws_exec_proc_node;
+    }
+
+    ws_query = queryDesc;
+    ws_subid = GetCurrentSubTransactionId();
+    ws_current = -1;
+
+    return true;
+}
+
+/*
+ * Arm or disarm the timer around ExecutorRun
+ */
+void
+pg_trace_waitsample_run(QueryDesc *queryDesc, bool running)
+{
+    if (queryDesc != ws_query)
+        return;
+
+    if (running && !ws_running)
+    {
+        ws_current = -1;
+        ws_lockwait = -1;
+        ws_prev_info = 0;
+        if (ws_samples->perf)
+            proc_perf_read(&ws_perf_last);
+        ws_running = true;
+        ws_set_timer(ws_samples->interval_us);
+    }
+    else if (!running && ws_running)
+    {
+        ws_set_timer(0);
+        ws_running = false;
+        ws_current = -1;
+    }
+}
+
+/*
+ * Profiles of queryDesc, or NULL if it was not sampled
+ */
+PgTraceWaitSamples *
+pg_trace_waitsample_get(QueryDesc *queryDesc)
+{
+    if (queryDesc != ws_query)
+        return NULL;
+
+    return ws_samples;
+}
+
+static void
+ws_clear(void)
+{
+    if (ws_running)
+    {
+        ws_set_timer(0);
+        ws_running = false;
+    }
+
+    ws_query = NULL;
+    ws_subid = InvalidSubTransactionId;
+    ws_samples = NULL;
+    ws_original = NULL;
+    ws_node_by_id = NULL;
+    ws_current = -1;
+    ws_lockwait = -1;
+}
+
+/*
+ * Wait profile of one node of the sampled query, NULL if not sampled
+ */
+PgTraceWaitProfile *
+pg_trace_waitsample_node_profile(PlanState *planstate, int *interval_us)
+{
+    int id;
+
+    if (!ws_samples || !planstate->plan || planstate->state != ws_query->estate)
+        return NULL;
+
+    id = planstate->plan->plan_node_id;
+    if (id < 0 || ws_node_by_id[id] < 0)
+        return NULL;
+
+    *interval_us = ws_samples->interval_us;
+    return &ws_samples->profiles[ws_node_by_id[id]];
+}
+
+/*
+ * Add a finished query's LWLock waits to the session totals
+ */
+static void
+ws_add_session_lwlocks(PgTraceWaitSamples *samples)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < samples->nlwlocks; i++)
+    {
+        PgTraceLWLockStat *stat = &samples->lwlocks[i];
+
+        for (j = 0; j < session_nlwlocks; j++)
+        {
+            if (session_lwlocks[j].wait_event_info == stat->wait_event_info)
+                break;
+        }
+
+        if (j == session_nlwlocks)
+        {
+            if (session_nlwlocks >= PG_TRACE_LWLOCK_STATS)
+                continue;
+            memset(&session_lwlocks[j], 0, sizeof(PgTraceLWLockStat));
+            session_lwlocks[j].wait_event_info = stat->wait_event_info;
+            session_nlwlocks++;
+        }
+
+        session_lwlocks[j].waits += stat->waits;
+        session_lwlocks[j].samples += stat->samples;
+        session_lwlocks[j].ela_us += stat->ela_us;
+    }
+}
+
+int
+pg_trace_waitsample_session_lwlocks(PgTraceLWLockStat **stats)
+{
+    *stats = session_lwlocks;
+    return session_nlwlocks;
+}
+
+void
+pg_trace_waitsample_session_reset(void)
+{
+    session_nlwlocks = 0;
+}
+
+/*
+ * ExecutorEnd: put the original node methods back and forget the query
+ */
+void
+pg_trace_waitsample_end(QueryDesc *queryDesc)
+{
+    PgTracePlan *plan;
+    int i;
+
+    if (queryDesc != ws_query)
+        return;
+
+    ws_add_session_lwlocks(ws_samples);
+
+    plan = ws_samples->plan;
+    for (i = 0; i < plan->nnodes; i++)
+    {
+        if (ws_original[i])
+            plan->nodes[i].planstate->ExecProcNodeReal = ws_original[i];
+    }
+
+    ws_clear();
+}
+
+/*
+ * (Sub)transaction abort: the plan state is gone or about to be
+ */
+void
+pg_trace_waitsample_abort(SubTransactionId subid)
+{
+    if (!ws_query)
+        return;
+
+    if (subid == InvalidSubTransactionId || subid == ws_subid)
+        ws_clear();
+}
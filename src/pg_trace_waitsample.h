@@ -0,0 +1,106 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_waitsample.h
+ *    In-backend wait event sampler attributed to plan nodes
+ *
+ * While a traced query is inside ExecutorRun, a POSIX interval timer
+ * delivers a signal every pg_trace.wait_sample_interval_us. The handler
+ * reads MyProc->wait_event_info and counts it against the plan node that
+ * is currently executing. No privileges are needed and the cost is one
+ * short handler call per sample plus a pointer swap per ExecProcNode.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_WAITSAMPLE_H
+#define PG_TRACE_WAITSAMPLE_H
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "executor/execdesc.h"
+#include "storage/lock.h"
+#include "utils/timestamp.h"
+
+#include "pg_trace_plan.h"
+#include "pg_trace_procfs.h"
+
+#define PG_TRACE_WAIT_SLOTS     8       /* Distinct wait events per node */
+#define PG_TRACE_LOCK_WAITS     32      /* Heavyweight lock waits per query */
+#define PG_TRACE_LWLOCK_STATS   16      /* LWLock tranches per query/session */
+
+typedef struct PgTraceWaitCount
+{
+    uint32 wait_event_info;     /* 0 means on CPU */
+    uint32 samples;
+} PgTraceWaitCount;
+
+/* Samples of one plan node */
+typedef struct PgTraceWaitProfile
+{
+    uint32 total;
+    uint32 overflow;            /* Samples of events beyond PG_TRACE_WAIT_SLOTS */
+    int nwaits;
+    PgTraceWaitCount waits[PG_TRACE_WAIT_SLOTS];
+    ProcPerfStats perf;         /* Counter deltas of the intervals ending in this node */
+} PgTraceWaitProfile;
+
+/*
+ * LWLock waits of one tranche. Consecutive samples in the same tranche
+ * count as one wait; most LWLock waits are much shorter than the sampling
+ * interval, so waits is a lower bound and ela an estimate.
+ */
+typedef struct PgTraceLWLockStat
+{
+    uint32 wait_event_info;     /* PG_WAIT_LWLOCK | tranche id */
+    uint32 waits;
+    uint32 samples;
+    uint64 ela_us;              /* samples * sampling interval */
+} PgTraceLWLockStat;
+
+/*
+ * One heavyweight lock wait, seen by at least one sample. The blocker is
+ * looked up at each sample until it is known.
+ */
+typedef struct PgTraceLockWait
+{
+    LOCKTAG tag;
+    LOCKMODE mode;
+    TimestampTz start;          /* PGPROC->waitStart, or the first sample */
+    TimestampTz last_seen;      /* Last sample still waiting */
+    int plan_node_id;           /* -1 outside any node */
+    int blocker_pid;            /* 0 when not resolvable */
+    int64 blocker_cursor;       /* Blocker's traced cursor, 0 if not traced */
+    uint64 blocker_sql_id;
+} PgTraceLockWait;
+
+/*
+ * Profiles of one query: one per flattened plan node, plus a last one for
+ * samples taken while no node was executing (executor startup, projection
+ * of the top-level result, ...)
+ */
+typedef struct PgTraceWaitSamples
+{
+    PgTracePlan *plan;
+    int interval_us;
+    bool perf;                  /* perf_event counters read at each sample */
+    PgTraceWaitProfile *profiles;   /* plan->nnodes + 1 */
+    int nlockwaits;
+    uint32 lockwaits_lost;      /* Waits beyond PG_TRACE_LOCK_WAITS */
+    PgTraceLockWait lockwaits[PG_TRACE_LOCK_WAITS];
+    int nlwlocks;
+    PgTraceLWLockStat lwlocks[PG_TRACE_LWLOCK_STATS];
+} PgTraceWaitSamples;
+
+extern bool pg_trace_waitsample_begin(QueryDesc *queryDesc, PgTracePlan *plan,
+                                      int interval_us, bool perf_counters);
+extern void pg_trace_waitsample_run(QueryDesc *queryDesc, bool running);
+extern PgTraceWaitSamples *pg_trace_waitsample_get(QueryDesc *queryDesc);
+extern void pg_trace_waitsample_end(QueryDesc *queryDesc);
+extern void pg_trace_waitsample_abort(SubTransactionId subid);
+
+extern PgTraceWaitProfile *pg_trace_waitsample_node_profile(PlanState *planstate,
+                                                           int *interval_us);
+extern int pg_trace_waitsample_session_lwlocks(PgTraceLWLockStat **stats);
+extern void pg_trace_waitsample_session_reset(void);
+
+#endif /* PG_TRACE_WAITSAMPLE_H */
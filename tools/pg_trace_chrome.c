@@ -0,0 +1,425 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_chrome.c
+ *    Convert pg_trace files to Chrome trace event JSON
+ *
+ * The output opens in ui.perfetto.dev and chrome://tracing with every
+ * traced backend on one time axis. Each trace file becomes a process
+ * (named after the backend pid) with three tracks:
+ *
+ *   calls  - one slice per cursor, PARSE, BIND and EXEC/FETCH inside it
+ *   plan   - STAT slice per cursor with the plan nodes nested inside,
+ *            laid out from Instrumentation totals
+ *   waits  - eBPF waits (tim= stamped) as slices; block reads, lock
+ *            waits and sampled waits, which carry no time of their own,
+ *            as instant events at the end of the execution
+ *
+ * Instrumentation only has totals per node, not when each node ran, so
+ * children are placed one after another from the start of their parent
+ * and cut at its end: the widths are right, the positions inside a
+ * parent are not.
+ *
+ * Usage:
+ *    pg_trace_chrome [-j threads] [-o output.json] file...
+ *
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pg_trace_parse.h"
+
+#define CHUNK_SIZE          (64 * 1024 * 1024)
+#define MAX_SQL_ARG         1024
+
+/* Tracks (thread ids) inside each backend's process */
+#define TRACK_CALLS         1
+#define TRACK_PLAN          2
+#define TRACK_WAITS         3
+
+typedef struct Output
+{
+    char *buf;
+    size_t len;
+    FILE *out;
+} Output;
+
+static const char *progname = "pg_trace_chrome";
+static PtFile *files;
+static Output *outputs;
+
+/*---- JSON ----*/
+
+static void
+json_string(FILE *out, const char *s, size_t len)
+{
+    size_t i;
+
+    fputc('"', out);
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char) s[i];
+
+        switch (c)
+        {
+            case '"':
+                fputs("\\\"", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\t':
+                fputs("\\t", out);
+                break;
+            default:
+                if (c < 0x20)
+                    fprintf(out, "\\u%04x", c);
+                else
+                    fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Start of an event; every event after the first metadata one */
+static void
+event_begin(FILE *out, const char *ph, int pid, int tid, double ts)
+{
+    fprintf(out, ",\n{\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", ph, pid, tid, ts);
+}
+
+static void
+slice(FILE *out, int pid, int tid, double ts, double dur, const char *name,
+      int name_len)
+{
+    event_begin(out, "X", pid, tid, ts);
+    fprintf(out, ",\"dur\":%.3f,\"name\":", dur > 0 ? dur : 0);
+    json_string(out, name, name_len);
+}
+
+static void
+instant(FILE *out, int pid, int tid, double ts, const char *name, int name_len)
+{
+    event_begin(out, "i", pid, tid, ts);
+    fputs(",\"s\":\"t\",\"name\":", out);
+    json_string(out, name, name_len);
+}
+
+static void
+metadata(FILE *out, bool first, const char *what, int pid, int tid,
+         const char *name)
+{
+    fprintf(out, "%s{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"%s\",\"args\":{\"name\":",
+            first ? "" : ",\n", pid, tid, what);
+    json_string(out, name, strlen(name));
+    fputs("}}", out);
+}
+
+/*---- Conversion ----*/
+
+/*
+ * Plan node i and its subtree from start, cut at limit. Returns the index
+ * after the subtree and the end of node i in *node_end.
+ */
+static int
+write_node(FILE *out, int pid, const PtCursor *cursor, int i,
+           double start, double limit, double *node_end)
+{
+    const PtNode *node = &cursor->nodes[i];
+    double end = start + node->total_ms * 1000.0;
+    double child_start = start;
+    char name[256];
+    int len;
+    int j;
+
+    if (end > limit)
+        end = limit;
+    *node_end = end;
+
+    if (node->object)
+        len = snprintf(name, sizeof(name), "%.*s %.*s", node->name_len, node->name,
+                       node->object_len, node->object);
+    else
+        len = snprintf(name, sizeof(name), "%.*s", node->name_len, node->name);
+    if (len >= (int) sizeof(name))
+        len = sizeof(name) - 1;
+
+    if (end > start)
+    {
+        slice(out, pid, TRACK_PLAN, start, end - start, name, len);
+        fprintf(out, ",\"args\":{\"node_id\":%d,\"rows\":%.0f,\"loops\":%.0f,"
+                "\"startup_ms\":%.3f,\"total_ms\":%.3f}}",
+                node->id, node->rows, node->loops, node->startup_ms, node->total_ms);
+    }
+
+    for (j = i + 1; j < cursor->nnodes && cursor->nodes[j].depth > node->depth;)
+    {
+        double child_end;
+
+        j = write_node(out, pid, cursor, j, child_start, end, &child_end);
+        child_start = child_end;
+    }
+    return j;
+}
+
+static void
+write_waits(FILE *out, int pid, const PtCursor *cursor, double exec_end)
+{
+    int i;
+
+    for (i = 0; i < cursor->nwaits; i++)
+    {
+        const PtWait *wait = &cursor->waits[i];
+
+        if (wait->sampled)
+        {
+            instant(out, pid, TRACK_WAITS, exec_end, wait->name, wait->name_len);
+            fprintf(out, ",\"args\":{\"cursor\":%lld,\"samples\":%lld,\"ela_ms\":%.3f,\"node_id\":%d}}",
+                    cursor->cursor_id, wait->count, wait->ela_us / 1000.0, wait->node_id);
+        }
+        else if (wait->tim > 0 && wait->count == 1)
+        {
+            /* eBPF: tim= is the end of the wait */
+            slice(out, pid, TRACK_WAITS, (double) wait->tim - wait->ela_us,
+                  wait->ela_us, wait->name, wait->name_len);
+            fprintf(out, ",\"args\":{\"cursor\":%lld}}", cursor->cursor_id);
+        }
+        else
+        {
+            instant(out, pid, TRACK_WAITS, wait->tim > 0 ? (double) wait->tim : exec_end,
+                    wait->name, wait->name_len);
+            fprintf(out, ",\"args\":{\"cursor\":%lld,\"waits\":%lld,\"ela_us\":%.0f,\"max_us\":%.0f}}",
+                    cursor->cursor_id, wait->count, wait->ela_us, wait->max_us);
+        }
+    }
+}
+
+static void
+convert_cursor(const PtCursor *cursor, void *arg)
+{
+    FILE *out = ((Output *) arg)->out;
+    int pid = files[cursor->file_index].pid;
+    double start = (double) cursor->parse_tim;
+    double parse_end = start + cursor->parse_ela_sec * 1e6;
+    double end = parse_end;
+    double exec_end = parse_end;
+    char name[64];
+    int len;
+    int i;
+
+    if (cursor->parse_tim == 0)
+        return;
+
+    for (i = 0; i < cursor->nexecs; i++)
+    {
+        double run_end = cursor->execs[i].tim + cursor->execs[i].ela_sec * 1e6;
+
+        if (run_end > exec_end)
+            exec_end = run_end;
+    }
+    end = exec_end;
+    if (cursor->have_stats && cursor->end_tim > end)
+        end = (double) cursor->end_tim;
+
+    /* Cursor, with the phases nested inside */
+    len = snprintf(name, sizeof(name), "#%lld sql_id=%lld", cursor->cursor_id, cursor->sql_id);
+    slice(out, pid, TRACK_CALLS, start, end - start, name, len);
+    fprintf(out, ",\"args\":{\"cursor\":%lld,\"sql_id\":%lld,\"plan_id\":%lld,"
+            "\"elapsed_sec\":%.6f,\"cpu_sec\":%.6f,\"offcpu_sec\":%.6f,\"cr\":%lld,\"pr\":%lld",
+            cursor->cursor_id, cursor->sql_id, cursor->plan_id, cursor->elapsed_sec,
+            cursor->cpu_sec, cursor->offcpu_sec, cursor->cr, cursor->pr);
+    if (cursor->sql_text)
+    {
+        fputs(",\"sql\":", out);
+        json_string(out, cursor->sql_text,
+                    cursor->sql_len > MAX_SQL_ARG ? MAX_SQL_ARG : cursor->sql_len);
+    }
+    fputs("}}", out);
+
+    slice(out, pid, TRACK_CALLS, start, parse_end - start, "PARSE", 5);
+    fprintf(out, ",\"args\":{\"cpu_sec\":%.6f,\"cr\":%lld}}",
+            cursor->parse_cpu_sec, cursor->parse_cr);
+
+    /* BIND TIME is ExecutorStart, which ends where the first run begins */
+    if (cursor->nexecs > 0 && cursor->bind_ela_sec > 0)
+    {
+        double bind_end = (double) cursor->execs[0].tim;
+        double bind_start = bind_end - cursor->bind_ela_sec * 1e6;
+
+        if (bind_start < parse_end)
+            bind_start = parse_end;
+        slice(out, pid, TRACK_CALLS, bind_start, bind_end - bind_start, "BIND", 4);
+        fprintf(out, ",\"args\":{\"cpu_sec\":%.6f}}", cursor->bind_cpu_sec);
+    }
+
+    /* The first ExecutorRun executes, later ones fetch from the portal */
+    for (i = 0; i < cursor->nexecs; i++)
+    {
+        const PtExec *exec = &cursor->execs[i];
+
+        slice(out, pid, TRACK_CALLS, (double) exec->tim, exec->ela_sec * 1e6,
+              i == 0 ? "EXEC" : "FETCH", i == 0 ? 4 : 5);
+        fprintf(out, ",\"args\":{\"cpu_sec\":%.6f,\"rows\":%lld}}", exec->cpu_sec, exec->rows);
+    }
+
+    /* Plan nodes from the start of the first run */
+    if (cursor->nnodes > 0 && cursor->nexecs > 0)
+    {
+        double plan_start = (double) cursor->execs[0].tim;
+        double node_end;
+
+        len = snprintf(name, sizeof(name), "STAT #%lld", cursor->cursor_id);
+        slice(out, pid, TRACK_PLAN, plan_start, end - plan_start, name, len);
+        fprintf(out, ",\"args\":{\"plan_id\":%lld}}", cursor->plan_id);
+
+        for (i = 0; i < cursor->nnodes;)
+            i = write_node(out, pid, cursor, i, plan_start, end, &node_end);
+    }
+
+    write_waits(out, pid, cursor, exec_end);
+}
+
+static void *
+make_output(int thread)
+{
+    Output *output = &outputs[thread];
+
+    output->out = open_memstream(&output->buf, &output->len);
+    if (!output->out)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        exit(1);
+    }
+    return output;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-j threads] [-o output.json] <trace_file>...\n"
+            "\n"
+            "Open the result in https://ui.perfetto.dev or chrome://tracing.\n",
+            progname);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int nfiles;
+    PtChunk *chunks;
+    int nchunks;
+    FILE *out;
+    char name[1024];
+    int c;
+
+    while ((c = getopt(argc, argv, "j:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    nfiles = argc - optind;
+    if (nfiles < 1)
+        usage();
+    if (nthreads < 1)
+        nthreads = 1;
+
+    files = calloc(nfiles, sizeof(PtFile));
+    if (!files)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    for (c = 0; c < nfiles; c++)
+    {
+        if (pt_file_open(&files[c], argv[optind + c]) != 0)
+        {
+            fprintf(stderr, "%s: could not open \"%s\": %s\n",
+                    progname, argv[optind + c], strerror(errno));
+            return 1;
+        }
+        /* Files of unknown backends still get a track of their own */
+        if (files[c].pid == 0)
+            files[c].pid = -(c + 1);
+    }
+
+    nchunks = pt_split(files, nfiles, CHUNK_SIZE, &chunks);
+    if (nchunks < 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    if (nthreads > nchunks)
+        nthreads = nchunks > 0 ? nchunks : 1;
+
+    outputs = calloc(nthreads, sizeof(Output));
+    if (!outputs)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    pt_parse_threads(chunks, nchunks, (int) nthreads, make_output, convert_cursor);
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (!out)
+        {
+            fprintf(stderr, "%s: could not create \"%s\": %s\n", progname, output, strerror(errno));
+            return 1;
+        }
+    }
+    else
+        out = stdout;
+
+    /* Track names first; events are unordered, the viewers sort them */
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    for (c = 0; c < nfiles; c++)
+    {
+        int pid = files[c].pid;
+
+        snprintf(name, sizeof(name), "backend %d (%s)", pid, files[c].path);
+        metadata(out, c == 0, "process_name", pid, 0, name);
+        metadata(out, false, "thread_name", pid, TRACK_CALLS, "calls");
+        metadata(out, false, "thread_name", pid, TRACK_PLAN, "plan");
+        metadata(out, false, "thread_name", pid, TRACK_WAITS, "waits");
+    }
+    for (c = 0; c < nthreads; c++)
+    {
+        fclose(outputs[c].out);
+        fwrite(outputs[c].buf, 1, outputs[c].len, out);
+        free(outputs[c].buf);
+    }
+    fputs("\n]}\n", out);
+
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: could not write output: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    for (c = 0; c < nfiles; c++)
+        pt_file_close(&files[c]);
+
+    return 0;
+}
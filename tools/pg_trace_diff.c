@@ -0,0 +1,852 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_diff.c
+ *    Compare two sets of pg_trace files of the same workload
+ *
+ * Statements are matched by a fingerprint of their text (literals and
+ * whitespace normalized), falling back to sql_id when no text was
+ * traced: sql_id is the core query id when compute_query_id is on, and
+ * that changes across major versions and with relation OIDs (dump and
+ * restore), which is what a before/after comparison often spans. Within
+ * a side, plans are told apart by PLAN_ID; across sides they are compared
+ * by a fingerprint of node types and relation and index names. For
+ * each statement the per-execution elapsed time, rows, buffers (cr, pr),
+ * I/O read time and wait time of "before" and "after" are compared, plan
+ * changes are flagged and the plan nodes (time, rows, shared buffers and
+ * I/O time) are compared node by node when the plan is the same, or
+ * listed side by side when it is not. Statements are ranked by impact:
+ * the change in time per execution times the executions after, i.e. the
+ * time the change costs (or saves) the "after" workload.
+ *
+ * The comparison works on PtCursor records, not on lines, so another
+ * trace format only needs a reader producing them.
+ *
+ * Usage:
+ *    pg_trace_diff [-n top] [-j threads] [-o output] -b before.trc... -a after.trc...
+ *
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pg_trace_parse.h"
+
+#define CHUNK_SIZE          (64 * 1024 * 1024)
+#define DEFAULT_TOP         20
+#define SQL_PREVIEW         120
+
+#define BEFORE              0
+#define AFTER               1
+
+typedef struct NodeAgg
+{
+    int depth;
+    const char *name;
+    int name_len;
+    const char *object;
+    int object_len;
+    double total_ms;            /* All executions */
+    double rows;                /* rows * loops, all executions */
+    long long shared_hit;       /* All executions */
+    long long shared_read;
+    double io_ms;
+} NodeAgg;
+
+/* One plan of one statement on one side */
+typedef struct PlanAgg
+{
+    bool used;
+    int side;
+    long long sql_id;
+    long long plan_id;
+    const char *sql_text;
+    size_t sql_len;
+
+    long long calls;
+    double elapsed_sec;
+    long long rows;
+    long long cr;
+    long long pr;
+    double io_ms;
+    double wait_us;
+
+    long long node_calls;       /* Executions with a STAT section */
+    int nnodes;                 /* -1 when executions disagree on the shape */
+    NodeAgg *nodes;
+    unsigned long long shape;   /* Fingerprint of nodes, 0 if none */
+
+    unsigned long long stmt_key;    /* Text fingerprint, else sql_id */
+} PlanAgg;
+
+typedef struct PlanTable
+{
+    PlanAgg *entries;
+    size_t capacity;
+    size_t count;
+} PlanTable;
+
+/* Both sides of one statement, for the report */
+typedef struct SideSummary
+{
+    long long sql_id;
+    long long calls;
+    double elapsed_sec;
+    long long rows;
+    long long cr;
+    long long pr;
+    double io_ms;
+    double wait_us;
+    const PlanAgg *main_plan;   /* The plan with most elapsed time */
+    int nplans;
+} SideSummary;
+
+typedef struct StmtDiff
+{
+    const char *sql_text;
+    size_t sql_len;
+    SideSummary side[2];
+    double impact_sec;
+} StmtDiff;
+
+static const char *progname = "pg_trace_diff";
+static PlanTable *tables;
+static int nbefore;
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+
+    if (!p)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        exit(1);
+    }
+    return p;
+}
+
+/*---- Fingerprints ----*/
+
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+static unsigned long long
+fnv_add(unsigned long long h, const char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char) data[i]) * FNV_PRIME;
+    return h;
+}
+
+static bool
+is_ident_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || (c & 0x80);
+}
+
+/*
+ * Fingerprint of a statement text: string and numeric literals and bind
+ * markers hash as '?', whitespace runs as one space, trailing blanks and
+ * semicolons not at all. Never 0.
+ */
+static unsigned long long
+text_fingerprint(const char *text, size_t len)
+{
+    unsigned long long h = FNV_OFFSET;
+    bool space = false;
+    size_t i = 0;
+
+    while (len > 0 && (text[len - 1] == ';' || text[len - 1] == ' ' ||
+                       text[len - 1] == '\n' || text[len - 1] == '\t' ||
+                       text[len - 1] == '\r'))
+        len--;
+    while (i < len && (text[i] == ' ' || text[i] == '\n' || text[i] == '\t' || text[i] == '\r'))
+        i++;
+
+    while (i < len)
+    {
+        char c = text[i];
+        bool prev_ident = i > 0 && is_ident_char(text[i - 1]);
+
+        if (c == ' ' || c == '\n' || c == '\t' || c == '\r')
+        {
+            space = true;
+            i++;
+            continue;
+        }
+        if (space)
+        {
+            h = fnv_add(h, " ", 1);
+            space = false;
+        }
+
+        if (c == '\'')
+        {
+            /* 'it''s' is one literal */
+            for (i++; i < len; i++)
+            {
+                if (text[i] == '\'')
+                {
+                    if (i + 1 < len && text[i + 1] == '\'')
+                        i++;
+                    else
+                        break;
+                }
+            }
+            i++;
+            h = fnv_add(h, "?", 1);
+        }
+        else if ((c >= '0' && c <= '9' && !prev_ident) ||
+                 (c == '$' && i + 1 < len && text[i + 1] >= '0' && text[i + 1] <= '9'))
+        {
+            for (i++; i < len && ((text[i] >= '0' && text[i] <= '9') || text[i] == '.'); i++)
+                ;
+            h = fnv_add(h, "?", 1);
+        }
+        else
+        {
+            h = fnv_add(h, &c, 1);
+            i++;
+        }
+    }
+
+    return h ? h : 1;
+}
+
+/* Node types and relation/index names in tree order, no OIDs */
+static unsigned long long
+shape_fingerprint(const NodeAgg *nodes, int nnodes)
+{
+    unsigned long long h = FNV_OFFSET;
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+    {
+        char depth = (char) nodes[i].depth;
+
+        h = fnv_add(h, &depth, 1);
+        h = fnv_add(h, nodes[i].name, nodes[i].name_len);
+        h = fnv_add(h, "/", 1);
+        if (nodes[i].object)
+            h = fnv_add(h, nodes[i].object, nodes[i].object_len);
+        h = fnv_add(h, ";", 1);
+    }
+
+    return h ? h : 1;
+}
+
+/*---- Aggregation ----*/
+
+static size_t
+plan_hash(int side, long long sql_id, long long plan_id)
+{
+    unsigned long long h = (unsigned long long) sql_id * 0x9E3779B97F4A7C15ULL;
+
+    h ^= (unsigned long long) plan_id + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+    h ^= (unsigned long long) side * 0xC2B2AE3D27D4EB4FULL;
+    return (size_t) (h ^ (h >> 29));
+}
+
+static PlanAgg *
+table_lookup(PlanTable *table, int side, long long sql_id, long long plan_id)
+{
+    size_t i;
+
+    if ((table->count + 1) * 10 > table->capacity * 7)
+    {
+        PlanAgg *old = table->entries;
+        size_t oldcap = table->capacity;
+
+        table->capacity = oldcap ? oldcap * 2 : 1024;
+        table->entries = xcalloc(table->capacity, sizeof(PlanAgg));
+        table->count = 0;
+        for (i = 0; i < oldcap; i++)
+        {
+            if (old[i].used)
+                *table_lookup(table, old[i].side, old[i].sql_id, old[i].plan_id) = old[i];
+        }
+        free(old);
+    }
+
+    i = plan_hash(side, sql_id, plan_id) & (table->capacity - 1);
+    for (;;)
+    {
+        PlanAgg *entry = &table->entries[i];
+
+        if (!entry->used)
+        {
+            entry->used = true;
+            entry->side = side;
+            entry->sql_id = sql_id;
+            entry->plan_id = plan_id;
+            table->count++;
+            return entry;
+        }
+        if (entry->side == side && entry->sql_id == sql_id && entry->plan_id == plan_id)
+            return entry;
+        i = (i + 1) & (table->capacity - 1);
+    }
+}
+
+/* Add the nodes of one execution, or of a merged plan (calls > 1) */
+static void
+add_nodes(PlanAgg *plan, const NodeAgg *nodes, int nnodes, long long calls)
+{
+    int i;
+
+    if (nnodes == 0 || plan->nnodes < 0)
+        return;
+
+    if (plan->node_calls == 0)
+    {
+        plan->nodes = xcalloc(nnodes, sizeof(NodeAgg));
+        memcpy(plan->nodes, nodes, nnodes * sizeof(NodeAgg));
+        plan->nnodes = nnodes;
+        plan->node_calls = calls;
+        plan->shape = shape_fingerprint(nodes, nnodes);
+        return;
+    }
+
+    if (plan->nnodes != nnodes)
+    {
+        /* Same plan_id, different tree: do not compare nodes */
+        plan->nnodes = -1;
+        plan->shape = 0;
+        return;
+    }
+
+    for (i = 0; i < nnodes; i++)
+    {
+        plan->nodes[i].total_ms += nodes[i].total_ms;
+        plan->nodes[i].rows += nodes[i].rows;
+        plan->nodes[i].shared_hit += nodes[i].shared_hit;
+        plan->nodes[i].shared_read += nodes[i].shared_read;
+        plan->nodes[i].io_ms += nodes[i].io_ms;
+    }
+    plan->node_calls += calls;
+}
+
+static void
+aggregate_cursor(const PtCursor *cursor, void *arg)
+{
+    PlanTable *table = arg;
+    int side = cursor->file_index < nbefore ? BEFORE : AFTER;
+    PlanAgg *plan = table_lookup(table, side, cursor->sql_id, cursor->plan_id);
+    double exec_ela = 0;
+    int i;
+
+    if (!plan->sql_text && cursor->sql_text)
+    {
+        plan->sql_text = cursor->sql_text;
+        plan->sql_len = cursor->sql_len;
+    }
+
+    plan->calls++;
+    for (i = 0; i < cursor->nexecs; i++)
+    {
+        plan->rows += cursor->execs[i].rows;
+        exec_ela += cursor->execs[i].ela_sec;
+    }
+    plan->elapsed_sec += cursor->parse_ela_sec +
+        (cursor->have_stats ? cursor->elapsed_sec : exec_ela);
+    plan->cr += cursor->cr;
+    plan->pr += cursor->pr;
+    plan->io_ms += cursor->io_ms;
+
+    for (i = 0; i < cursor->nwaits; i++)
+    {
+        if (!cursor->waits[i].sampled)
+            plan->wait_us += cursor->waits[i].ela_us;
+    }
+
+    if (cursor->nnodes > 0)
+    {
+        /* Per-thread scratch: one allocation, not one per execution */
+        static __thread NodeAgg *nodes;
+        static __thread int node_cap;
+
+        if (cursor->nnodes > node_cap)
+        {
+            free(nodes);
+            node_cap = cursor->nnodes * 2;
+            nodes = xcalloc(node_cap, sizeof(NodeAgg));
+        }
+
+        for (i = 0; i < cursor->nnodes; i++)
+        {
+            const PtNode *node = &cursor->nodes[i];
+
+            nodes[i].depth = node->depth;
+            nodes[i].name = node->name;
+            nodes[i].name_len = node->name_len;
+            nodes[i].object = node->object;
+            nodes[i].object_len = node->object_len;
+            nodes[i].total_ms = node->total_ms;
+            nodes[i].rows = node->rows * node->loops;
+            nodes[i].shared_hit = node->shared_hit;
+            nodes[i].shared_read = node->shared_read;
+            nodes[i].io_ms = node->io_ms;
+        }
+        add_nodes(plan, nodes, cursor->nnodes, 1);
+    }
+}
+
+static void *
+make_table(int thread)
+{
+    return &tables[thread];
+}
+
+static void
+merge_plan(PlanTable *into, const PlanAgg *from)
+{
+    PlanAgg *plan = table_lookup(into, from->side, from->sql_id, from->plan_id);
+
+    if (!plan->sql_text && from->sql_text)
+    {
+        plan->sql_text = from->sql_text;
+        plan->sql_len = from->sql_len;
+    }
+    plan->calls += from->calls;
+    plan->elapsed_sec += from->elapsed_sec;
+    plan->rows += from->rows;
+    plan->cr += from->cr;
+    plan->pr += from->pr;
+    plan->io_ms += from->io_ms;
+    plan->wait_us += from->wait_us;
+
+    if (from->nnodes < 0)
+    {
+        plan->nnodes = -1;
+        plan->shape = 0;
+    }
+    else
+        add_nodes(plan, from->nodes, from->nnodes, from->node_calls);
+}
+
+/*---- Report ----*/
+
+static int
+compare_side_sql_id(const void *a, const void *b)
+{
+    const PlanAgg *pa = *(PlanAgg * const *) a;
+    const PlanAgg *pb = *(PlanAgg * const *) b;
+
+    if (pa->side != pb->side)
+        return pa->side - pb->side;
+    return (pa->sql_id > pb->sql_id) - (pa->sql_id < pb->sql_id);
+}
+
+static int
+compare_plans(const void *a, const void *b)
+{
+    const PlanAgg *pa = *(PlanAgg * const *) a;
+    const PlanAgg *pb = *(PlanAgg * const *) b;
+
+    return (pa->stmt_key > pb->stmt_key) - (pa->stmt_key < pb->stmt_key);
+}
+
+/*
+ * Statement key of every plan: the text fingerprint of its (side, sql_id),
+ * as the text is written once per file and only some plans carry it
+ */
+static void
+set_stmt_keys(PlanAgg **plans, size_t nplans)
+{
+    size_t i;
+    size_t j;
+    size_t k;
+
+    qsort(plans, nplans, sizeof(PlanAgg *), compare_side_sql_id);
+
+    for (i = 0; i < nplans; i = j)
+    {
+        unsigned long long key = (unsigned long long) plans[i]->sql_id;
+        bool have_text = false;
+
+        for (j = i; j < nplans && plans[j]->side == plans[i]->side &&
+             plans[j]->sql_id == plans[i]->sql_id; j++)
+        {
+            if (!have_text && plans[j]->sql_text)
+            {
+                key = text_fingerprint(plans[j]->sql_text, plans[j]->sql_len);
+                have_text = true;
+            }
+        }
+        for (k = i; k < j; k++)
+            plans[k]->stmt_key = key;
+    }
+}
+
+/* Different plans? By node shape and names when both were traced with STAT */
+static bool
+plan_changed(const PlanAgg *before, const PlanAgg *after)
+{
+    if (before->shape != 0 && after->shape != 0)
+        return before->shape != after->shape;
+    return before->plan_id != after->plan_id;
+}
+
+static int
+compare_impact(const void *a, const void *b)
+{
+    double ia = fabs(((const StmtDiff *) a)->impact_sec);
+    double ib = fabs(((const StmtDiff *) b)->impact_sec);
+
+    return (ia < ib) - (ia > ib);
+}
+
+static double
+per_call(double total, long long calls)
+{
+    return calls > 0 ? total / calls : 0;
+}
+
+static void
+write_change(FILE *out, const char *label, const char *unit, double before, double after,
+             bool have_before, bool have_after)
+{
+    fprintf(out, "  %-14s", label);
+    if (have_before)
+        fprintf(out, " %14.3f", before);
+    else
+        fprintf(out, " %14s", "-");
+    if (have_after)
+        fprintf(out, " %14.3f", after);
+    else
+        fprintf(out, " %14s", "-");
+    if (have_before && have_after && before > 0)
+        fprintf(out, " %+9.1f%%", (after - before) / before * 100.0);
+    else if (have_before && have_after && after > 0)
+        fprintf(out, " %10s", "new");
+    fprintf(out, "  %s\n", unit);
+}
+
+static void
+write_node_name(FILE *out, const NodeAgg *node)
+{
+    fprintf(out, "%*s-> %.*s", node->depth * 2, "", node->name_len, node->name);
+    if (node->object)
+        fprintf(out, " %.*s", node->object_len, node->object);
+}
+
+static void
+write_plan(FILE *out, const char *label, const PlanAgg *plan)
+{
+    int i;
+
+    fprintf(out, "  %s plan %lld:\n", label, plan->plan_id);
+    for (i = 0; i < plan->nnodes; i++)
+    {
+        const NodeAgg *node = &plan->nodes[i];
+
+        fprintf(out, "    ");
+        write_node_name(out, node);
+        fprintf(out, "  (%.3f ms, %.0f rows, hit=%.0f read=%.0f, io %.3f ms per execution)\n",
+                per_call(node->total_ms, plan->node_calls),
+                per_call(node->rows, plan->node_calls),
+                per_call(node->shared_hit, plan->node_calls),
+                per_call(node->shared_read, plan->node_calls),
+                per_call(node->io_ms, plan->node_calls));
+    }
+}
+
+static void
+write_nodes(FILE *out, const PlanAgg *before, const PlanAgg *after)
+{
+    int i;
+
+    if (before->nnodes <= 0 || after->nnodes <= 0)
+        return;
+
+    if (plan_changed(before, after) || before->nnodes != after->nnodes)
+    {
+        write_plan(out, "before", before);
+        write_plan(out, "after", after);
+        return;
+    }
+
+    fprintf(out, "  Nodes (per execution, before -> after):\n");
+    for (i = 0; i < before->nnodes; i++)
+    {
+        const NodeAgg *b = &before->nodes[i];
+        const NodeAgg *a = &after->nodes[i];
+        double b_ms = per_call(b->total_ms, before->node_calls);
+        double a_ms = per_call(a->total_ms, after->node_calls);
+
+        fprintf(out, "    ");
+        write_node_name(out, b);
+        fprintf(out, "  %.3f -> %.3f ms", b_ms, a_ms);
+        if (b_ms > 0)
+            fprintf(out, " (%+.1f%%)", (a_ms - b_ms) / b_ms * 100.0);
+        fprintf(out, ", rows %.0f -> %.0f",
+                per_call(b->rows, before->node_calls), per_call(a->rows, after->node_calls));
+        fprintf(out, ", hit %.0f -> %.0f, read %.0f -> %.0f",
+                per_call(b->shared_hit, before->node_calls), per_call(a->shared_hit, after->node_calls),
+                per_call(b->shared_read, before->node_calls), per_call(a->shared_read, after->node_calls));
+        fprintf(out, ", io %.3f -> %.3f ms\n",
+                per_call(b->io_ms, before->node_calls), per_call(a->io_ms, after->node_calls));
+    }
+}
+
+static void
+write_stmt(FILE *out, const StmtDiff *diff)
+{
+    const SideSummary *b = &diff->side[BEFORE];
+    const SideSummary *a = &diff->side[AFTER];
+    bool have_b = b->calls > 0;
+    bool have_a = a->calls > 0;
+    size_t i;
+
+    fprintf(out, "********************************************************************************\n");
+    if (have_b && have_a && b->sql_id != a->sql_id)
+        fprintf(out, "SQL_ID: %lld -> %lld", b->sql_id, a->sql_id);
+    else
+        fprintf(out, "SQL_ID: %lld", have_b ? b->sql_id : a->sql_id);
+    fprintf(out, "  impact: %+.6f sec%s\n", diff->impact_sec,
+            !have_b ? "  (new)" : !have_a ? "  (gone)" : "");
+    if (diff->sql_text)
+    {
+        /* First line or so of the text */
+        fputs("  ", out);
+        for (i = 0; i < diff->sql_len && i < SQL_PREVIEW; i++)
+            fputc(diff->sql_text[i] == '\n' ? ' ' : diff->sql_text[i], out);
+        fputs(diff->sql_len > SQL_PREVIEW ? " ...\n" : "\n", out);
+    }
+    fprintf(out, "\n  %-14s %14s %14s %10s\n", "", "before", "after", "change");
+    fprintf(out, "  %-14s %14lld %14lld\n", "executions", b->calls, a->calls);
+    write_change(out, "elapsed", "ms/exec", per_call(b->elapsed_sec * 1000, b->calls),
+                 per_call(a->elapsed_sec * 1000, a->calls), have_b, have_a);
+    write_change(out, "rows", "/exec", per_call(b->rows, b->calls),
+                 per_call(a->rows, a->calls), have_b, have_a);
+    write_change(out, "cr", "blocks/exec", per_call(b->cr, b->calls),
+                 per_call(a->cr, a->calls), have_b, have_a);
+    write_change(out, "pr", "blocks/exec", per_call(b->pr, b->calls),
+                 per_call(a->pr, a->calls), have_b, have_a);
+    write_change(out, "io", "ms/exec", per_call(b->io_ms, b->calls),
+                 per_call(a->io_ms, a->calls), have_b, have_a);
+    write_change(out, "wait", "ms/exec", per_call(b->wait_us / 1000, b->calls),
+                 per_call(a->wait_us / 1000, a->calls), have_b, have_a);
+
+    if (have_b && have_a)
+    {
+        bool changed = plan_changed(b->main_plan, a->main_plan);
+
+        fprintf(out, "  %-14s %14lld %14lld %10s\n", "plan_id",
+                b->main_plan->plan_id, a->main_plan->plan_id, changed ? "CHANGED" : "");
+        if (b->nplans > 1 || a->nplans > 1)
+            fprintf(out, "  %-14s %14d %14d\n", "plans", b->nplans, a->nplans);
+        write_nodes(out, b->main_plan, a->main_plan);
+    }
+    fprintf(out, "\n");
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [options] -b before.trc [-b ...] -a after.trc [-a ...]\n"
+            "\n"
+            "  -n top      statements to report (default %d, 0 for all)\n"
+            "  -j threads  parser threads (default: online CPUs)\n"
+            "  -o output   write here instead of stdout\n",
+            progname, DEFAULT_TOP);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    long top = DEFAULT_TOP;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char **paths[2];
+    int npaths[2] = {0, 0};
+    PtFile *files;
+    int nfiles;
+    PtChunk *chunks;
+    int nchunks;
+    PlanTable *result;
+    PlanAgg **plans;
+    size_t nplans = 0;
+    StmtDiff *diffs;
+    size_t ndiffs = 0;
+    FILE *out;
+    size_t i;
+    size_t j;
+    int c;
+
+    paths[BEFORE] = xcalloc(argc, sizeof(char *));
+    paths[AFTER] = xcalloc(argc, sizeof(char *));
+
+    while ((c = getopt(argc, argv, "b:a:n:j:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                paths[BEFORE][npaths[BEFORE]++] = optarg;
+                break;
+            case 'a':
+                paths[AFTER][npaths[AFTER]++] = optarg;
+                break;
+            case 'n':
+                top = strtol(optarg, NULL, 10);
+                if (top < 0)
+                    usage();
+                break;
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind != argc || npaths[BEFORE] == 0 || npaths[AFTER] == 0)
+        usage();
+    if (nthreads < 1)
+        nthreads = 1;
+
+    /* Before files first: a cursor's side is its file index < nbefore */
+    nbefore = npaths[BEFORE];
+    nfiles = npaths[BEFORE] + npaths[AFTER];
+    files = xcalloc(nfiles, sizeof(PtFile));
+    for (c = 0; c < nfiles; c++)
+    {
+        const char *path = c < nbefore ? paths[BEFORE][c] : paths[AFTER][c - nbefore];
+
+        if (pt_file_open(&files[c], path) != 0)
+        {
+            fprintf(stderr, "%s: could not open \"%s\": %s\n", progname, path, strerror(errno));
+            return 1;
+        }
+    }
+
+    nchunks = pt_split(files, nfiles, CHUNK_SIZE, &chunks);
+    if (nchunks < 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    if (nthreads > nchunks)
+        nthreads = nchunks > 0 ? nchunks : 1;
+
+    tables = xcalloc(nthreads, sizeof(PlanTable));
+    pt_parse_threads(chunks, nchunks, (int) nthreads, make_table, aggregate_cursor);
+
+    result = &tables[0];
+    for (c = 1; c < nthreads; c++)
+    {
+        for (i = 0; i < tables[c].capacity; i++)
+        {
+            if (tables[c].entries[i].used)
+                merge_plan(result, &tables[c].entries[i]);
+        }
+    }
+
+    /* Group the plans of each statement */
+    plans = xcalloc(result->count + 1, sizeof(PlanAgg *));
+    for (i = 0; i < result->capacity; i++)
+    {
+        if (result->entries[i].used)
+            plans[nplans++] = &result->entries[i];
+    }
+    set_stmt_keys(plans, nplans);
+    qsort(plans, nplans, sizeof(PlanAgg *), compare_plans);
+
+    diffs = xcalloc(nplans + 1, sizeof(StmtDiff));
+    for (i = 0; i < nplans; i = j)
+    {
+        StmtDiff *diff = &diffs[ndiffs++];
+        const SideSummary *b;
+        const SideSummary *a;
+
+        for (j = i; j < nplans && plans[j]->stmt_key == plans[i]->stmt_key; j++)
+        {
+            const PlanAgg *plan = plans[j];
+            SideSummary *side = &diff->side[plan->side];
+
+            side->sql_id = plan->sql_id;
+            if (!diff->sql_text && plan->sql_text)
+            {
+                diff->sql_text = plan->sql_text;
+                diff->sql_len = plan->sql_len;
+            }
+            side->calls += plan->calls;
+            side->elapsed_sec += plan->elapsed_sec;
+            side->rows += plan->rows;
+            side->cr += plan->cr;
+            side->pr += plan->pr;
+            side->io_ms += plan->io_ms;
+            side->wait_us += plan->wait_us;
+            side->nplans++;
+            if (!side->main_plan || plan->elapsed_sec > side->main_plan->elapsed_sec)
+                side->main_plan = plan;
+        }
+
+        b = &diff->side[BEFORE];
+        a = &diff->side[AFTER];
+        if (b->calls > 0 && a->calls > 0)
+            diff->impact_sec = (per_call(a->elapsed_sec, a->calls) -
+                                per_call(b->elapsed_sec, b->calls)) * a->calls;
+        else
+            diff->impact_sec = a->elapsed_sec - b->elapsed_sec;
+    }
+    qsort(diffs, ndiffs, sizeof(StmtDiff), compare_impact);
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (!out)
+        {
+            fprintf(stderr, "%s: could not create \"%s\": %s\n", progname, output, strerror(errno));
+            return 1;
+        }
+    }
+    else
+        out = stdout;
+
+    {
+        double total[2] = {0, 0};
+        long long calls[2] = {0, 0};
+
+        for (i = 0; i < ndiffs; i++)
+        {
+            for (c = BEFORE; c <= AFTER; c++)
+            {
+                total[c] += diffs[i].side[c].elapsed_sec;
+                calls[c] += diffs[i].side[c].calls;
+            }
+        }
+        fprintf(out, "pg_trace_diff: %zu statements\n", ndiffs);
+        fprintf(out, "  before: %d file(s), %lld executions, %.6f sec\n",
+                npaths[BEFORE], calls[BEFORE], total[BEFORE]);
+        fprintf(out, "  after:  %d file(s), %lld executions, %.6f sec\n\n",
+                npaths[AFTER], calls[AFTER], total[AFTER]);
+    }
+
+    for (i = 0; i < ndiffs && (top == 0 || (long) i < top); i++)
+        write_stmt(out, &diffs[i]);
+
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: could not write output: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    for (c = 0; c < nfiles; c++)
+        pt_file_close(&files[c]);
+
+    return 0;
+}
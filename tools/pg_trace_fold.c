@@ -0,0 +1,350 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_fold.c
+ *    Folded stacks of exclusive time per plan node path
+ *
+ * STAT sections give inclusive times: a node's total contains its
+ * children's. For each node this writes the time spent in the node itself
+ * (its total minus its children's totals) under its path from the root:
+ *
+ *    sql_id=-3749202158761243157;HASHJOIN;SEQSCAN orders 1234
+ *
+ * Times are microseconds summed over every execution in the files, so
+ * thousands of executions of one statement fold into one line per path.
+ * The trace writes Instrumentation totals after InstrEndLoop, which are
+ * already summed over loops, so no per-loop scaling is needed. Planning
+ * time goes under a PARSE frame.
+ *
+ * Output is the input of flamegraph.pl, inferno and speedscope.
+ *
+ * Usage:
+ *    pg_trace_fold [-q sql_id] [-j threads] [-o output] file...
+ *
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pg_trace_parse.h"
+
+#define CHUNK_SIZE          (64 * 1024 * 1024)
+#define MAX_DEPTH           64
+#define MAX_STACK           4096
+
+typedef struct Stack
+{
+    char *path;
+    size_t len;
+    double us;
+} Stack;
+
+typedef struct StackTable
+{
+    Stack *entries;
+    size_t capacity;
+    size_t count;
+} StackTable;
+
+static const char *progname = "pg_trace_fold";
+static StackTable *tables;
+static bool filter_sql_id;
+static long long sql_id_filter;
+
+static size_t
+path_hash(const char *path, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return h;
+}
+
+static void
+table_add(StackTable *table, const char *path, size_t len, double us, bool copy)
+{
+    size_t i;
+
+    if ((table->count + 1) * 10 > table->capacity * 7)
+    {
+        Stack *old = table->entries;
+        size_t oldcap = table->capacity;
+
+        table->capacity = oldcap ? oldcap * 2 : 1024;
+        table->entries = calloc(table->capacity, sizeof(Stack));
+        if (!table->entries)
+        {
+            fprintf(stderr, "%s: out of memory\n", progname);
+            exit(1);
+        }
+        table->count = 0;
+        for (i = 0; i < oldcap; i++)
+        {
+            if (old[i].path)
+                table_add(table, old[i].path, old[i].len, old[i].us, false);
+        }
+        free(old);
+    }
+
+    i = path_hash(path, len) & (table->capacity - 1);
+    while (table->entries[i].path)
+    {
+        Stack *entry = &table->entries[i];
+
+        if (entry->len == len && memcmp(entry->path, path, len) == 0)
+        {
+            entry->us += us;
+            return;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    table->entries[i].path = copy ? strndup(path, len) : (char *) path;
+    if (!table->entries[i].path)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        exit(1);
+    }
+    table->entries[i].len = len;
+    table->entries[i].us = us;
+    table->count++;
+}
+
+/* Append one frame; ';' separates frames, so it cannot appear in one */
+static size_t
+append_frame(char *stack, size_t len, const char *frame, int frame_len)
+{
+    int i;
+
+    if (len + frame_len + 2 >= MAX_STACK)
+        return len;
+
+    stack[len++] = ';';
+    for (i = 0; i < frame_len; i++)
+        stack[len++] = frame[i] == ';' ? ':' : frame[i];
+    return len;
+}
+
+static void
+fold_cursor(const PtCursor *cursor, void *arg)
+{
+    StackTable *table = arg;
+    char stack[MAX_STACK];
+    size_t depth_len[MAX_DEPTH + 1];
+    size_t root_len;
+    int i;
+
+    if (filter_sql_id && cursor->sql_id != sql_id_filter)
+        return;
+
+    root_len = snprintf(stack, sizeof(stack), "sql_id=%lld", cursor->sql_id);
+    for (i = 0; i <= MAX_DEPTH; i++)
+        depth_len[i] = root_len;
+
+    if (cursor->parse_ela_sec > 0)
+    {
+        size_t len = append_frame(stack, root_len, "PARSE", 5);
+
+        table_add(table, stack, len, cursor->parse_ela_sec * 1e6, true);
+    }
+
+    for (i = 0; i < cursor->nnodes; i++)
+    {
+        const PtNode *node = &cursor->nodes[i];
+        double self_ms = node->total_ms;
+        size_t len;
+        int j;
+
+        if (node->depth > MAX_DEPTH)
+            continue;
+
+        /* Children are the following nodes one level deeper */
+        for (j = i + 1; j < cursor->nnodes && cursor->nodes[j].depth > node->depth; j++)
+        {
+            if (cursor->nodes[j].depth == node->depth + 1)
+                self_ms -= cursor->nodes[j].total_ms;
+        }
+        if (self_ms < 0)
+            self_ms = 0;
+
+        len = node->depth == 0 ? root_len : depth_len[node->depth - 1];
+        len = append_frame(stack, len, node->name, node->name_len);
+        if (node->object && len + node->object_len + 2 < MAX_STACK)
+        {
+            stack[len++] = ' ';
+            memcpy(stack + len, node->object, node->object_len);
+            len += node->object_len;
+        }
+        depth_len[node->depth] = len;
+
+        if (self_ms > 0)
+            table_add(table, stack, len, self_ms * 1000.0, true);
+    }
+}
+
+static void *
+make_table(int thread)
+{
+    return &tables[thread];
+}
+
+static int
+compare_stacks(const void *a, const void *b)
+{
+    const Stack *sa = a;
+    const Stack *sb = b;
+    size_t len = sa->len < sb->len ? sa->len : sb->len;
+    int cmp = memcmp(sa->path, sb->path, len);
+
+    return cmp ? cmp : (sa->len > sb->len) - (sa->len < sb->len);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-q sql_id] [-j threads] [-o output] <trace_file>...\n"
+            "\n"
+            "Writes folded stacks of exclusive microseconds per plan node path,\n"
+            "e.g. for flamegraph.pl:\n"
+            "  %s /tmp/pg_trace/*.trc | flamegraph.pl > plan.svg\n",
+            progname, progname);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    PtFile *files;
+    int nfiles;
+    PtChunk *chunks;
+    int nchunks;
+    StackTable *result;
+    Stack *sorted;
+    size_t nsorted = 0;
+    FILE *out;
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "q:j:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'q':
+                filter_sql_id = true;
+                sql_id_filter = strtoll(optarg, NULL, 10);
+                break;
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    nfiles = argc - optind;
+    if (nfiles < 1)
+        usage();
+    if (nthreads < 1)
+        nthreads = 1;
+
+    files = calloc(nfiles, sizeof(PtFile));
+    if (!files)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    for (c = 0; c < nfiles; c++)
+    {
+        if (pt_file_open(&files[c], argv[optind + c]) != 0)
+        {
+            fprintf(stderr, "%s: could not open \"%s\": %s\n",
+                    progname, argv[optind + c], strerror(errno));
+            return 1;
+        }
+    }
+
+    nchunks = pt_split(files, nfiles, CHUNK_SIZE, &chunks);
+    if (nchunks < 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    if (nthreads > nchunks)
+        nthreads = nchunks > 0 ? nchunks : 1;
+
+    tables = calloc(nthreads, sizeof(StackTable));
+    if (!tables)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    pt_parse_threads(chunks, nchunks, (int) nthreads, make_table, fold_cursor);
+
+    /* Merge into the first table */
+    result = &tables[0];
+    for (c = 1; c < nthreads; c++)
+    {
+        for (i = 0; i < tables[c].capacity; i++)
+        {
+            if (tables[c].entries[i].path)
+                table_add(result, tables[c].entries[i].path, tables[c].entries[i].len,
+                          tables[c].entries[i].us, false);
+        }
+    }
+
+    /* Sorted output is stable across runs and diffs well */
+    sorted = calloc(result->count + 1, sizeof(Stack));
+    if (!sorted)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    for (i = 0; i < result->capacity; i++)
+    {
+        if (result->entries[i].path)
+            sorted[nsorted++] = result->entries[i];
+    }
+    qsort(sorted, nsorted, sizeof(Stack), compare_stacks);
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (!out)
+        {
+            fprintf(stderr, "%s: could not create \"%s\": %s\n", progname, output, strerror(errno));
+            return 1;
+        }
+    }
+    else
+        out = stdout;
+
+    for (i = 0; i < nsorted; i++)
+    {
+        long long us = (long long) (sorted[i].us + 0.5);
+
+        if (us > 0)
+            fprintf(out, "%.*s %lld\n", (int) sorted[i].len, sorted[i].path, us);
+    }
+
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: could not write output: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    for (c = 0; c < nfiles; c++)
+        pt_file_close(&files[c]);
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_merge.c
+ *    Stream-merge an extension trace with the eBPF wait stream by time
+ *
+ * Both inputs are read line by line, once. Extension lines carrying tim=
+ * (PARSE, EXEC, EXEC TIME, EXEC STATS) are anchors: before an anchor is
+ * written, every wait that ended before it is written, so waits land in
+ * the cursor section they happened in. Lines without tim= keep their
+ * position relative to the anchors.
+ *
+ * The wait tracer drains per-CPU buffers, so its output is only roughly
+ * ordered. Waits pass through a min-heap of at most -w lines (default
+ * 4096) that restores time order; memory stays bounded by that window
+ * regardless of the input size.
+ *
+ * Usage:
+ *    pg_trace_merge [-o output] [-w window] <trace_file> <wait_file>
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IO_BUFFER_SIZE      (1024 * 1024)
+#define DEFAULT_WINDOW      4096
+
+typedef struct WaitLine
+{
+    long long tim;
+    unsigned long long seq;     /* Input order, breaks ties */
+    char *line;
+} WaitLine;
+
+typedef struct WaitHeap
+{
+    WaitLine *items;
+    size_t nitems;
+    size_t capacity;
+} WaitHeap;
+
+static const char *progname = "pg_trace_merge";
+
+static void
+fatal(const char *what, const char *path)
+{
+    fprintf(stderr, "%s: %s \"%s\": %s\n", progname, what, path, strerror(errno));
+    exit(1);
+}
+
+/*
+ * Value of tim= in the line, or -1
+ */
+static long long
+parse_tim(const char *line)
+{
+    const char *p = strstr(line, "tim=");
+
+    if (!p)
+        return -1;
+
+    return strtoll(p + 4, NULL, 10);
+}
+
+/*
+ * tim= of an anchor line of the extension trace, or -1. Only the call
+ * lines are looked at: statement text may contain anything.
+ */
+static long long
+anchor_tim(const char *line)
+{
+    if (strncmp(line, "PARSE #", 7) != 0 && strncmp(line, "EXEC ", 5) != 0)
+        return -1;
+
+    return parse_tim(line);
+}
+
+static int
+wait_before(const WaitLine *a, const WaitLine *b)
+{
+    if (a->tim != b->tim)
+        return a->tim < b->tim;
+    return a->seq < b->seq;
+}
+
+static void
+heap_push(WaitHeap *heap, WaitLine item)
+{
+    size_t i = heap->nitems++;
+
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+
+        if (!wait_before(&item, &heap->items[parent]))
+            break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = item;
+}
+
+static WaitLine
+heap_pop(WaitHeap *heap)
+{
+    WaitLine top = heap->items[0];
+    WaitLine last = heap->items[--heap->nitems];
+    size_t i = 0;
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= heap->nitems)
+            break;
+        if (child + 1 < heap->nitems &&
+            wait_before(&heap->items[child + 1], &heap->items[child]))
+            child++;
+        if (!wait_before(&heap->items[child], &last))
+            break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->nitems > 0)
+        heap->items[i] = last;
+
+    return top;
+}
+
+/*
+ * Reader of the wait stream: keeps the heap filled to the window size
+ */
+typedef struct WaitReader
+{
+    FILE *file;
+    WaitHeap heap;
+    unsigned long long seq;
+    int eof;
+    char *buf;
+    size_t bufsize;
+} WaitReader;
+
+static void
+wait_reader_fill(WaitReader *reader)
+{
+    while (!reader->eof && reader->heap.nitems < reader->heap.capacity)
+    {
+        ssize_t len = getline(&reader->buf, &reader->bufsize, reader->file);
+        WaitLine item;
+
+        if (len < 0)
+        {
+            reader->eof = 1;
+            break;
+        }
+
+        /* Banner and status lines of the tracer are not waits */
+        if (strncmp(reader->buf, "WAIT", 4) != 0)
+            continue;
+
+        item.tim = parse_tim(reader->buf);
+        item.seq = reader->seq++;
+        item.line = strdup(reader->buf);
+        if (!item.line)
+        {
+            fprintf(stderr, "%s: out of memory\n", progname);
+            exit(1);
+        }
+        heap_push(&reader->heap, item);
+    }
+}
+
+/*
+ * Write all waits that ended before tim (all of them if tim < 0)
+ */
+static void
+write_waits_before(WaitReader *reader, long long tim, FILE *out)
+{
+    for (;;)
+    {
+        WaitLine item;
+
+        wait_reader_fill(reader);
+        if (reader->heap.nitems == 0)
+            return;
+        if (tim >= 0 && reader->heap.items[0].tim > tim)
+            return;
+
+        item = heap_pop(&reader->heap);
+        fputs(item.line, out);
+        free(item.line);
+    }
+}
+
+static FILE *
+open_input(const char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if (!file)
+        fatal("could not open", path);
+    setvbuf(file, NULL, _IOFBF, IO_BUFFER_SIZE);
+    return file;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [-o output] [-w window] <trace_file> <wait_file>\n"
+            "\n"
+            "  -o output   write here instead of stdout\n"
+            "  -w window   wait lines buffered to restore time order (default %d)\n",
+            progname, DEFAULT_WINDOW);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    long window = DEFAULT_WINDOW;
+    FILE *trace;
+    FILE *out;
+    WaitReader reader;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:w:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            case 'w':
+                window = strtol(optarg, NULL, 10);
+                if (window < 1)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (argc - optind != 2)
+        usage();
+
+    trace = open_input(argv[optind]);
+
+    memset(&reader, 0, sizeof(reader));
+    reader.file = open_input(argv[optind + 1]);
+    reader.heap.capacity = (size_t) window;
+    reader.heap.items = malloc(reader.heap.capacity * sizeof(WaitLine));
+    if (!reader.heap.items)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (!out)
+            fatal("could not create", output);
+    }
+    else
+        out = stdout;
+    setvbuf(out, NULL, _IOFBF, IO_BUFFER_SIZE);
+
+    while ((len = getline(&line, &linesize, trace)) >= 0)
+    {
+        long long tim = anchor_tim(line);
+
+        if (tim >= 0)
+            write_waits_before(&reader, tim, out);
+        fputs(line, out);
+    }
+
+    /* Waits after the last traced call */
+    write_waits_before(&reader, -1, out);
+
+    if (ferror(trace) || ferror(reader.file))
+    {
+        fprintf(stderr, "%s: read error\n", progname);
+        return 1;
+    }
+    if (fclose(out) != 0)
+        fatal("could not write", output ? output : "stdout");
+
+    free(line);
+    free(reader.buf);
+    free(reader.heap.items);
+    fclose(trace);
+    fclose(reader.file);
+
+    return 0;
+}
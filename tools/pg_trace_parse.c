@@ -0,0 +1,772 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_parse.c
+ *    Reader of pg_trace .trc files shared by the trace file tools
+ *
+ * Lines are recognised by their prefix, fields by their name= inside the
+ * line; unknown lines and fields are skipped, so traces written by older
+ * or newer versions of the extension still parse. Numbers are read with
+ * a bounded scanner: the mapping is not NUL-terminated.
+ *
+ * Recursive statements (dep= above the running cursor's) are written
+ * inside the section of the statement that ran them. The running cursor
+ * is put aside while they are read and picked up again when they end.
+ *
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pg_trace_parse.h"
+
+#define PREFIX(line, end, s) \
+    ((size_t) ((end) - (line)) >= sizeof(s) - 1 && memcmp(line, s, sizeof(s) - 1) == 0)
+
+#define PT_MAX_NESTING      16
+
+/* A cursor and the capacity of its arrays */
+typedef struct PtLevel
+{
+    PtCursor cursor;
+    bool in_samples;
+    int exec_cap;
+    int wait_cap;
+    int node_cap;
+} PtLevel;
+
+/* Parser state for one chunk */
+typedef struct PtParser
+{
+    PtCursor cursor;
+    bool active;                /* Inside a cursor section */
+    bool in_sql;                /* SQL: text may span lines */
+    bool in_samples;            /* Lines of a WAIT SAMPLES section */
+    bool closing;               /* After ====: the end, or a recursive PARSE */
+    int exec_cap;
+    int wait_cap;
+    int node_cap;
+
+    int nsaved;                 /* Cursors waiting for a recursive one */
+    PtLevel saved[PT_MAX_NESTING];
+    PtLevel spare[PT_MAX_NESTING];  /* Arrays of ended recursive cursors */
+} PtParser;
+
+/*---- Files ----*/
+
+/* "*** PID: n" in the header, else pg_trace_<pid>_... in the file name */
+static int
+file_pid(const PtFile *file)
+{
+    size_t head = file->size < 4096 ? file->size : 4096;
+    const char *base = strrchr(file->path, '/');
+    const char *p;
+
+    if (head > 0 && (p = memmem(file->data, head, "*** PID: ", 9)) != NULL)
+        return atoi(p + 9);
+
+    base = base ? base + 1 : file->path;
+    if (strncmp(base, "pg_trace_", 9) == 0)
+        return atoi(base + 9);
+    return 0;
+}
+
+int
+pt_file_open(PtFile *file, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(file, 0, sizeof(PtFile));
+    file->path = path;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    file->size = (size_t) st.st_size;
+    if (file->size > 0)
+    {
+        void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        madvise(map, file->size, MADV_SEQUENTIAL);
+        file->data = map;
+    }
+
+    file->pid = file_pid(file);
+
+    close(fd);
+    return 0;
+}
+
+void
+pt_file_close(PtFile *file)
+{
+    if (file->data)
+        munmap((void *) file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+/* Next "\nPARSE #" line of a top-level statement (dep=0 or no dep=) */
+static const char *
+next_top_level(const char *data, size_t size, size_t from)
+{
+    const char *p = data + from;
+    const char *end = data + size;
+
+    while ((p = memmem(p, end - p, "\nPARSE #", 8)) != NULL)
+    {
+        const char *eol = memchr(p + 1, '\n', end - p - 1);
+        const char *dep = memmem(p + 1, (eol ? eol : end) - p - 1, " dep=", 5);
+
+        if (!dep || dep[5] == '0')
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * Split files into chunks of about chunk_size, each starting at a line
+ * "PARSE #" of a top-level statement (or at the start of the file), so
+ * that recursive statements stay in the chunk of the one that ran them.
+ * Returns the number of chunks, -1 if out of memory.
+ */
+int
+pt_split(const PtFile *files, int nfiles, size_t chunk_size, PtChunk **chunks)
+{
+    int nchunks = 0;
+    int cap = 64;
+    int f;
+
+    *chunks = malloc(cap * sizeof(PtChunk));
+    if (!*chunks)
+        return -1;
+
+    for (f = 0; f < nfiles; f++)
+    {
+        const char *data = files[f].data;
+        size_t size = files[f].size;
+        size_t start = 0;
+
+        while (start < size)
+        {
+            size_t end = start + chunk_size;
+
+            if (end >= size)
+                end = size;
+            else
+            {
+                const char *next = next_top_level(data, size, end);
+
+                end = next ? (size_t) (next - data) + 1 : size;
+            }
+
+            if (nchunks == cap)
+            {
+                PtChunk *grown = realloc(*chunks, 2 * cap * sizeof(PtChunk));
+
+                if (!grown)
+                    return -1;
+                *chunks = grown;
+                cap *= 2;
+            }
+
+            (*chunks)[nchunks].file_index = f;
+            (*chunks)[nchunks].data = data + start;
+            (*chunks)[nchunks].size = end - start;
+            nchunks++;
+            start = end;
+        }
+    }
+
+    return nchunks;
+}
+
+/*---- Scanner ----*/
+
+static const char *
+find_field(const char *line, const char *end, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = line;
+
+    while ((p = memmem(p, end - p, name, len)) != NULL)
+    {
+        /* Whole field names only: "ela=" must not match "max_ela=" */
+        if (p == line || p[-1] == ' ' || p[-1] == '(' || p[-1] == ',')
+            return p + len;
+        p += len;
+    }
+    return NULL;
+}
+
+static long long
+scan_int(const char *p, const char *end)
+{
+    long long value = 0;
+    bool negative = false;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+
+    return negative ? -value : value;
+}
+
+static double
+scan_double(const char *p, const char *end)
+{
+    double value = 0;
+    double scale = 1;
+    bool negative = false;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    if (p < end && *p == '.')
+    {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            scale /= 10;
+            value += (*p++ - '0') * scale;
+        }
+    }
+
+    return negative ? -value : value;
+}
+
+static long long
+field_int(const char *line, const char *end, const char *name, long long dflt)
+{
+    const char *p = find_field(line, end, name);
+
+    return p ? scan_int(p, end) : dflt;
+}
+
+static double
+field_double(const char *line, const char *end, const char *name, double dflt)
+{
+    const char *p = find_field(line, end, name);
+
+    return p ? scan_double(p, end) : dflt;
+}
+
+/* Cursor number after '#' */
+static long long
+cursor_number(const char *line, const char *end)
+{
+    const char *p = memchr(line, '#', end - line);
+
+    return p ? scan_int(p + 1, end) : -1;
+}
+
+/* Quoted value of name='...' */
+static bool
+field_quoted(const char *line, const char *end, const char *name,
+             const char **value, int *len)
+{
+    const char *p = find_field(line, end, name);
+    const char *close;
+
+    if (!p || p >= end || *p != '\'')
+        return false;
+
+    close = memchr(p + 1, '\'', end - p - 1);
+    if (!close)
+        return false;
+
+    *value = p + 1;
+    *len = (int) (close - p - 1);
+    return true;
+}
+
+/*---- Cursor assembly ----*/
+
+static void *
+grow(void *array, int *cap, size_t elem)
+{
+    int newcap = *cap ? *cap * 2 : 16;
+    void *grown = realloc(array, newcap * elem);
+
+    if (!grown)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    *cap = newcap;
+    return grown;
+}
+
+static PtWait *
+add_wait(PtParser *ps)
+{
+    PtCursor *c = &ps->cursor;
+    PtWait *wait;
+
+    if (c->nwaits == ps->wait_cap)
+        c->waits = grow(c->waits, &ps->wait_cap, sizeof(PtWait));
+
+    wait = &c->waits[c->nwaits++];
+    memset(wait, 0, sizeof(PtWait));
+    wait->node_id = -1;
+    return wait;
+}
+
+static void
+begin_cursor(PtParser *ps, int file_index, const char *line, const char *end)
+{
+    PtCursor *c = &ps->cursor;
+    PtExec *execs = c->execs;
+    PtWait *waits = c->waits;
+    PtNode *nodes = c->nodes;
+
+    memset(c, 0, sizeof(PtCursor));
+    c->execs = execs;
+    c->waits = waits;
+    c->nodes = nodes;
+
+    c->file_index = file_index;
+    c->cursor_id = cursor_number(line, end);
+    c->depth = (int) field_int(line, end, "dep=", 0);
+    c->parse_tim = field_int(line, end, "tim=", 0);
+    ps->active = true;
+    ps->in_sql = false;
+    ps->in_samples = false;
+    ps->closing = false;
+}
+
+/* Put the running cursor aside; the next one reuses spare arrays */
+static void
+push_cursor(PtParser *ps)
+{
+    PtLevel *saved = &ps->saved[ps->nsaved];
+    PtLevel *spare = &ps->spare[ps->nsaved];
+
+    saved->cursor = ps->cursor;
+    saved->in_samples = ps->in_samples;
+    saved->exec_cap = ps->exec_cap;
+    saved->wait_cap = ps->wait_cap;
+    saved->node_cap = ps->node_cap;
+
+    ps->cursor.execs = spare->cursor.execs;
+    ps->cursor.waits = spare->cursor.waits;
+    ps->cursor.nodes = spare->cursor.nodes;
+    ps->exec_cap = spare->exec_cap;
+    ps->wait_cap = spare->wait_cap;
+    ps->node_cap = spare->node_cap;
+    ps->nsaved++;
+}
+
+/* Back to the cursor that ran the one just ended */
+static void
+pop_cursor(PtParser *ps)
+{
+    PtLevel *saved = &ps->saved[--ps->nsaved];
+    PtLevel *spare = &ps->spare[ps->nsaved];
+
+    spare->cursor.execs = ps->cursor.execs;
+    spare->cursor.waits = ps->cursor.waits;
+    spare->cursor.nodes = ps->cursor.nodes;
+    spare->exec_cap = ps->exec_cap;
+    spare->wait_cap = ps->wait_cap;
+    spare->node_cap = ps->node_cap;
+
+    ps->cursor = saved->cursor;
+    ps->in_samples = saved->in_samples;
+    ps->exec_cap = saved->exec_cap;
+    ps->wait_cap = saved->wait_cap;
+    ps->node_cap = saved->node_cap;
+    ps->active = true;
+}
+
+static void
+end_cursor(PtParser *ps, PtCursorCallback callback, void *arg)
+{
+    if (ps->active)
+        callback(&ps->cursor, arg);
+    ps->active = false;
+    ps->in_sql = false;
+    ps->in_samples = false;
+    ps->closing = false;
+
+    if (ps->nsaved > 0)
+        pop_cursor(ps);
+}
+
+/* "WAIT #n: nam='...' ela=N" from the extension or the eBPF tracer */
+static void
+parse_wait(PtParser *ps, const char *line, const char *end)
+{
+    PtCursor *c = &ps->cursor;
+    const char *name;
+    int name_len;
+    PtWait *wait;
+
+    if (!field_quoted(line, end, "nam=", &name, &name_len))
+        return;
+    if (cursor_number(line, end) != c->cursor_id)
+        return;
+
+    wait = add_wait(ps);
+    wait->name = name;
+    wait->name_len = name_len;
+    wait->tim = field_int(line, end, "tim=", 0);
+
+    if (PREFIX(line, end, "WAIT STATS"))
+    {
+        /* In-kernel aggregate: waits=N ela=total max=M */
+        wait->count = field_int(line, end, "waits=", 1);
+        wait->ela_us = field_double(line, end, "ela=", 0);
+        wait->max_us = field_double(line, end, "max=", wait->ela_us);
+    }
+    else
+    {
+        wait->count = 1;
+        wait->ela_us = field_double(line, end, "ela=", 0);
+        wait->max_us = wait->ela_us;
+    }
+}
+
+/* "  id=N op=X nam='...' class=C samples=N ela=X ms" */
+static void
+parse_sample(PtParser *ps, const char *line, const char *end)
+{
+    const char *name;
+    int name_len;
+    const char *wait_class;
+    PtWait *wait;
+
+    if (!field_quoted(line, end, "nam=", &name, &name_len))
+        return;
+
+    /* On-CPU samples are not waits */
+    wait_class = find_field(line, end, "class=");
+    if (wait_class && end - wait_class >= 3 && memcmp(wait_class, "CPU", 3) == 0)
+        return;
+
+    wait = add_wait(ps);
+    wait->name = name;
+    wait->name_len = name_len;
+    wait->count = field_int(line, end, "samples=", 0);
+    wait->ela_us = field_double(line, end, "ela=", 0) * 1000.0;
+    wait->max_us = 0;
+    wait->sampled = true;
+    wait->node_id = (int) field_int(line, end, "id=", -1);
+}
+
+/* "    -> NodeName (cost=...) (actual rows=R loops=L)" */
+static void
+parse_node(PtParser *ps, const char *line, const char *end)
+{
+    PtCursor *c = &ps->cursor;
+    const char *arrow = line;
+    const char *name;
+    const char *name_end;
+    PtNode *node;
+
+    while (arrow < end && *arrow == ' ')
+        arrow++;
+
+    if (c->nnodes == ps->node_cap)
+        c->nodes = grow(c->nodes, &ps->node_cap, sizeof(PtNode));
+
+    node = &c->nodes[c->nnodes++];
+    memset(node, 0, sizeof(PtNode));
+    node->depth = (int) (arrow - line) / 2;
+
+    name = arrow + 3;
+    name_end = name;
+    while (name_end < end && *name_end != ' ' && *name_end != '(')
+        name_end++;
+    node->name = name;
+    node->name_len = (int) (name_end - name);
+    node->id = (int) field_int(line, end, "id=", -1);
+
+    /* "(cost=... rows=E ...)" comes first: take the actual rows */
+    {
+        const char *actual = memmem(line, end - line, "(actual ", 8);
+
+        if (actual)
+        {
+            node->rows = field_double(actual, end, "rows=", 0);
+            node->loops = field_double(actual, end, "loops=", 0);
+        }
+    }
+}
+
+static void
+parse_line(PtParser *ps, int file_index, const char *line, const char *end,
+           PtCursorCallback callback, void *arg)
+{
+    PtCursor *c = &ps->cursor;
+
+    if (PREFIX(line, end, "PARSE #"))
+    {
+        int depth = (int) field_int(line, end, "dep=", 0);
+
+        /* End the cursors at this level or deeper, keep the one running it */
+        while (ps->active && depth <= ps->cursor.depth)
+            end_cursor(ps, callback, arg);
+        if (ps->active && ps->nsaved == PT_MAX_NESTING)
+            end_cursor(ps, callback, arg);
+        if (ps->active)
+            push_cursor(ps);
+        begin_cursor(ps, file_index, line, end);
+        return;
+    }
+
+    /* ==== not followed by a recursive PARSE: the cursor ended */
+    if (ps->closing)
+        end_cursor(ps, callback, arg);
+
+    if (!ps->active)
+        return;
+
+    if (ps->in_sql)
+    {
+        if (!PREFIX(line, end, "-----"))
+        {
+            c->sql_len = (size_t) (end - c->sql_text);
+            return;
+        }
+        ps->in_sql = false;
+    }
+
+    if (PREFIX(line, end, "====="))
+        ps->closing = true;
+    else if (PREFIX(line, end, "SQL_ID: "))
+        c->sql_id = scan_int(line + 8, end);
+    else if (PREFIX(line, end, "SQL: "))
+    {
+        c->sql_text = line + 5;
+        c->sql_len = (size_t) (end - c->sql_text);
+        ps->in_sql = true;
+    }
+    else if (PREFIX(line, end, "PLAN_ID: "))
+        c->plan_id = scan_int(line + 9, end);
+    else if (PREFIX(line, end, "PARSE TIME:"))
+    {
+        c->parse_ela_sec = field_double(line, end, "ela=", 0);
+        c->parse_cpu_sec = field_double(line, end, "cpu=", 0);
+    }
+    else if (PREFIX(line, end, "PARSE STATS:"))
+        c->parse_cr = field_int(line, end, "cr=", 0);
+    else if (PREFIX(line, end, "BIND TIME:"))
+    {
+        c->bind_ela_sec = field_double(line, end, "ela=", 0);
+        c->bind_cpu_sec = field_double(line, end, "cpu=", 0);
+    }
+    else if (PREFIX(line, end, "EXEC #"))
+    {
+        PtExec *exec;
+
+        if (c->nexecs == ps->exec_cap)
+            c->execs = grow(c->execs, &ps->exec_cap, sizeof(PtExec));
+        exec = &c->execs[c->nexecs++];
+        memset(exec, 0, sizeof(PtExec));
+        exec->tim = field_int(line, end, "tim=", 0);
+    }
+    else if (PREFIX(line, end, "EXEC TIME:"))
+    {
+        if (c->nexecs > 0)
+        {
+            PtExec *exec = &c->execs[c->nexecs - 1];
+
+            exec->ela_sec = field_double(line, end, "ela=", 0);
+            exec->cpu_sec = field_double(line, end, "cpu=", 0);
+            exec->rows = field_int(line, end, "rows=", 0);
+        }
+    }
+    else if (PREFIX(line, end, "EXEC STATS:"))
+    {
+        c->have_stats = true;
+        c->cr = field_int(line, end, "cr=", 0);
+        c->pr = field_int(line, end, "pr=", 0);
+        c->cpu_sec = field_double(line, end, "cpu=", 0);
+        c->elapsed_sec = field_double(line, end, "elapsed=", 0);
+        c->offcpu_sec = field_double(line, end, "offcpu=", 0);
+        c->end_tim = field_int(line, end, "tim=", 0);
+    }
+    else if (PREFIX(line, end, "WAIT SAMPLES"))
+        ps->in_samples = true;
+    else if (PREFIX(line, end, "WAIT"))
+        parse_wait(ps, line, end);
+    else if (ps->in_samples && PREFIX(line, end, "  id="))
+        parse_sample(ps, line, end);
+    else if (PREFIX(line, end, "-> "))
+        parse_node(ps, line, end);
+    else if (line < end && *line == ' ')
+    {
+        /* Plan tree lines below the root are indented by depth */
+        const char *p = line;
+
+        while (p < end && *p == ' ')
+            p++;
+        if (end - p > 3 && p[0] == '-' && p[1] == '>' && p[2] == ' ')
+            parse_node(ps, line, end);
+        else if (c->nnodes > 0)
+        {
+            PtNode *node = &c->nodes[c->nnodes - 1];
+
+            if (PREFIX(p, end, "Timing: "))
+            {
+                node->startup_ms = field_double(p, end, "startup=", 0);
+                node->total_ms = field_double(p, end, "total=", 0);
+            }
+            else if (PREFIX(p, end, "Buffers: "))
+            {
+                node->shared_hit = field_int(p, end, "hit=", 0);
+                node->shared_read = field_int(p, end, "read=", 0);
+            }
+            else if (PREFIX(p, end, "I/O Detail: "))
+            {
+                node->io_ms = field_double(p, end, "total=", 0);
+                if (c->nnodes == 1)
+                    c->io_ms = node->io_ms;
+            }
+            else if (!node->object &&
+                     (PREFIX(p, end, "Relation: ") || PREFIX(p, end, "Index: ")))
+            {
+                node->object = memchr(p, ':', end - p) + 2;
+                node->object_len = (int) (end - node->object);
+            }
+        }
+    }
+}
+
+/*
+ * Parse one chunk, calling callback for each complete cursor section
+ */
+void
+pt_parse(const PtChunk *chunk, PtCursorCallback callback, void *arg)
+{
+    PtParser ps;
+    const char *p = chunk->data;
+    const char *end = chunk->data + chunk->size;
+    int i;
+
+    memset(&ps, 0, sizeof(ps));
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+
+        if (!eol)
+            eol = end;
+        parse_line(&ps, chunk->file_index, p, eol, callback, arg);
+        p = eol + 1;
+    }
+
+    while (ps.active)
+        end_cursor(&ps, callback, arg);
+
+    free(ps.cursor.execs);
+    free(ps.cursor.waits);
+    free(ps.cursor.nodes);
+    for (i = 0; i < PT_MAX_NESTING; i++)
+    {
+        free(ps.spare[i].cursor.execs);
+        free(ps.spare[i].cursor.waits);
+        free(ps.spare[i].cursor.nodes);
+    }
+}
+
+/*---- Threads ----*/
+
+typedef struct PtWorker
+{
+    pthread_t thread;
+    int index;
+    const PtChunk *chunks;
+    int nchunks;
+    int *next;                  /* Shared chunk counter */
+    void *state;
+    PtCursorCallback callback;
+} PtWorker;
+
+static void *
+pt_worker_main(void *arg)
+{
+    PtWorker *worker = arg;
+
+    for (;;)
+    {
+        int i = __atomic_fetch_add(worker->next, 1, __ATOMIC_RELAXED);
+
+        if (i >= worker->nchunks)
+            break;
+        pt_parse(&worker->chunks[i], worker->callback, worker->state);
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse all chunks with nthreads threads. Each thread gets its own
+ * callback argument from make_state(thread), so callbacks need no locks;
+ * the caller merges the states afterwards.
+ */
+int
+pt_parse_threads(const PtChunk *chunks, int nchunks, int nthreads,
+                 void *(*make_state) (int thread), PtCursorCallback callback)
+{
+    PtWorker *workers;
+    int next = 0;
+    int i;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    workers = calloc(nthreads, sizeof(PtWorker));
+    if (!workers)
+        return -1;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].index = i;
+        workers[i].chunks = chunks;
+        workers[i].nchunks = nchunks;
+        workers[i].next = &next;
+        workers[i].state = make_state(i);
+        workers[i].callback = callback;
+
+        if (pthread_create(&workers[i].thread, NULL, pt_worker_main, &workers[i]) != 0)
+        {
+            /* Run the rest on the threads we have */
+            nthreads = i;
+            break;
+        }
+    }
+
+    if (nthreads == 0)
+        pt_worker_main(&workers[0]);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_parse.h
+ *    Reader of pg_trace .trc files shared by the trace file tools
+ *
+ * Files are memory-mapped and parsed without copying: strings in the
+ * records point into the mapping. The parser turns the lines of one
+ * cursor section (PARSE # ... closing ====) into a PtCursor and hands it
+ * to a callback; the record and its arrays are reused for the next
+ * cursor, so callbacks copy what they keep.
+ *
+ * A file can be split at any line that starts a top-level cursor section
+ * and the pieces parsed independently, which is how the tools use several
+ * threads on one file. Recursive statements (dep= > 0) are reported
+ * before the cursor that ran them, which is reported when its own
+ * section ends.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_TRACE_PARSE_H
+#define PG_TRACE_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A memory-mapped trace file */
+typedef struct PtFile
+{
+    const char *path;
+    const char *data;
+    size_t size;
+    int pid;                    /* Backend from the header, 0 if unknown */
+} PtFile;
+
+/* One wait: a WAIT line, an aggregated eBPF WAIT STATS line, or a sample */
+typedef struct PtWait
+{
+    const char *name;
+    int name_len;
+    long long count;            /* 1 for a single wait */
+    double ela_us;
+    double max_us;
+    long long tim;              /* 0 when the line has none */
+    bool sampled;               /* From WAIT SAMPLES: ela is an estimate */
+    int node_id;                /* Plan node of a sampled wait, -1 if unknown */
+} PtWait;
+
+/* One ExecutorRun: EXEC # and EXEC TIME */
+typedef struct PtExec
+{
+    long long tim;              /* Start */
+    double ela_sec;
+    double cpu_sec;
+    long long rows;
+} PtExec;
+
+/* One plan node of the STAT section */
+typedef struct PtNode
+{
+    int depth;
+    int id;                     /* -1 if the trace predates node ids */
+    const char *name;
+    int name_len;
+    const char *object;         /* Relation or index, NULL if none */
+    int object_len;
+    double rows;                /* Per loop */
+    double loops;
+    double startup_ms;          /* To the first row, all loops */
+    double total_ms;            /* Inclusive, all loops */
+    long long shared_hit;       /* Inclusive, all loops */
+    long long shared_read;
+    double io_ms;               /* Read time from I/O Detail, 0 without track_io_timing */
+} PtNode;
+
+/* One cursor section */
+typedef struct PtCursor
+{
+    int file_index;
+    long long cursor_id;
+    int depth;                  /* dep=: 0 for a top-level statement */
+    long long sql_id;
+    long long plan_id;
+    const char *sql_text;       /* NULL if written earlier in the file */
+    size_t sql_len;
+
+    long long parse_tim;
+    double parse_ela_sec;
+    double parse_cpu_sec;
+    long long parse_cr;
+    double bind_ela_sec;
+    double bind_cpu_sec;
+
+    int nexecs;
+    PtExec *execs;
+
+    bool have_stats;            /* EXEC STATS seen */
+    long long end_tim;
+    double elapsed_sec;
+    double cpu_sec;
+    double offcpu_sec;
+    long long cr;
+    long long pr;
+    double io_ms;               /* I/O Detail of the plan root */
+
+    int nwaits;
+    PtWait *waits;
+    int nnodes;
+    PtNode *nodes;
+} PtCursor;
+
+typedef void (*PtCursorCallback) (const PtCursor *cursor, void *arg);
+
+/* A piece of a file that starts at a cursor section */
+typedef struct PtChunk
+{
+    int file_index;
+    const char *data;
+    size_t size;
+} PtChunk;
+
+extern int pt_file_open(PtFile *file, const char *path);
+extern void pt_file_close(PtFile *file);
+
+extern int pt_split(const PtFile *files, int nfiles, size_t chunk_size,
+                    PtChunk **chunks);
+extern void pt_parse(const PtChunk *chunk, PtCursorCallback callback, void *arg);
+
+extern int pt_parse_threads(const PtChunk *chunks, int nchunks, int nthreads,
+                            void *(*make_state) (int thread),
+                            PtCursorCallback callback);
+
+#endif /* PG_TRACE_PARSE_H */
@@ -0,0 +1,646 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_trace_prof.c
+ *    tkprof-style report of pg_trace files
+ *
+ * Aggregates every traced statement of one or many trace files by sql_id
+ * and plan_id: parse/bind/execute counts and times, buffers, the waits
+ * that made up the elapsed time and the worst executions. Files are
+ * memory-mapped and split at cursor boundaries; each thread aggregates
+ * into its own table and the tables are merged at the end, so parsing
+ * scales with the cores and needs no locks.
+ *
+ * Usage:
+ *    pg_trace_prof [-s sort] [-n top] [-j threads] [-w worst] [-o output] file...
+ *
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pg_trace_parse.h"
+
+#define CHUNK_SIZE          (64 * 1024 * 1024)
+#define MAX_WORST           32
+#define DEFAULT_TOP         20
+#define DEFAULT_WORST       3
+#define REPORT_WAITS        10
+
+typedef struct WaitAgg
+{
+    const char *name;
+    int name_len;
+    bool sampled;
+    long long times;
+    double total_us;
+    double max_us;
+} WaitAgg;
+
+typedef struct Execution
+{
+    int file_index;
+    long long cursor_id;
+    long long tim;
+    double elapsed_sec;
+    double cpu_sec;
+    long long rows;
+} Execution;
+
+typedef struct PhaseAgg
+{
+    long long count;
+    double ela_sec;
+    double cpu_sec;
+    long long disk;
+    long long query;
+    long long rows;
+} PhaseAgg;
+
+typedef struct StmtAgg
+{
+    bool used;
+    long long sql_id;
+    long long plan_id;
+    const char *sql_text;
+    size_t sql_len;
+
+    long long calls;            /* Cursors */
+    double elapsed_sec;         /* Parse + EXEC STATS elapsed */
+    double offcpu_sec;
+    PhaseAgg parse;
+    PhaseAgg bind;
+    PhaseAgg exec;
+
+    int nwaits;
+    int wait_cap;
+    WaitAgg *waits;
+
+    int nworst;
+    Execution worst[MAX_WORST];
+} StmtAgg;
+
+typedef struct StmtTable
+{
+    StmtAgg *entries;
+    size_t capacity;
+    size_t count;
+    long long cursors;
+} StmtTable;
+
+typedef enum SortKey
+{
+    SORT_ELAPSED,
+    SORT_CPU,
+    SORT_CALLS,
+    SORT_DISK,
+    SORT_QUERY,
+    SORT_ROWS,
+    SORT_WAIT,
+    SORT_AVG
+} SortKey;
+
+static const char *sort_names[] = {
+    "elapsed", "cpu", "calls", "disk", "query", "rows", "wait", "avg", NULL
+};
+
+static const char *progname = "pg_trace_prof";
+static int worst_keep = DEFAULT_WORST;
+static StmtTable *tables;
+static SortKey sort_key = SORT_ELAPSED;
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+
+    if (!p)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        exit(1);
+    }
+    return p;
+}
+
+/*---- Aggregation ----*/
+
+static size_t
+stmt_hash(long long sql_id, long long plan_id)
+{
+    unsigned long long h = (unsigned long long) sql_id * 0x9E3779B97F4A7C15ULL;
+
+    h ^= (unsigned long long) plan_id + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+    return (size_t) (h ^ (h >> 29));
+}
+
+static void table_grow(StmtTable *table);
+
+static StmtAgg *
+table_lookup(StmtTable *table, long long sql_id, long long plan_id)
+{
+    size_t i;
+
+    if ((table->count + 1) * 10 > table->capacity * 7)
+        table_grow(table);
+
+    i = stmt_hash(sql_id, plan_id) & (table->capacity - 1);
+    for (;;)
+    {
+        StmtAgg *entry = &table->entries[i];
+
+        if (!entry->used)
+        {
+            entry->used = true;
+            entry->sql_id = sql_id;
+            entry->plan_id = plan_id;
+            table->count++;
+            return entry;
+        }
+        if (entry->sql_id == sql_id && entry->plan_id == plan_id)
+            return entry;
+        i = (i + 1) & (table->capacity - 1);
+    }
+}
+
+static void
+table_grow(StmtTable *table)
+{
+    StmtAgg *old = table->entries;
+    size_t oldcap = table->capacity;
+    size_t i;
+
+    table->capacity = oldcap ? oldcap * 2 : 1024;
+    table->entries = xcalloc(table->capacity, sizeof(StmtAgg));
+    table->count = 0;
+
+    for (i = 0; i < oldcap; i++)
+    {
+        if (old[i].used)
+        {
+            StmtAgg *entry = table_lookup(table, old[i].sql_id, old[i].plan_id);
+
+            *entry = old[i];
+        }
+    }
+    free(old);
+}
+
+static void
+add_wait(StmtAgg *stmt, const char *name, int name_len, bool sampled,
+         long long times, double total_us, double max_us)
+{
+    WaitAgg *wait = NULL;
+    int i;
+
+    for (i = 0; i < stmt->nwaits; i++)
+    {
+        if (stmt->waits[i].sampled == sampled &&
+            stmt->waits[i].name_len == name_len &&
+            memcmp(stmt->waits[i].name, name, name_len) == 0)
+        {
+            wait = &stmt->waits[i];
+            break;
+        }
+    }
+
+    if (!wait)
+    {
+        if (stmt->nwaits == stmt->wait_cap)
+        {
+            stmt->wait_cap = stmt->wait_cap ? stmt->wait_cap * 2 : 8;
+            stmt->waits = realloc(stmt->waits, stmt->wait_cap * sizeof(WaitAgg));
+            if (!stmt->waits)
+            {
+                fprintf(stderr, "%s: out of memory\n", progname);
+                exit(1);
+            }
+        }
+        wait = &stmt->waits[stmt->nwaits++];
+        memset(wait, 0, sizeof(WaitAgg));
+        wait->name = name;
+        wait->name_len = name_len;
+        wait->sampled = sampled;
+    }
+
+    wait->times += times;
+    wait->total_us += total_us;
+    if (max_us > wait->max_us)
+        wait->max_us = max_us;
+}
+
+/* Keep the worst_keep slowest executions, slowest first */
+static void
+add_worst(StmtAgg *stmt, const Execution *exec)
+{
+    int i;
+
+    if (stmt->nworst == worst_keep &&
+        exec->elapsed_sec <= stmt->worst[stmt->nworst - 1].elapsed_sec)
+        return;
+
+    i = stmt->nworst < worst_keep ? stmt->nworst++ : stmt->nworst - 1;
+    while (i > 0 && stmt->worst[i - 1].elapsed_sec < exec->elapsed_sec)
+    {
+        stmt->worst[i] = stmt->worst[i - 1];
+        i--;
+    }
+    stmt->worst[i] = *exec;
+}
+
+static void
+phase_add(PhaseAgg *sum, const PhaseAgg *add)
+{
+    sum->count += add->count;
+    sum->ela_sec += add->ela_sec;
+    sum->cpu_sec += add->cpu_sec;
+    sum->disk += add->disk;
+    sum->query += add->query;
+    sum->rows += add->rows;
+}
+
+static void
+aggregate_cursor(const PtCursor *cursor, void *arg)
+{
+    StmtTable *table = arg;
+    StmtAgg *stmt = table_lookup(table, cursor->sql_id, cursor->plan_id);
+    Execution exec;
+    long long rows = 0;
+    double exec_ela = 0;
+    int i;
+
+    table->cursors++;
+    stmt->calls++;
+
+    if (!stmt->sql_text && cursor->sql_text)
+    {
+        stmt->sql_text = cursor->sql_text;
+        stmt->sql_len = cursor->sql_len;
+    }
+
+    stmt->parse.count++;
+    stmt->parse.ela_sec += cursor->parse_ela_sec;
+    stmt->parse.cpu_sec += cursor->parse_cpu_sec;
+    stmt->parse.query += cursor->parse_cr;
+
+    if (cursor->bind_ela_sec > 0 || cursor->bind_cpu_sec > 0)
+    {
+        stmt->bind.count++;
+        stmt->bind.ela_sec += cursor->bind_ela_sec;
+        stmt->bind.cpu_sec += cursor->bind_cpu_sec;
+    }
+
+    for (i = 0; i < cursor->nexecs; i++)
+    {
+        stmt->exec.count++;
+        stmt->exec.ela_sec += cursor->execs[i].ela_sec;
+        stmt->exec.cpu_sec += cursor->execs[i].cpu_sec;
+        rows += cursor->execs[i].rows;
+        exec_ela += cursor->execs[i].ela_sec;
+    }
+    stmt->exec.rows += rows;
+    stmt->exec.disk += cursor->pr;
+    stmt->exec.query += cursor->cr;
+
+    /* Without EXEC STATS (older traces, errors), the runs are all we know */
+    exec.elapsed_sec = cursor->parse_ela_sec +
+        (cursor->have_stats ? cursor->elapsed_sec : exec_ela);
+    stmt->elapsed_sec += exec.elapsed_sec;
+    stmt->offcpu_sec += cursor->offcpu_sec;
+
+    for (i = 0; i < cursor->nwaits; i++)
+    {
+        const PtWait *wait = &cursor->waits[i];
+
+        add_wait(stmt, wait->name, wait->name_len, wait->sampled,
+                 wait->count, wait->ela_us, wait->max_us);
+    }
+
+    exec.file_index = cursor->file_index;
+    exec.cursor_id = cursor->cursor_id;
+    exec.tim = cursor->parse_tim;
+    exec.cpu_sec = cursor->parse_cpu_sec + cursor->cpu_sec;
+    exec.rows = rows;
+    add_worst(stmt, &exec);
+}
+
+static void *
+make_table(int thread)
+{
+    return &tables[thread];
+}
+
+static void
+merge_stmt(StmtTable *into, const StmtAgg *from)
+{
+    StmtAgg *stmt = table_lookup(into, from->sql_id, from->plan_id);
+    int i;
+
+    if (!stmt->sql_text && from->sql_text)
+    {
+        stmt->sql_text = from->sql_text;
+        stmt->sql_len = from->sql_len;
+    }
+
+    stmt->calls += from->calls;
+    stmt->elapsed_sec += from->elapsed_sec;
+    stmt->offcpu_sec += from->offcpu_sec;
+    phase_add(&stmt->parse, &from->parse);
+    phase_add(&stmt->bind, &from->bind);
+    phase_add(&stmt->exec, &from->exec);
+
+    for (i = 0; i < from->nwaits; i++)
+        add_wait(stmt, from->waits[i].name, from->waits[i].name_len,
+                 from->waits[i].sampled, from->waits[i].times,
+                 from->waits[i].total_us, from->waits[i].max_us);
+    for (i = 0; i < from->nworst; i++)
+        add_worst(stmt, &from->worst[i]);
+}
+
+/*---- Report ----*/
+
+static double
+stmt_wait_sec(const StmtAgg *stmt)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < stmt->nwaits; i++)
+    {
+        if (!stmt->waits[i].sampled)
+            total += stmt->waits[i].total_us;
+    }
+    return total / 1e6;
+}
+
+static double
+sort_value(const StmtAgg *stmt)
+{
+    switch (sort_key)
+    {
+        case SORT_ELAPSED:
+            return stmt->elapsed_sec;
+        case SORT_CPU:
+            return stmt->parse.cpu_sec + stmt->bind.cpu_sec + stmt->exec.cpu_sec;
+        case SORT_CALLS:
+            return (double) stmt->calls;
+        case SORT_DISK:
+            return (double) stmt->exec.disk;
+        case SORT_QUERY:
+            return (double) stmt->exec.query;
+        case SORT_ROWS:
+            return (double) stmt->exec.rows;
+        case SORT_WAIT:
+            return stmt_wait_sec(stmt);
+        case SORT_AVG:
+            return stmt->calls ? stmt->elapsed_sec / stmt->calls : 0;
+    }
+    return 0;
+}
+
+static int
+compare_stmts(const void *a, const void *b)
+{
+    double va = sort_value(*(StmtAgg * const *) a);
+    double vb = sort_value(*(StmtAgg * const *) b);
+
+    return (va < vb) - (va > vb);
+}
+
+static int
+compare_waits(const void *a, const void *b)
+{
+    const WaitAgg *wa = a;
+    const WaitAgg *wb = b;
+
+    return (wa->total_us < wb->total_us) - (wa->total_us > wb->total_us);
+}
+
+static void
+write_phase(FILE *out, const char *label, const PhaseAgg *phase)
+{
+    fprintf(out, "%-7s %6lld %10.4f %10.4f %10lld %10lld %10lld\n",
+            label, phase->count, phase->cpu_sec, phase->ela_sec,
+            phase->disk, phase->query, phase->rows);
+}
+
+static void
+write_stmt(FILE *out, const StmtAgg *stmt, const PtFile *files)
+{
+    PhaseAgg total;
+    int i;
+
+    fprintf(out, "********************************************************************************\n\n");
+    fprintf(out, "SQL_ID: %lld  PLAN_ID: %lld\n\n", stmt->sql_id, stmt->plan_id);
+    if (stmt->sql_text)
+        fprintf(out, "%.*s\n\n", (int) stmt->sql_len, stmt->sql_text);
+    else
+        fprintf(out, "(text not in these files; SELECT pg_trace_sql_text(%lld))\n\n", stmt->sql_id);
+
+    fprintf(out, "call     count        cpu    elapsed       disk      query       rows\n");
+    fprintf(out, "------- ------ ---------- ---------- ---------- ---------- ----------\n");
+    write_phase(out, "Parse", &stmt->parse);
+    write_phase(out, "Bind", &stmt->bind);
+    write_phase(out, "Execute", &stmt->exec);
+    fprintf(out, "------- ------ ---------- ---------- ---------- ---------- ----------\n");
+    memset(&total, 0, sizeof(total));
+    phase_add(&total, &stmt->parse);
+    phase_add(&total, &stmt->bind);
+    phase_add(&total, &stmt->exec);
+    write_phase(out, "total", &total);
+
+    fprintf(out, "\nStatements: %lld  elapsed: %.4f sec  avg: %.6f sec  off-CPU: %.4f sec\n",
+            stmt->calls, stmt->elapsed_sec,
+            stmt->calls ? stmt->elapsed_sec / stmt->calls : 0.0,
+            stmt->offcpu_sec);
+
+    if (stmt->nwaits > 0)
+    {
+        WaitAgg *waits = xcalloc(stmt->nwaits, sizeof(WaitAgg));
+
+        memcpy(waits, stmt->waits, stmt->nwaits * sizeof(WaitAgg));
+        qsort(waits, stmt->nwaits, sizeof(WaitAgg), compare_waits);
+
+        fprintf(out, "\nElapsed times include waiting on following events:\n");
+        fprintf(out, "  Event waited on                             Times   Max. Wait  Total Waited\n");
+        fprintf(out, "  ----------------------------------------   Waited  ----------  ------------\n");
+        for (i = 0; i < stmt->nwaits && i < REPORT_WAITS; i++)
+        {
+            fprintf(out, "  %-40.*s %8lld %11.6f %13.6f%s\n",
+                    waits[i].name_len > 40 ? 40 : waits[i].name_len, waits[i].name,
+                    waits[i].times, waits[i].max_us / 1e6, waits[i].total_us / 1e6,
+                    waits[i].sampled ? "  (sampled)" : "");
+        }
+        free(waits);
+    }
+
+    if (stmt->nworst > 0)
+    {
+        fprintf(out, "\nWorst executions:\n");
+        for (i = 0; i < stmt->nworst; i++)
+        {
+            const Execution *exec = &stmt->worst[i];
+
+            fprintf(out, "  %s #%lld tim=%lld elapsed=%.6f sec cpu=%.6f sec rows=%lld\n",
+                    files[exec->file_index].path, exec->cursor_id, exec->tim,
+                    exec->elapsed_sec, exec->cpu_sec, exec->rows);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <trace_file>...\n"
+            "\n"
+            "  -s key      sort statements by elapsed (default), cpu, calls,\n"
+            "              disk, query, rows, wait or avg\n"
+            "  -n top      statements to report (default %d, 0 for all)\n"
+            "  -j threads  parser threads (default: online CPUs)\n"
+            "  -w worst    slowest executions listed per statement, 1-32 (default %d)\n"
+            "  -o output   write here instead of stdout\n",
+            progname, DEFAULT_TOP, DEFAULT_WORST);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *output = NULL;
+    long top = DEFAULT_TOP;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    PtFile *files;
+    int nfiles;
+    PtChunk *chunks;
+    int nchunks;
+    StmtTable *result;
+    StmtAgg **sorted;
+    size_t nsorted = 0;
+    long long cursors = 0;
+    FILE *out;
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:n:j:w:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                {
+                    int k;
+
+                    for (k = 0; sort_names[k]; k++)
+                    {
+                        if (strcmp(optarg, sort_names[k]) == 0)
+                            break;
+                    }
+                    if (!sort_names[k])
+                        usage();
+                    sort_key = (SortKey) k;
+                }
+                break;
+            case 'n':
+                top = strtol(optarg, NULL, 10);
+                if (top < 0)
+                    usage();
+                break;
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                worst_keep = (int) strtol(optarg, NULL, 10);
+                if (worst_keep < 1 || worst_keep > MAX_WORST)
+                    usage();
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    nfiles = argc - optind;
+    if (nfiles < 1)
+        usage();
+    if (nthreads < 1)
+        nthreads = 1;
+
+    files = xcalloc(nfiles, sizeof(PtFile));
+    for (c = 0; c < nfiles; c++)
+    {
+        if (pt_file_open(&files[c], argv[optind + c]) != 0)
+        {
+            fprintf(stderr, "%s: could not open \"%s\": %s\n",
+                    progname, argv[optind + c], strerror(errno));
+            return 1;
+        }
+    }
+
+    nchunks = pt_split(files, nfiles, CHUNK_SIZE, &chunks);
+    if (nchunks < 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", progname);
+        return 1;
+    }
+    if (nthreads > nchunks)
+        nthreads = nchunks > 0 ? nchunks : 1;
+
+    tables = xcalloc(nthreads, sizeof(StmtTable));
+    pt_parse_threads(chunks, nchunks, (int) nthreads, make_table, aggregate_cursor);
+
+    /* Merge into the first table */
+    result = &tables[0];
+    cursors = result->cursors;
+    for (c = 1; c < nthreads; c++)
+    {
+        for (i = 0; i < tables[c].capacity; i++)
+        {
+            if (tables[c].entries[i].used)
+                merge_stmt(result, &tables[c].entries[i]);
+        }
+        cursors += tables[c].cursors;
+    }
+
+    sorted = xcalloc(result->count + 1, sizeof(StmtAgg *));
+    for (i = 0; i < result->capacity; i++)
+    {
+        if (result->entries[i].used)
+            sorted[nsorted++] = &result->entries[i];
+    }
+    qsort(sorted, nsorted, sizeof(StmtAgg *), compare_stmts);
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (!out)
+        {
+            fprintf(stderr, "%s: could not create \"%s\": %s\n", progname, output, strerror(errno));
+            return 1;
+        }
+    }
+    else
+        out = stdout;
+
+    fprintf(out, "pg_trace_prof: %d file(s), %lld statement executions, %zu distinct statements\n",
+            nfiles, cursors, nsorted);
+    fprintf(out, "sort options: %s\n\n", sort_names[sort_key]);
+
+    for (i = 0; i < nsorted && (top == 0 || (long) i < top); i++)
+        write_stmt(out, sorted[i], files);
+
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: could not write output: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    for (c = 0; c < nfiles; c++)
+        pt_file_close(&files[c]);
+
+    return 0;
+}